@@ -0,0 +1,87 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+namespace metafile {
+
+	// runs tasks of asynchronous operations. implement it to run them on own event loop
+	class Executor
+	{
+	public:
+		virtual ~Executor() {}
+		virtual void Post(const std::function<void()> &task) = 0;
+	};
+
+	// executor with fixed number of threads. destructor completes tasks already posted
+	class IoThreadPool : public Executor
+	{
+	public:
+		explicit IoThreadPool(uint32_t numberOfThreads);
+		~IoThreadPool();
+
+		virtual void Post(const std::function<void()> &task) override;
+
+		// shared pool used when Metafile has no executor set
+		static std::shared_ptr<IoThreadPool> GetDefault();
+
+	private:
+		void Run();
+
+		std::vector<std::thread> m_threads;
+		std::deque< std::function<void()> > m_tasks;
+		std::mutex m_lock;
+		std::condition_variable m_wakeUp;
+		bool m_stop;
+	};
+
+	// copies share state, so caller keeps one copy and passes another to the operation.
+	// operation which has not started yet when cancelled completes with AsyncStatus::Cancelled.
+	// running read or write stops between chunks of 1 MB with Cancelled and the size done so far,
+	// running flush stops after data is flushed, before the table is written
+	class CancellationToken
+	{
+	public:
+		CancellationToken();
+
+		void Cancel();
+		bool IsCancelled() const;
+
+	private:
+		std::shared_ptr< std::atomic<bool> > m_cancelled;
+	};
+
+	enum class AsyncStatus
+	{
+		Ok,
+		Cancelled,
+		Failed
+	};
+
+	struct AsyncResult
+	{
+		AsyncStatus status;
+		uint32_t size;	// bytes transferred
+
+		AsyncResult(AsyncStatus status = AsyncStatus::Ok, uint32_t size = 0) : status(status), size(size) {}
+	};
+
+	// called on executor thread once operation is complete. a coroutine or event loop
+	// resumes from here, future returned by the operation is already ready at this point
+	typedef std::function<void(const AsyncResult &)> AsyncCallback;
+
+} // namespace
@@ -0,0 +1,146 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <vector>
+#include <stdint.h>
+
+namespace metafile {
+
+	// memory of transient i/o buffers, same role as std::pmr::memory_resource.
+	// Metafile takes its copy and staging buffers from one, implement it to give out own memory
+	class BufferResource
+	{
+	public:
+		virtual ~BufferResource() {}
+
+		// nullptr if out of memory. alignment is a power of two
+		virtual void *Allocate(size_t size, size_t alignment) = 0;
+
+		// size and alignment are the ones buffer was allocated with
+		virtual void Deallocate(void *buffer, size_t size, size_t alignment) = 0;
+	};
+
+	// buffers in size classes: granularity, twice that, four times and so on up to maxPooledSize.
+	// released buffers are kept for the next request of the same class, so steady I/O
+	// does not go to the system allocator. thread safe
+	class BufferArena : public BufferResource
+	{
+	public:
+		struct Options
+		{
+			size_t granularity;		// power of two, smallest class. buffers are aligned to it
+			size_t maxPooledSize;	// larger requests go to the system every time
+			size_t maxCachedSize;	// released buffers over this total are freed
+
+			// classes of kHugePageSize and more are mapped with huge pages (MAP_HUGETLB,
+			// MADV_HUGEPAGE, MEM_LARGE_PAGES). normal pages if system has none to give
+			bool hugePages;
+
+			Options() : granularity(4096), maxPooledSize(16 * 1024 * 1024), maxCachedSize(64 * 1024 * 1024), hugePages(false) {}
+		};
+
+		static const size_t kHugePageSize = 2 * 1024 * 1024;
+
+		explicit BufferArena(const Options &options = Options());
+		~BufferArena();
+
+		virtual void *Allocate(size_t size, size_t alignment) override;
+		virtual void Deallocate(void *buffer, size_t size, size_t alignment) override;
+
+		// buffers taken from the system so far, reused ones are not counted
+		uint64_t GetNumberOfSystemAllocations();
+
+	private:
+		BufferArena(const BufferArena &);
+		BufferArena &operator=(const BufferArena &);
+
+		// false if request is not pooled
+		bool GetClass(size_t size, size_t alignment, uint32_t &sizeClass);
+		void *AllocateFromSystem(size_t size, size_t alignment);
+		void FreeToSystem(void *buffer, size_t size, size_t alignment);
+
+		Options m_options;
+		std::mutex m_lock;
+		std::vector< std::vector<void *> > m_free;	// released buffers of every class
+		size_t m_cachedSize;
+		uint64_t m_numberOfSystemAllocations;
+	};
+
+	// buffer of a BufferResource for one scope. Get returns nullptr if out of memory
+	class ScopedBuffer
+	{
+	public:
+		ScopedBuffer(BufferResource &resource, size_t size, size_t alignment = 1)
+			: m_resource(resource)
+			, m_size(size)
+			, m_alignment(alignment)
+			, m_buffer((char *)resource.Allocate(size, alignment))
+		{
+		}
+
+		~ScopedBuffer()
+		{
+			if (m_buffer) m_resource.Deallocate(m_buffer, m_size, m_alignment);
+		}
+
+		char *Get() { return m_buffer; }
+		size_t GetSize() { return m_size; }
+
+	private:
+		ScopedBuffer(const ScopedBuffer &);
+		ScopedBuffer &operator=(const ScopedBuffer &);
+
+		BufferResource &m_resource;
+		size_t m_size;
+		size_t m_alignment;
+		char *m_buffer;
+	};
+
+	// std allocator over BufferResource, so containers can take memory from it too
+	template <class T>
+	class BufferAllocator
+	{
+	public:
+		typedef T value_type;
+
+		explicit BufferAllocator(BufferResource *resource) : m_resource(resource) {}
+
+		template <class U>
+		BufferAllocator(const BufferAllocator<U> &other) : m_resource(other.GetResource()) {}
+
+		T *allocate(size_t n)
+		{
+			void *res = m_resource->Allocate(n * sizeof(T), std::alignment_of<T>::value);
+			if (!res) throw std::bad_alloc();
+			return (T *)res;
+		}
+
+		void deallocate(T *p, size_t n)
+		{
+			m_resource->Deallocate(p, n * sizeof(T), std::alignment_of<T>::value);
+		}
+
+		BufferResource *GetResource() const { return m_resource; }
+
+	private:
+		BufferResource *m_resource;
+	};
+
+	template <class T, class U>
+	bool operator==(const BufferAllocator<T> &a, const BufferAllocator<U> &b) { return a.GetResource() == b.GetResource(); }
+
+	template <class T, class U>
+	bool operator!=(const BufferAllocator<T> &a, const BufferAllocator<U> &b) { return a.GetResource() != b.GetResource(); }
+
+} // namespace
@@ -7,6 +7,7 @@
 */
 
 #pragma once
+#include <atomic>
 #include <cstdio>
 #include "fileaccessinterface.h"
 
@@ -19,6 +20,7 @@ namespace metafile {
 		~DefaultFileAccess();
 
 		virtual void UseFile(const std::string &name) override;
+		virtual void UseFileReadOnly(const std::string &name) override;
 		virtual bool IsValid() override;
 		virtual std::string GetLastError() override;
 		virtual void SetPointerTo(uint64_t offset) override;
@@ -26,10 +28,22 @@ namespace metafile {
 		virtual uint32_t Read(void *buffer, uint32_t bufferSize) override;
 		virtual uint32_t Write(void *buffer, uint32_t bufferSize) override;
 		virtual void Flush() override;
+		virtual bool LockForWriting() override;
+		virtual uint64_t GetFileSize() override;
+		virtual bool Sync() override;
+		virtual uint64_t TransferTo(int fd, uint64_t offset, uint64_t size) override;
+
+		// pwrite, or WriteFile with OVERLAPPED on windows. bypasses stdio buffer
+		virtual uint32_t WriteAt(uint64_t offset, const void *buffer, uint32_t bufferSize) override;
 
 	private:
+		void Close();
+
 		std::string m_error;
 		FILE *m_file;
+		void *m_positionalHandle;				// windows only, own handle so stdio file pointer stays put
+		std::atomic<bool> m_pendingWrites;		// stdio buffer holds written bytes
+		std::atomic<bool> m_positionalWrites;	// WriteAt ran since the last Read
 	};
 
 
@@ -0,0 +1,82 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <atomic>
+#include <memory>
+#include "fileaccessinterface.h"
+
+namespace metafile {
+
+	class AlignedBufferPool;
+
+	// unbuffered access (O_DIRECT, FILE_FLAG_NO_BUFFERING). page cache is bypassed,
+	// so caching decisions are up to the application.
+	// aligned requests go to the device as is, unaligned head and tail are
+	// staged through a pool of aligned bounce buffers.
+	class DirectFileAccess : public FileAccessInterface
+	{
+	public:
+		static const uint32_t kDefaultAlignment = 4096;
+		static const uint32_t kBounceBufferSize = 1024 * 1024;
+
+		// alignment must be a power of two and not less than logical block size of the device
+		explicit DirectFileAccess(uint32_t alignment = kDefaultAlignment);
+		~DirectFileAccess();
+
+		virtual void UseFile(const std::string &name) override;
+		virtual void UseFileReadOnly(const std::string &name) override;
+		virtual bool IsValid() override;
+		virtual std::string GetLastError() override;
+		virtual void SetPointerTo(uint64_t offset) override;
+		virtual void SetFileSize(uint64_t) override;
+		virtual uint32_t Read(void *buffer, uint32_t bufferSize) override;
+		virtual uint32_t Write(void *buffer, uint32_t bufferSize) override;
+		virtual void Flush() override;
+		virtual bool LockForWriting() override;
+		virtual uint64_t GetFileSize() override;
+		virtual bool Sync() override;
+		virtual uint32_t GetAlignment() override;
+
+		// aligned offset, size and buffer only, others return 0 and go through Write
+		virtual uint32_t WriteAt(uint64_t offset, const void *buffer, uint32_t bufferSize) override;
+
+	private:
+		uint32_t Transfer(char *buffer, uint32_t size, bool write);
+		void Open(const std::string &name, bool readOnly);
+		void Close();
+		void SetError(const std::string &message);
+		void GrowFileSize(uint64_t end);
+
+		std::string m_error;
+		intptr_t m_file;	// HANDLE on windows, descriptor elsewhere. -1 if not opened
+		uint64_t m_position;
+		std::atomic<uint64_t> m_fileSize;	// aligned writes may leave file longer, it's trimmed on flush
+		uint32_t m_alignment;
+		std::unique_ptr<AlignedBufferPool> m_bounceBuffers;
+	};
+
+
+	class DirectFileAccessFactory : public FileAccessInterfaceAbstractFactory
+	{
+	public:
+		explicit DirectFileAccessFactory(uint32_t alignment = DirectFileAccess::kDefaultAlignment)
+			: m_alignment(alignment)
+		{
+		}
+
+		std::shared_ptr<FileAccessInterface> CreateFile()
+		{
+			return std::make_shared<DirectFileAccess>(m_alignment);
+		}
+
+	private:
+		uint32_t m_alignment;
+	};
+
+} // namespace
@@ -19,6 +19,10 @@ namespace metafile {
 		virtual ~FileAccessInterface(){};
 
 		virtual void UseFile(const std::string &name) = 0;
+
+		// opens existing file for reading only, never creates it.
+		// backend which can't do that opens it like UseFile, metafile does not write through it anyway
+		virtual void UseFileReadOnly(const std::string &name) { UseFile(name); }
 		virtual bool IsValid() = 0;
 		virtual std::string GetLastError() = 0;
 		virtual void SetPointerTo(uint64_t offset) = 0;
@@ -26,6 +30,39 @@ namespace metafile {
 		virtual uint32_t Read(void *buffer, uint32_t bufferSize) = 0;
 		virtual uint32_t Write(void *buffer, uint32_t bufferSize) = 0;
 		virtual void Flush() = 0;
+
+		// moves size bytes starting at offset straight into descriptor fd, bypassing user space.
+		// returns number of bytes moved. backends which are not descriptor based return 0,
+		// caller falls back to Read.
+		virtual uint64_t TransferTo(int fd, uint64_t offset, uint64_t size) { return 0; }
+
+		// positional write which may run in many threads at once and does not move the pointer.
+		// backends which can't do that return 0, caller falls back to SetPointerTo and Write under a lock
+		virtual uint32_t WriteAt(uint64_t offset, const void *buffer, uint32_t bufferSize) { return 0; }
+
+		// offsets and sizes which are multiple of this value are served without extra copies.
+		// metafile aligns its data region and clusters to it.
+		virtual uint32_t GetAlignment() { return 1; }
+
+		// advisory lock of the writer, held until the file is closed. false if another handle,
+		// in this or another process, holds it. backends without locks always succeed
+		virtual bool LockForWriting() { return true; }
+
+		// current size of the file, 0 if backend can't tell
+		virtual uint64_t GetFileSize() { return 0; }
+
+		// waits until data passed to Flush is on the disk, not only in os cache (fdatasync).
+		// may run in another thread together with Read and Write. backends without durable storage succeed
+		virtual bool Sync() { return true; }
+
+		// for reading in place: points data at the bytes from offset on and returns how many of
+		// size bytes are there in one piece. 0 if backend does not keep the file in memory.
+		// memory is valid until the next Write or SetFileSize of any handle
+		virtual uint64_t GetMappedData(uint64_t offset, uint64_t size, const char *&data) { return 0; }
+
+		// for writing in place: same as GetMappedData, but memory is writable and the file
+		// grows to cover it at once. 0 if backend does not keep the file in memory
+		virtual uint64_t GetWritableData(uint64_t offset, uint64_t size, char *&data) { return 0; }
 	};
 
 
@@ -7,12 +7,18 @@
 */
 
 #pragma once
+#include <functional>
+#include <future>
 #include <string>
 #include <vector>
 #include <stdint.h>
+#include "asyncio.h"
+#include "streamprofile.h"
 
 namespace metafile {
 	
+	class MetafileImpl;
+
 	class FileThread
 	{
 	public:
@@ -25,8 +31,64 @@ namespace metafile {
 		uint32_t Write(void *data, uint32_t size);
 		uint32_t Read(void *data, uint32_t size);
 
+		// zero terminated, valid as long as Metafile is valid
+		const char *GetNameRef();
+
+		// size bytes at offset, any size. do not move the pointer and do not allocate
+		// in steady state. return number of bytes transferred
+		uint64_t ReadAt(uint64_t offset, void *data, uint64_t size);
+		uint64_t WriteAt(uint64_t offset, const void *data, uint64_t size);
+
 		void SetPointerTo(uint64_t pos);
 
+		// two phase Write for producers which build data in place. BeginWrite gives up to size
+		// writable bytes at the pointer, available says how many, nullptr on error. they are
+		// memory of the backend if it keeps the file in memory and the block is own, nothing
+		// is copied then. otherwise they are a buffer of the stream, copied once on commit.
+		// CommitWrite stores first used bytes of them as Write does, moves the pointer and
+		// updates size, the rest is dropped. nothing else may change the stream or move its
+		// pointer in between. false if there is nothing to commit or it failed
+		char *BeginWrite(uint32_t size, uint32_t &available);
+		bool CommitWrite(uint32_t used);
+
+		// cluster size is the actual one, never 0
+		StreamProfile GetProfile();
+
+		// allocates space for size bytes without changing the size of stream.
+		// streams reserved one after another are laid out one after another
+		void Reserve(uint64_t size);
+
+		static const uint64_t kAppendFailed = ~0ull;
+
+		// adds size bytes at the end of stream and returns their offset, kAppendFailed on error.
+		// many threads may append to the same stream at once: space is reserved atomically and
+		// copies run in parallel if FileAccessInterface has WriteAt. GetSize, and Read of this
+		// stream, see only the prefix which is completely written. other calls must not run
+		// concurrently with appends. does not move the pointer. once a range fails, appends
+		// after it fail too, until Write, BeginWrite, SetSize or cloning of the stream starts them over
+		uint64_t Append(const void *data, uint32_t size);
+
+		// gets offset in stream of data[0] and a read-only piece of the stream. returns false to stop
+		typedef std::function<bool(uint64_t offset, const char *data, size_t size)> ScanVisitor;
+
+		// hands size bytes from offset on to visitor in order, without copying them to the caller.
+		// pieces never cross a block. they point into memory of the backend if it keeps the file
+		// in memory, into an internal buffer otherwise, and are valid only during the call.
+		// visitor must not change the stream. does not move the pointer. returns bytes visited
+		uint64_t Scan(uint64_t offset, uint64_t size, const ScanVisitor &visitor);
+
+		// writes size bytes starting at offset to descriptor fd (file or socket).
+		// does not move the pointer. returns number of bytes written.
+		uint64_t ExportTo(int fd, uint64_t offset, uint64_t size);
+
+		// same as SetPointerTo(offset) and Read/Write, but run on executor of Metafile
+		// without blocking the caller. data must stay valid until operation completes.
+		// operations of one Metafile run in the order they were started
+		std::future<AsyncResult> ReadAsync(uint64_t offset, void *data, uint32_t size,
+			const AsyncCallback &callback = AsyncCallback(), const CancellationToken &token = CancellationToken());
+		std::future<AsyncResult> WriteAsync(uint64_t offset, const void *data, uint32_t size,
+			const AsyncCallback &callback = AsyncCallback(), const CancellationToken &token = CancellationToken());
+
 	private:
 		friend class MetafileImpl;
 
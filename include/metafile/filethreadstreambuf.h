@@ -0,0 +1,68 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <iostream>
+#include <streambuf>
+#include <vector>
+#include "filethread.h"
+
+namespace metafile {
+
+	// std::streambuf over FileThread, so iostreams and serializers can work with streams.
+	// one buffer serves either reading or writing, like std::filebuf.
+	// transfers of at least buffer size go straight to FileThread.
+	// owns the pointer of FileThread, don't mix with direct Read/Write calls without pubsync
+	class FileThreadStreambuf : public std::streambuf
+	{
+	public:
+		static const size_t kDefaultBufferSize = 64 * 1024;
+
+		explicit FileThreadStreambuf(FileThread *thread, size_t bufferSize = kDefaultBufferSize);
+		~FileThreadStreambuf();
+
+	protected:
+		virtual int_type underflow() override;
+		virtual int_type overflow(int_type c) override;
+		virtual int sync() override;
+		virtual std::streamsize showmanyc() override;
+		virtual std::streamsize xsgetn(char *s, std::streamsize n) override;
+		virtual std::streamsize xsputn(const char *s, std::streamsize n) override;
+		virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+			std::ios_base::openmode which = std::ios_base::in | std::ios_base::out) override;
+		virtual pos_type seekpos(pos_type pos,
+			std::ios_base::openmode which = std::ios_base::in | std::ios_base::out) override;
+
+	private:
+		uint64_t GetPosition();
+		bool FlushPutArea();
+		void DropGetArea();
+
+		FileThread *m_thread;
+		std::vector<char> m_buffer;
+
+		// offset in stream of m_buffer[0]
+		uint64_t m_bufferStart;
+	};
+
+	// iostream which owns its FileThreadStreambuf
+	class FileThreadStream : public std::iostream
+	{
+	public:
+		explicit FileThreadStream(FileThread *thread, size_t bufferSize = FileThreadStreambuf::kDefaultBufferSize)
+			: std::iostream(nullptr)
+			, m_buffer(thread, bufferSize)
+		{
+			rdbuf(&m_buffer);
+		}
+
+	private:
+		FileThreadStreambuf m_buffer;
+	};
+
+} // namespace
@@ -0,0 +1,81 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <memory>
+#include "fileaccessinterface.h"
+
+namespace metafile {
+
+	struct MemoryImage;
+	class MemoryImageRegistry;
+
+	// keeps the whole container in RAM as a list of fixed size chunks.
+	// image is identified by the name given to UseFile and lives as long as the factory
+	// which created it, so the same name can be opened again later.
+	class MemoryFileAccess : public FileAccessInterface
+	{
+	public:
+		static const uint32_t kChunkSize = 1024 * 1024;
+
+		explicit MemoryFileAccess(const std::shared_ptr<MemoryImageRegistry> &registry);
+		~MemoryFileAccess();
+
+		virtual void UseFile(const std::string &name) override;
+		virtual void UseFileReadOnly(const std::string &name) override;
+		virtual bool IsValid() override;
+		virtual std::string GetLastError() override;
+		virtual void SetPointerTo(uint64_t offset) override;
+		virtual void SetFileSize(uint64_t) override;
+		virtual uint32_t Read(void *buffer, uint32_t bufferSize) override;
+		virtual uint32_t Write(void *buffer, uint32_t bufferSize) override;
+		virtual void Flush() override;
+		virtual bool LockForWriting() override;
+		virtual uint64_t GetFileSize() override;
+		virtual uint32_t WriteAt(uint64_t offset, const void *buffer, uint32_t bufferSize) override;
+		virtual uint64_t GetMappedData(uint64_t offset, uint64_t size, const char *&data) override;
+		virtual uint64_t GetWritableData(uint64_t offset, uint64_t size, char *&data) override;
+
+		// image is stored as is, so saved file can be opened by DefaultFileAccess.
+		// flush Metafile before saving, otherwise headers on disk are stale
+		bool SaveTo(const std::string &path);
+		bool LoadFrom(const std::string &path);
+
+	private:
+		std::shared_ptr<MemoryImageRegistry> m_registry;
+		std::shared_ptr<MemoryImage> m_image;
+		std::string m_error;
+		uint64_t m_position;
+		bool m_locked;	// this handle holds writerLocked of the image
+
+		void Unlock();
+	};
+
+
+	class MemoryFileAccessFactory : public FileAccessInterfaceAbstractFactory
+	{
+	public:
+		MemoryFileAccessFactory();
+
+		std::shared_ptr<FileAccessInterface> CreateFile()
+		{
+			return std::make_shared<MemoryFileAccess>(m_registry);
+		}
+
+		// same as MemoryFileAccess::SaveTo/LoadFrom for image called name
+		bool SaveTo(const std::string &name, const std::string &path);
+		bool LoadFrom(const std::string &name, const std::string &path);
+
+		// drops image, memory is released once last user closes it
+		void Remove(const std::string &name);
+
+	private:
+		std::shared_ptr<MemoryImageRegistry> m_registry;
+	};
+
+} // namespace
@@ -7,16 +7,84 @@
 */
 
 #pragma once
+#include <future>
 #include <memory>
 #include <string>
 #include <vector>
+#include "asyncio.h"
+#include "bufferarena.h"
 #include "fileaccessinterface.h"
+#include "streamprofile.h"
 
 namespace metafile {
 
 	class FileThread;
 	class MetafileImpl;
 
+	struct ReadRequest
+	{
+		FileThread *thread;
+		void *data;
+		uint64_t size;		// bytes to read from the beginning of stream, data must hold that much
+		uint64_t bytesRead;	// set by ReadMany, less than size if stream is shorter
+	};
+
+	struct VerifyOptions
+	{
+		// read every block too, not only the table: finds unreadable blocks and checks
+		// content of deduplicated blocks against their fingerprints
+		bool readBlocks;
+
+		// threads reading blocks, each with own handle of the file. 0 - one per core
+		uint32_t numberOfThreads;
+
+		// rebuild reference counts and fingerprint index from the table, cut unused
+		// space after the last block and save. ignored if file is read-only
+		bool repair;
+
+		VerifyOptions() : readBlocks(false), numberOfThreads(0), repair(false) {}
+	};
+
+	struct VerifyReport
+	{
+		std::vector<std::string> problems;	// one line each, repaired ones included
+		uint32_t numberOfRepaired;
+		uint64_t leakedSize;				// bytes after the table not used by any block
+		uint64_t scannedSize;				// bytes of blocks read by readBlocks
+		uint64_t numberOfFragments;			// pieces streams are in, stream in one piece is one
+
+		VerifyReport() : numberOfRepaired(0), leakedSize(0), scannedSize(0), numberOfFragments(0) {}
+	};
+
+	// Metafile::StartBackgroundFlush. table is saved when any of the limits is reached,
+	// 0 turns a limit off. with all of them off it is saved only by Flush
+	struct FlushPolicy
+	{
+		uint32_t intervalMs;	// while anything is not saved, at least this often
+		uint64_t dirtyBytes;	// after this many bytes are written
+		uint32_t idleMs;		// after nothing was written for about this long
+
+		// wait for the disk (fdatasync), not only hand data to the os: data is synced before
+		// the table is written, so table on the disk never points to lost blocks, and the
+		// table after it. writers wait for the first sync only
+		bool sync;
+
+		FlushPolicy() : intervalMs(1000), dirtyBytes(0), idleMs(0), sync(true) {}
+	};
+
+	// kind of the last error, GetLastError has the details
+	enum class ErrorCode
+	{
+		None,
+		IoError,			// FileAccessInterface failed, "File not found", etc.
+		NotMetafile,
+		UnsupportedFormat,	// newer format version or unknown stream profile
+		Damaged,			// table or internal streams are inconsistent
+		BaseMismatch,		// overlay and its base container do not match
+		InvalidOptions,		// CreateOptions or stream names can't be used
+		Locked				// another single writer has the file
+	};
+
 	class Metafile
 	{
 	public:
@@ -28,18 +96,92 @@ namespace metafile {
 
 		// "File not found", etc.
 		std::string GetLastError();
+		ErrorCode GetLastErrorCode();
 
 		//FileThread* is valid as long as Metafile is valid
 		std::vector<FileThread *> GetAllFileThreads();
 		FileThread* GetFileThread(const std::string &name);
+
+		// same as above without allocations. list is owned by Metafile and grows
+		// when streams are added, so iterators are valid until then
+		const std::vector<FileThread *> &GetFileThreadList();
+		FileThread* GetFileThread(const char *name, size_t length);
+
+		// saves the table. with background flush it waits until everything written
+		// before the call is saved, and synced if policy says so
 		void Flush();
 
+		// table is saved and synced by a thread of this file as the policy says, writers
+		// don't wait for the disk. calls of this file and its streams take a lock meanwhile.
+		// false if file is read-only or invalid. starting again replaces the policy
+		bool StartBackgroundFlush(const FlushPolicy &policy = FlushPolicy());
+
+		// saves what is not saved yet and stops the thread. destructor does the same
+		void StopBackgroundFlush();
+
+		// reader of a file which another process writes: loads streams flushed by the writer
+		// since open or last Refresh. costs one header read if nothing changed.
+		// FileThread pointers stay valid, new streams are added.
+		// reads go by the table of the last Refresh. blocks which the writer moved or freed
+		// after that (table growth, released reservations) may hold other data already,
+		// so a reader must Refresh after the writer flushes before it trusts what it reads
+		bool Refresh();
+
+		// loads many streams at once. pieces of all streams are read in file order,
+		// close pieces are merged into large reads spread over numberOfThreads threads,
+		// 0 means one per core. stream pointers are not moved. returns false if any read failed
+		bool ReadMany(std::vector<ReadRequest> &requests, uint32_t numberOfThreads = 0);
+
+		// executor of async operations of this file and its streams. IoThreadPool::GetDefault() if not set.
+		// operations of one file run one at a time in the order they were started, whatever the
+		// executor, so a long one delays the rest. files opened separately run in parallel.
+		// blocking calls must not be made while async operations are in flight
+		void SetExecutor(const std::shared_ptr<Executor> &executor);
+		std::future<AsyncResult> FlushAsync(const AsyncCallback &callback = AsyncCallback(),
+			const CancellationToken &token = CancellationToken());
+
+		// memory of transient buffers of this file: copies of shared and base blocks, export,
+		// block checks. own BufferArena with classes of cluster size unless set, user buffers
+		// may come from it too. must be set before streams are used
+		void SetBufferResource(const std::shared_ptr<BufferResource> &resource);
+		std::shared_ptr<BufferResource> GetBufferResource();
+
+		// new stream which shares all blocks with source, no data is copied.
+		// shared block is copied when either stream writes to it.
+		// returns nullptr if source does not exist, newName is taken or file is an overlay
+		FileThread* CloneFileThread(const std::string &source, const std::string &newName);
+
+		// point in time copy of every stream as CloneFileThread(name, name + suffix).
+		// streams made by Snapshot are not included in next snapshots
+		bool Snapshot(const std::string &suffix);
+
+		// rewrites table of a file made by older version in the compact format, in place.
+		// older versions take the file for a foreign one afterwards and don't open it.
+		// does nothing if format is current
+		bool UpgradeFormat();
+
+		// writes visible streams to a new read-only container at outputPath, made with the
+		// same backend: each stream in one piece aligned to pages, names in a sorted index.
+		// OpenFile reads its table at once and reads go straight to file offsets.
+		// it can't be written or used as a base, this file does not change
+		bool Seal(const std::string &outputPath);
+
+		// checks that the container is consistent: header, blocks within data region
+		// which never overlap except shared ones, sizes, reference counts and fingerprints.
+		// true if no problems are left. must not run together with other calls
+		bool Verify(VerifyReport &report, const VerifyOptions &options = VerifyOptions());
+
 	private:
 		std::shared_ptr<MetafileImpl> m_impl;
 
 		void SetFileAccessInterface(const std::shared_ptr<FileAccessInterface> &file);
+		void SetReaderSource(const std::shared_ptr<FileAccessInterfaceAbstractFactory> &factory, const std::string &path);
+		void SetReadOnly();
+		void SetSingleWriter();
 		void Init();
-		void InitEmpty(const std::vector<std::string> &threadNames);
+		void InitEmpty(const std::vector<std::string> &threadNames, const CreateOptions &options);
+		void SetBaseFileAccessInterface(const std::shared_ptr<FileAccessInterface> &base);
+		void InitOverlay();
 
 		friend class MetafileLib;
 	};
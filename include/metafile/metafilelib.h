@@ -13,9 +13,22 @@
 #include "fileaccessinterface.h"
 #include "filethread.h"
 #include "metafile.h"
+#include "streamprofile.h"
 
 namespace metafile {
 
+	enum class OpenMode
+	{
+		ReadWrite,
+		// file is opened for reading only and never created. writes, SetSize, clones and
+		// snapshots fail, Flush and close write nothing. works on read-only media.
+		// Metafile::Refresh follows changes made by a SingleWriter
+		ReadOnly,
+		// like ReadWrite, but takes advisory lock of the writer, opening fails if it's taken.
+		// readers in other processes see a consistent table after each flush
+		SingleWriter
+	};
+
 	class MetafileLib
 	{
 	public:
@@ -25,16 +38,28 @@ namespace metafile {
 
 		// never returns null.
 		// call like CreateNewFile("c:\\test.dat", {"data1", "data2"});
+		// options choose cluster size and block growth, per stream or for all of them
 		std::shared_ptr<Metafile> CreateNewFile(const std::string &path,
-			const std::vector<std::string> &threadNames);
+			const std::vector<std::string> &threadNames, const CreateOptions &options = CreateOptions());
+
+		// never returns null.
+		// call like OpenFile("c:\\test.dat");
+		std::shared_ptr<Metafile> OpenFile(const std::string &path, OpenMode mode = OpenMode::ReadWrite);
+
+		// never returns null.
+		// writable copy-on-write view of container basePath. base is only read,
+		// changed clusters are stored in path. base must not change while overlay exists.
+		std::shared_ptr<Metafile> CreateOverlay(const std::string &path, const std::string &basePath);
 
 		// never returns null.
-		// call like CreateNewFile("c:\\test.dat");
-		std::shared_ptr<Metafile> OpenFile(const std::string &path);
+		// opens overlay created by CreateOverlay, basePath must point to the same base.
+		// fails with ErrorCode::BaseMismatch if the base table is not the one overlay was made over.
+		std::shared_ptr<Metafile> OpenOverlay(const std::string &path, const std::string &basePath);
 
 	private:
 		std::shared_ptr<FileAccessInterfaceAbstractFactory> m_AccessFactory;
-		std::shared_ptr<Metafile> OpenInternal(const std::string &path);
+		std::shared_ptr<Metafile> OpenInternal(const std::string &path, OpenMode mode = OpenMode::ReadWrite);
+		std::shared_ptr<FileAccessInterface> OpenBase(const std::string &basePath);
 	};
 
 } // namespace
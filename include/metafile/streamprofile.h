@@ -0,0 +1,93 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <map>
+#include <string>
+#include <stdint.h>
+
+namespace metafile {
+
+	// how sizes of consecutive blocks of a stream grow
+	enum class BlockGrowth
+	{
+		Default,	// 1, 2, 3, 4 clusters, then alternately *3/2 and *4/3
+		Fixed,		// every block is the same
+		Geometric,	// every block is ratio times bigger than previous
+		SizeHint	// first block holds expected size, next ones double
+	};
+
+	// allocation profile of one stream, stored in the container.
+	// stream has a limited number of blocks, so small fixed blocks also limit its size
+	struct StreamProfile
+	{
+		// power of two from 512 bytes to 1 GB, 0 - cluster of container.
+		// rounded up to alignment of FileAccessInterface
+		uint32_t clusterSize;
+		BlockGrowth growth;
+
+		// Fixed: clusters per block, up to 65535.
+		// Geometric: ratio * 256, from 256 to 65535, e.g. 512 doubles every block.
+		// SizeHint: expected size of stream in bytes
+		uint64_t parameter;
+
+		StreamProfile()
+			: clusterSize(0)
+			, growth(BlockGrowth::Default)
+			, parameter(0)
+		{
+		}
+
+		static StreamProfile Fixed(uint32_t clustersPerBlock, uint32_t clusterSize = 0)
+		{
+			return StreamProfile(BlockGrowth::Fixed, clustersPerBlock, clusterSize);
+		}
+
+		static StreamProfile Geometric(double ratio, uint32_t clusterSize = 0)
+		{
+			return StreamProfile(BlockGrowth::Geometric, (uint64_t)(ratio * 256 + 0.5), clusterSize);
+		}
+
+		static StreamProfile SizeHint(uint64_t expectedSize, uint32_t clusterSize = 0)
+		{
+			return StreamProfile(BlockGrowth::SizeHint, expectedSize, clusterSize);
+		}
+
+	private:
+		StreamProfile(BlockGrowth growth, uint64_t parameter, uint32_t clusterSize)
+			: clusterSize(clusterSize)
+			, growth(growth)
+			, parameter(parameter)
+		{
+		}
+	};
+
+	struct CreateOptions
+	{
+		// cluster of container, 0 - 4 KB. rounded up to alignment of FileAccessInterface
+		uint32_t clusterSize;
+
+		// profile of streams not listed in profiles
+		StreamProfile defaultProfile;
+		std::map<std::string, StreamProfile> profiles;
+
+		// streams up to this size are packed together into shared slabs and get
+		// own blocks once they grow. 0 - off, at most 64 KB
+		uint32_t smallStreamSize;
+
+		// 0 - current. 1 - fixed 1 KB table entry per stream, readable by older versions
+		uint32_t formatVersion;
+
+		// whole blocks with the same content are stored once and shared between streams,
+		// writing them again costs a hash and a compare. works best with Fixed profiles
+		bool deduplicate;
+
+		CreateOptions() : clusterSize(0), smallStreamSize(0), formatVersion(0), deduplicate(false) {}
+	};
+
+} // namespace
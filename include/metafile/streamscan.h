@@ -0,0 +1,38 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include "filethread.h"
+#include <stdint.h>
+
+namespace metafile {
+
+	// stream helpers on top of FileThread::Scan. they don't move the pointer and need
+	// no memory proportional to the stream
+
+	const uint64_t kNotFound = ~0ull;
+
+	// offset of the first value at or after offset, kNotFound if there is none
+	uint64_t FindByte(FileThread &thread, uint64_t offset, char value);
+
+	// offset of the first occurrence of pattern at or after offset, also one which crosses blocks
+	uint64_t FindPattern(FileThread &thread, uint64_t offset, const void *pattern, size_t size);
+
+	// number of '\n' in the stream
+	uint64_t CountLines(FileThread &thread);
+
+	// crc-32 of zlib and png over size bytes from offset on
+	uint32_t ComputeCrc32(FileThread &thread, uint64_t offset = 0, uint64_t size = ~0ull);
+
+	// same on plain memory. sse2 where the compiler targets it
+	size_t CountByte(const char *data, size_t size, char value);
+
+	// crc of previous data and this one. start with 0
+	uint32_t UpdateCrc32(uint32_t crc, const void *data, size_t size);
+
+} // namespace
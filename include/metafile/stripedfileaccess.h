@@ -0,0 +1,114 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "defaultfileaccess.h"
+#include "fileaccessinterface.h"
+
+namespace metafile {
+
+	class StripeWorker;
+
+	struct StripeMember
+	{
+		// member file is pathPrefix + name given to UseFile, like "/mnt/disk1/"
+		std::string pathPrefix;
+
+		// share of stripes which go to this member. equal weights give round robin,
+		// weights proportional to free space fill members evenly
+		uint32_t weight;
+	};
+
+	// one logical file spread over several member files in stripes of fixed size.
+	// requests which span several members run on all of them in parallel,
+	// one I/O thread per member. requests of many threads take turns.
+	class StripedFileAccess : public FileAccessInterface
+	{
+	public:
+		StripedFileAccess(const std::vector< std::shared_ptr<FileAccessInterface> > &memberAccess,
+			const std::vector<StripeMember> &members, uint32_t stripeSize);
+		~StripedFileAccess();
+
+		virtual void UseFile(const std::string &name) override;
+		virtual void UseFileReadOnly(const std::string &name) override;
+		virtual bool IsValid() override;
+		virtual std::string GetLastError() override;
+		virtual void SetPointerTo(uint64_t offset) override;
+		virtual void SetFileSize(uint64_t) override;
+		virtual uint32_t Read(void *buffer, uint32_t bufferSize) override;
+		virtual uint32_t Write(void *buffer, uint32_t bufferSize) override;
+		virtual void Flush() override;
+		virtual bool LockForWriting() override;
+		virtual uint64_t TransferTo(int fd, uint64_t offset, uint64_t size) override;
+		virtual uint32_t GetAlignment() override;
+		virtual bool Sync() override;
+
+	private:
+		struct Segment
+		{
+			uint32_t member;
+			uint64_t offsetInMember;
+			uint32_t offsetInBuffer;
+			uint32_t size;
+		};
+
+		void SplitToSegments(uint64_t offset, uint32_t size, std::vector<Segment> &segments);
+		uint64_t GetMemberSize(uint32_t member, uint64_t logicalSize);
+		uint32_t Transfer(char *buffer, uint32_t size, bool write);
+
+		std::vector< std::shared_ptr<FileAccessInterface> > m_members;
+		std::vector<StripeMember> m_config;
+		std::vector< std::unique_ptr<StripeWorker> > m_workers;
+		std::mutex m_transferLock;	// workers run one request at a time, guards m_position
+
+		// stripe number i goes to member m_pattern[i % m_pattern.size()],
+		// it's m_slotRank[i % m_pattern.size()]-th stripe of the member in that cycle
+		std::vector<uint32_t> m_pattern;
+		std::vector<uint32_t> m_slotRank;
+
+		uint32_t m_stripeSize;
+		uint64_t m_position;
+		std::string m_error;
+	};
+
+
+	class StripedFileAccessFactory : public FileAccessInterfaceAbstractFactory
+	{
+	public:
+		static const uint32_t kDefaultStripeSize = 1024 * 1024;
+
+		StripedFileAccessFactory(const std::vector<StripeMember> &members, uint32_t stripeSize = kDefaultStripeSize,
+			const std::shared_ptr<FileAccessInterfaceAbstractFactory> &memberFactory
+			= std::shared_ptr<DefaultFileAccessFactory>(new DefaultFileAccessFactory()))
+			: m_members(members)
+			, m_stripeSize(stripeSize)
+			, m_memberFactory(memberFactory)
+		{
+		}
+
+		std::shared_ptr<FileAccessInterface> CreateFile()
+		{
+			std::vector< std::shared_ptr<FileAccessInterface> > memberAccess;
+			for (size_t i = 0; i < m_members.size(); i++)
+			{
+				memberAccess.push_back(m_memberFactory->CreateFile());
+			}
+
+			return std::make_shared<StripedFileAccess>(memberAccess, m_members, m_stripeSize);
+		}
+
+	private:
+		std::vector<StripeMember> m_members;
+		uint32_t m_stripeSize;
+		std::shared_ptr<FileAccessInterfaceAbstractFactory> m_memberFactory;
+	};
+
+} // namespace
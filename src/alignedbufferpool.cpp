@@ -0,0 +1,75 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "alignedbufferpool.h"
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+namespace metafile
+{
+	static char *AllocateAligned(uint32_t alignment, uint32_t size)
+	{
+#ifdef _WIN32
+		return (char *)_aligned_malloc(size, alignment);
+#else
+		void *res = nullptr;
+		if (posix_memalign(&res, alignment, size) != 0) return nullptr;
+		return (char *)res;
+#endif
+	}
+
+	static void FreeAligned(char *buffer)
+	{
+#ifdef _WIN32
+		_aligned_free(buffer);
+#else
+		free(buffer);
+#endif
+	}
+
+	AlignedBufferPool::AlignedBufferPool(uint32_t alignment, uint32_t bufferSize)
+		: m_alignment(alignment)
+		, m_bufferSize((bufferSize + alignment - 1) / alignment * alignment)
+	{
+	}
+
+	AlignedBufferPool::~AlignedBufferPool()
+	{
+		for (auto buffer : m_free)
+		{
+			FreeAligned(buffer);
+		}
+	}
+
+	char *AlignedBufferPool::Acquire()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			if (!m_free.empty())
+			{
+				char *res = m_free.back();
+				m_free.pop_back();
+				return res;
+			}
+		}
+
+		return AllocateAligned(m_alignment, m_bufferSize);
+	}
+
+	void AlignedBufferPool::Release(char *buffer)
+	{
+		if (!buffer) return;
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_free.push_back(buffer);
+	}
+
+} // namespace
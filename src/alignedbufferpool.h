@@ -0,0 +1,40 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+
+namespace metafile {
+
+	// fixed size buffers aligned to device block size.
+	// buffers are kept after release, so steady state I/O does not allocate.
+	class AlignedBufferPool
+	{
+	public:
+		AlignedBufferPool(uint32_t alignment, uint32_t bufferSize);
+		~AlignedBufferPool();
+
+		uint32_t GetBufferSize() { return m_bufferSize; }
+
+		// returns nullptr if out of memory
+		char *Acquire();
+		void Release(char *buffer);
+
+	private:
+		AlignedBufferPool(const AlignedBufferPool &);
+		AlignedBufferPool &operator=(const AlignedBufferPool &);
+
+		uint32_t m_alignment;
+		uint32_t m_bufferSize;
+		std::mutex m_lock;
+		std::vector<char *> m_free;
+	};
+
+} // namespace
@@ -0,0 +1,92 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "asyncio.h"
+#include <algorithm>
+#include <assert.h>
+
+namespace metafile
+{
+	IoThreadPool::IoThreadPool(uint32_t numberOfThreads)
+		: m_stop(false)
+	{
+		assert(numberOfThreads != 0);
+
+		for (uint32_t i = 0; i < numberOfThreads; i++)
+		{
+			m_threads.push_back(std::thread(&IoThreadPool::Run, this));
+		}
+	}
+
+	IoThreadPool::~IoThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_stop = true;
+		}
+
+		m_wakeUp.notify_all();
+		for (auto &thread : m_threads) thread.join();
+	}
+
+	void IoThreadPool::Post(const std::function<void()> &task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_tasks.push_back(task);
+		}
+
+		m_wakeUp.notify_one();
+	}
+
+	void IoThreadPool::Run()
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		while (true)
+		{
+			m_wakeUp.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+			if (m_tasks.empty()) return;
+
+			std::function<void()> task;
+			task.swap(m_tasks.front());
+			m_tasks.pop_front();
+
+			lock.unlock();
+			task();
+			lock.lock();
+		}
+	}
+
+	// function level statics are not thread safe in vs2013
+	static std::mutex g_defaultPoolLock;
+	static std::shared_ptr<IoThreadPool> g_defaultPool;
+
+	std::shared_ptr<IoThreadPool> IoThreadPool::GetDefault()
+	{
+		std::lock_guard<std::mutex> lock(g_defaultPoolLock);
+		if (!g_defaultPool) g_defaultPool = std::make_shared<IoThreadPool>(std::max(2u, std::thread::hardware_concurrency()));
+		return g_defaultPool;
+	}
+
+	CancellationToken::CancellationToken()
+		: m_cancelled(std::make_shared< std::atomic<bool> >(false))
+	{
+	}
+
+	void CancellationToken::Cancel()
+	{
+		*m_cancelled = true;
+	}
+
+	bool CancellationToken::IsCancelled() const
+	{
+		return *m_cancelled;
+	}
+
+} // namespace
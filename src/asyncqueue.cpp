@@ -0,0 +1,74 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "asyncqueue.h"
+#include <assert.h>
+
+namespace metafile
+{
+	AsyncQueue::AsyncQueue(const std::shared_ptr<Executor> &executor)
+		: m_executor(executor)
+		, m_scheduled(false)
+	{
+		assert(m_executor);
+	}
+
+	void AsyncQueue::SetExecutor(const std::shared_ptr<Executor> &executor)
+	{
+		assert(executor);
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_executor = executor;
+	}
+
+	void AsyncQueue::Post(const std::function<void()> &task)
+	{
+		std::shared_ptr<Executor> executor;
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_tasks.push_back(task);
+			if (m_scheduled) return;
+
+			m_scheduled = true;
+			executor = m_executor;
+		}
+
+		auto self = shared_from_this();
+		executor->Post([self] { self->Drain(); });
+	}
+
+	void AsyncQueue::Drain()
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		for (uint32_t i = 0; i < kBatchSize && !m_tasks.empty(); i++)
+		{
+			std::function<void()> task;
+			task.swap(m_tasks.front());
+			m_tasks.pop_front();
+
+			lock.unlock();
+			task();
+			lock.lock();
+		}
+
+		if (m_tasks.empty())
+		{
+			m_scheduled = false;
+			return;
+		}
+
+		std::shared_ptr<Executor> executor = m_executor;
+		lock.unlock();
+
+		auto self = shared_from_this();
+		executor->Post([self] { self->Drain(); });
+	}
+
+} // namespace
@@ -0,0 +1,43 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include "asyncio.h"
+
+namespace metafile {
+
+	// runs tasks one after another on an executor, never two at once.
+	// MetafileImpl is not thread safe, so all its async operations go through one queue
+	class AsyncQueue : public std::enable_shared_from_this<AsyncQueue>
+	{
+	public:
+		explicit AsyncQueue(const std::shared_ptr<Executor> &executor);
+
+		void SetExecutor(const std::shared_ptr<Executor> &executor);
+		void Post(const std::function<void()> &task);
+
+	private:
+		AsyncQueue(const AsyncQueue &);
+		AsyncQueue &operator=(const AsyncQueue &);
+
+		void Drain();
+
+		// tasks run by one Drain before executor gets a chance to run other queues
+		static const uint32_t kBatchSize = 64;
+
+		std::shared_ptr<Executor> m_executor;
+		std::deque< std::function<void()> > m_tasks;
+		std::mutex m_lock;
+		bool m_scheduled;
+	};
+
+} // namespace
@@ -0,0 +1,126 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "backgroundflusher.h"
+#include <algorithm>
+#include <assert.h>
+
+namespace metafile
+{
+	BackgroundFlusher::BackgroundFlusher(const FlushPolicy &policy, const std::function<bool()> &flush)
+		: m_policy(policy)
+		, m_flush(flush)
+		, m_dirty(0)
+		, m_requested(0)
+		, m_completed(0)
+		, m_result(true)
+		, m_stop(false)
+	{
+		assert(m_flush);
+		m_thread = std::thread(&BackgroundFlusher::Run, this);
+	}
+
+	BackgroundFlusher::~BackgroundFlusher()
+	{
+		Stop();
+	}
+
+	void BackgroundFlusher::Stop()
+	{
+		if (!m_thread.joinable()) return;
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_stop = true;
+		}
+
+		m_wakeUp.notify_one();
+		m_thread.join();
+	}
+
+	void BackgroundFlusher::AddDirty(uint64_t size)
+	{
+		uint64_t dirty = m_dirty.fetch_add(size) + size;
+		if (m_policy.dirtyBytes == 0 || dirty < m_policy.dirtyBytes || dirty - size >= m_policy.dirtyBytes) return;
+
+		// once per crossing. lock makes sure the thread is either waiting or checks again
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+		}
+
+		m_wakeUp.notify_one();
+	}
+
+	bool BackgroundFlusher::WaitForFlush()
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		uint64_t request = ++m_requested;
+
+		m_wakeUp.notify_one();
+		m_flushed.wait(lock, [&] { return m_completed >= request; });
+		return m_result;
+	}
+
+	bool BackgroundFlusher::IsOverLimit()
+	{
+		return m_policy.dirtyBytes != 0 && m_dirty.load() >= m_policy.dirtyBytes;
+	}
+
+	void BackgroundFlusher::Run()
+	{
+		// time limits are checked this often, idle one twice per period
+		uint32_t tick = 0;
+		if (m_policy.intervalMs) tick = m_policy.intervalMs;
+		if (m_policy.idleMs) tick = std::min(tick ? tick : ~0u, std::max(m_policy.idleMs / 2, 1u));
+
+		auto interval = std::chrono::milliseconds(m_policy.intervalMs);
+		auto idle = std::chrono::milliseconds(m_policy.idleMs);
+
+		Clock::time_point lastFlush = Clock::now();
+		Clock::time_point lastWrite = lastFlush;
+		uint64_t lastDirty = 0;
+
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		while (true)
+		{
+			auto ready = [this] { return m_stop || m_requested != m_completed || IsOverLimit(); };
+			if (tick) m_wakeUp.wait_for(lock, std::chrono::milliseconds(tick), ready);
+			else m_wakeUp.wait(lock, ready);
+
+			Clock::time_point now = Clock::now();
+			uint64_t dirty = m_dirty.load();
+			if (dirty != lastDirty) lastWrite = now;
+			lastDirty = dirty;
+
+			bool due = ready();
+			if (dirty != 0 && m_policy.intervalMs && now - lastFlush >= interval) due = true;
+			if (dirty != 0 && m_policy.idleMs && now - lastWrite >= idle) due = true;
+			if (!due) continue;
+
+			bool stop = m_stop;
+			uint64_t requested = m_requested;
+
+			// writes which come from now on are left to the next flush
+			m_dirty -= dirty;
+			lastDirty = 0;
+
+			lock.unlock();
+			bool res = m_flush();
+			lock.lock();
+
+			m_result = res;
+			m_completed = requested;
+			lastFlush = Clock::now();
+			m_flushed.notify_all();
+
+			if (stop) return;
+		}
+	}
+
+} // namespace
@@ -0,0 +1,64 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include "metafile.h"
+
+namespace metafile {
+
+	// thread which calls flush when FlushPolicy says so. writers only count bytes,
+	// the thread is woken up by them only when dirtyBytes is reached
+	class BackgroundFlusher
+	{
+	public:
+		// flush saves everything written so far, false on error
+		BackgroundFlusher(const FlushPolicy &policy, const std::function<bool()> &flush);
+
+		// flushes what is left
+		~BackgroundFlusher();
+
+		// same as destructor, for owner which is read by the flush itself
+		void Stop();
+
+		void AddDirty(uint64_t size);
+
+		// waits until everything added before the call is flushed. result of that flush
+		bool WaitForFlush();
+
+	private:
+		BackgroundFlusher(const BackgroundFlusher &);
+		BackgroundFlusher &operator=(const BackgroundFlusher &);
+
+		typedef std::chrono::steady_clock Clock;
+
+		void Run();
+		bool IsOverLimit();
+
+		FlushPolicy m_policy;
+		std::function<bool()> m_flush;
+
+		std::atomic<uint64_t> m_dirty;	// bytes written since last flush started
+
+		std::mutex m_lock;
+		std::condition_variable m_wakeUp;
+		std::condition_variable m_flushed;
+		uint64_t m_requested;	// WaitForFlush calls so far
+		uint64_t m_completed;	// requests covered by finished flushes
+		bool m_result;
+		bool m_stop;
+
+		std::thread m_thread;
+	};
+
+} // namespace
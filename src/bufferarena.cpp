@@ -0,0 +1,213 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "bufferarena.h"
+#include <algorithm>
+#include <cstdlib>
+#include <assert.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace metafile
+{
+	static size_t RoundUp(size_t size, size_t granularity)
+	{
+		return (size + granularity - 1) / granularity * granularity;
+	}
+
+#ifdef _WIN32
+
+	static void *OsMapHuge(size_t size)
+	{
+		// needs SeLockMemoryPrivilege, which most accounts don't have
+		size_t largePage = GetLargePageMinimum();
+		if (largePage != 0)
+		{
+			void *res = VirtualAlloc(nullptr, RoundUp(size, largePage), MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (res) return res;
+		}
+
+		return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+
+	static void OsUnmapHuge(void *buffer, size_t)
+	{
+		VirtualFree(buffer, 0, MEM_RELEASE);
+	}
+
+	static void *OsAllocateAligned(size_t size, size_t alignment)
+	{
+		return _aligned_malloc(size, alignment);
+	}
+
+	static void OsFreeAligned(void *buffer)
+	{
+		_aligned_free(buffer);
+	}
+
+#else
+
+	static void *OsMapHuge(size_t size)
+	{
+		// reserved huge pages first, they are usually not configured
+		size = RoundUp(size, BufferArena::kHugePageSize);
+		void *res;
+#ifdef MAP_HUGETLB
+		res = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (res != MAP_FAILED) return res;
+#endif
+
+		res = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (res == MAP_FAILED) return nullptr;
+
+		// transparent huge pages, if system allows them
+#ifdef MADV_HUGEPAGE
+		madvise(res, size, MADV_HUGEPAGE);
+#endif
+		return res;
+	}
+
+	static void OsUnmapHuge(void *buffer, size_t size)
+	{
+		munmap(buffer, RoundUp(size, BufferArena::kHugePageSize));
+	}
+
+	static void *OsAllocateAligned(size_t size, size_t alignment)
+	{
+		void *res = nullptr;
+		if (posix_memalign(&res, std::max(alignment, sizeof(void *)), size) != 0) return nullptr;
+		return res;
+	}
+
+	static void OsFreeAligned(void *buffer)
+	{
+		free(buffer);
+	}
+
+#endif
+
+	BufferArena::BufferArena(const Options &options)
+		: m_options(options)
+		, m_cachedSize(0)
+		, m_numberOfSystemAllocations(0)
+	{
+		assert(m_options.granularity != 0 && (m_options.granularity & (m_options.granularity - 1)) == 0);
+
+		for (size_t size = m_options.granularity; size <= m_options.maxPooledSize; size *= 2)
+		{
+			m_free.push_back(std::vector<void *>());
+		}
+	}
+
+	BufferArena::~BufferArena()
+	{
+		for (uint32_t sizeClass = 0; sizeClass < m_free.size(); sizeClass++)
+		{
+			for (auto buffer : m_free[sizeClass])
+			{
+				FreeToSystem(buffer, m_options.granularity << sizeClass, m_options.granularity);
+			}
+		}
+	}
+
+	bool BufferArena::GetClass(size_t size, size_t alignment, uint32_t &sizeClass)
+	{
+		if (alignment > m_options.granularity) return false;
+
+		for (sizeClass = 0; sizeClass < m_free.size(); sizeClass++)
+		{
+			if ((m_options.granularity << sizeClass) >= size) return true;
+		}
+
+		return false;
+	}
+
+	void *BufferArena::Allocate(size_t size, size_t alignment)
+	{
+		uint32_t sizeClass;
+		if (!GetClass(size, alignment, sizeClass))
+		{
+			void *res = AllocateFromSystem(size, alignment);
+
+			std::lock_guard<std::mutex> lock(m_lock);
+			if (res) m_numberOfSystemAllocations++;
+			return res;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			auto &list = m_free[sizeClass];
+
+			if (!list.empty())
+			{
+				void *res = list.back();
+				list.pop_back();
+				m_cachedSize -= m_options.granularity << sizeClass;
+				return res;
+			}
+		}
+
+		void *res = AllocateFromSystem(m_options.granularity << sizeClass, m_options.granularity);
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		if (res) m_numberOfSystemAllocations++;
+		return res;
+	}
+
+	void BufferArena::Deallocate(void *buffer, size_t size, size_t alignment)
+	{
+		if (!buffer) return;
+
+		uint32_t sizeClass;
+		if (!GetClass(size, alignment, sizeClass))
+		{
+			FreeToSystem(buffer, size, alignment);
+			return;
+		}
+
+		size_t classSize = m_options.granularity << sizeClass;
+
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			if (m_cachedSize + classSize <= m_options.maxCachedSize)
+			{
+				m_free[sizeClass].push_back(buffer);
+				m_cachedSize += classSize;
+				return;
+			}
+		}
+
+		FreeToSystem(buffer, classSize, m_options.granularity);
+	}
+
+	uint64_t BufferArena::GetNumberOfSystemAllocations()
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		return m_numberOfSystemAllocations;
+	}
+
+	void *BufferArena::AllocateFromSystem(size_t size, size_t alignment)
+	{
+		// mappings are page aligned, larger alignments take the usual way
+		if (m_options.hugePages && size >= kHugePageSize && alignment <= 4096) return OsMapHuge(size);
+		return OsAllocateAligned(std::max(size, (size_t)1), std::max(alignment, m_options.granularity));
+	}
+
+	void BufferArena::FreeToSystem(void *buffer, size_t size, size_t alignment)
+	{
+		if (m_options.hugePages && size >= kHugePageSize && alignment <= 4096) OsUnmapHuge(buffer, size);
+		else OsFreeAligned(buffer);
+	}
+
+} // namespace
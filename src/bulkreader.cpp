@@ -0,0 +1,183 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "bulkreader.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <assert.h>
+
+namespace metafile
+{
+	// FileAccessInterface transfers are limited to 32 bit sizes
+	static const uint32_t kMaxTransferSize = 1u << 30;
+
+	struct WorkQueue
+	{
+		std::mutex lock;
+		std::deque<size_t> runs;
+	};
+
+	BulkReader::BulkReader(const std::function< std::shared_ptr<FileAccessInterface>() > &openReader, BufferResource &buffers)
+		: m_openReader(openReader)
+		, m_buffers(buffers)
+	{
+	}
+
+	void BulkReader::Add(uint64_t address, uint64_t size, char *data)
+	{
+		if (size == 0) return;
+
+		Extent extent = { address, size, data };
+		m_extents.push_back(extent);
+	}
+
+	void BulkReader::BuildRuns()
+	{
+		std::sort(m_extents.begin(), m_extents.end(), [](const Extent &a, const Extent &b) { return a.address < b.address; });
+
+		m_runs.clear();
+		for (size_t i = 0; i < m_extents.size(); i++)
+		{
+			const Extent &extent = m_extents[i];
+
+			if (!m_runs.empty())
+			{
+				// cloned streams share blocks, so extents may overlap
+				Run &last = m_runs.back();
+				uint64_t end = std::max(last.address + last.size, extent.address + extent.size);
+
+				if (extent.address <= last.address + last.size + kMergeGap && end - last.address <= kMaxRunSize)
+				{
+					last.size = end - last.address;
+					last.endExtent = i + 1;
+					continue;
+				}
+			}
+
+			Run run = { extent.address, extent.size, i, i + 1 };
+			m_runs.push_back(run);
+		}
+	}
+
+	bool BulkReader::ReadAt(FileAccessInterface &reader, uint64_t address, char *data, uint64_t size)
+	{
+		reader.SetPointerTo(address);
+
+		for (uint64_t done = 0; done < size; )
+		{
+			uint32_t sizeToProcess = (uint32_t)std::min(size - done, (uint64_t)kMaxTransferSize);
+			uint32_t res = reader.Read(data + done, sizeToProcess);
+
+			// block is allocated but never written up to here, it reads as zeros
+			if (res < sizeToProcess)
+			{
+				memset(data + done + res, 0, (size_t)(size - done - res));
+				break;
+			}
+
+			done += res;
+		}
+
+		return reader.IsValid() && reader.GetLastError().empty();
+	}
+
+	bool BulkReader::ReadRun(FileAccessInterface &reader, const Run &run, Buffer &buffer)
+	{
+		// single extent goes straight to its destination
+		if (run.endExtent - run.firstExtent == 1)
+		{
+			const Extent &extent = m_extents[run.firstExtent];
+			return ReadAt(reader, extent.address, extent.data, extent.size);
+		}
+
+		buffer.resize((size_t)std::max((uint64_t)buffer.size(), run.size));
+		if (!ReadAt(reader, run.address, &buffer[0], run.size)) return false;
+
+		for (size_t i = run.firstExtent; i < run.endExtent; i++)
+		{
+			const Extent &extent = m_extents[i];
+			memcpy(extent.data, &buffer[(size_t)(extent.address - run.address)], (size_t)extent.size);
+		}
+
+		return true;
+	}
+
+	bool BulkReader::ReadAll(uint32_t numberOfThreads, std::string &error)
+	{
+		BuildRuns();
+		if (m_runs.empty()) return true;
+
+		uint32_t numberOfWorkers = (uint32_t)std::min((size_t)std::max(numberOfThreads, 1u), m_runs.size());
+
+		// every worker starts with its own contiguous part of the file, so its reads stay sequential
+		std::vector< std::unique_ptr<WorkQueue> > queues;
+		for (uint32_t i = 0; i < numberOfWorkers; i++)
+		{
+			queues.emplace_back(new WorkQueue());
+			size_t begin = m_runs.size() * i / numberOfWorkers;
+			size_t end = m_runs.size() * (i + 1) / numberOfWorkers;
+			for (size_t run = begin; run < end; run++) queues[i]->runs.push_back(run);
+		}
+
+		std::mutex errorLock;
+		auto work = [&](uint32_t worker)
+		{
+			auto reader = m_openReader();
+			Buffer buffer((BufferAllocator<char>(&m_buffers)));
+
+			while (true)
+			{
+				size_t run = m_runs.size();
+
+				{
+					std::lock_guard<std::mutex> lock(queues[worker]->lock);
+					if (!queues[worker]->runs.empty())
+					{
+						run = queues[worker]->runs.front();
+						queues[worker]->runs.pop_front();
+					}
+				}
+
+				// own work is done, take the far end of somebody else's
+				for (uint32_t i = 1; i < numberOfWorkers && run == m_runs.size(); i++)
+				{
+					WorkQueue &victim = *queues[(worker + i) % numberOfWorkers];
+					std::lock_guard<std::mutex> lock(victim.lock);
+					if (victim.runs.empty()) continue;
+
+					run = victim.runs.back();
+					victim.runs.pop_back();
+				}
+
+				if (run == m_runs.size()) return;
+
+				if (!reader || !ReadRun(*reader, m_runs[run], buffer))
+				{
+					std::lock_guard<std::mutex> lock(errorLock);
+					if (error.empty()) error = reader ? reader->GetLastError() : "Can not open file";
+					if (error.empty()) error = "Read error";
+				}
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (uint32_t i = 1; i < numberOfWorkers; i++)
+		{
+			threads.push_back(std::thread(work, i));
+		}
+
+		work(0);
+		for (auto &thread : threads) thread.join();
+
+		return error.empty();
+	}
+
+} // namespace
@@ -0,0 +1,68 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include "bufferarena.h"
+#include "fileaccessinterface.h"
+
+namespace metafile {
+
+	// copies many extents of underlying file to memory at once.
+	// extents are sorted by address, close ones are merged into one large read,
+	// reads are spread over threads which steal work from each other.
+	class BulkReader
+	{
+	public:
+		// reads past this gap are merged, reading the gap is cheaper than another request
+		static const uint64_t kMergeGap = 128 * 1024;
+		static const uint64_t kMaxRunSize = 8 * 1024 * 1024;
+
+		// every thread reads through its own FileAccessInterface made by openReader.
+		// buffers of merged reads come from buffers
+		BulkReader(const std::function< std::shared_ptr<FileAccessInterface>() > &openReader, BufferResource &buffers);
+
+		void Add(uint64_t address, uint64_t size, char *data);
+
+		// returns false and sets error if any read failed
+		bool ReadAll(uint32_t numberOfThreads, std::string &error);
+
+	private:
+		struct Extent
+		{
+			uint64_t address;
+			uint64_t size;
+			char *data;
+		};
+
+		// one read of underlying file, covers extents [firstExtent, endExtent)
+		struct Run
+		{
+			uint64_t address;
+			uint64_t size;
+			size_t firstExtent;
+			size_t endExtent;
+		};
+
+		void BuildRuns();
+		typedef std::vector<char, BufferAllocator<char> > Buffer;
+
+		bool ReadRun(FileAccessInterface &reader, const Run &run, Buffer &buffer);
+		bool ReadAt(FileAccessInterface &reader, uint64_t address, char *data, uint64_t size);
+
+		std::function< std::shared_ptr<FileAccessInterface>() > m_openReader;
+		BufferResource &m_buffers;
+		std::vector<Extent> m_extents;
+		std::vector<Run> m_runs;
+	};
+
+} // namespace
@@ -7,29 +7,59 @@
 */
 
 #include "defaultfileaccess.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
 #include <io.h>
+#else
+#include <sys/file.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 namespace metafile
 {
 	DefaultFileAccess::DefaultFileAccess()
+		: m_pendingWrites(false)
+		, m_positionalWrites(false)
 	{
 		m_file = nullptr;
+		m_positionalHandle = nullptr;
 	}
 
 
 	DefaultFileAccess::~DefaultFileAccess()
 	{
-		if (m_file) fclose(m_file);
+		Close();
 	}
 
-
-	void DefaultFileAccess::UseFile(const std::string &name) 
+	void DefaultFileAccess::Close()
 	{
+#ifdef _WIN32
+		if (m_positionalHandle) CloseHandle(m_positionalHandle);
+#endif
+		m_positionalHandle = nullptr;
+
 		if (m_file)
 		{
 			fclose(m_file);
 			m_file = nullptr;
 		}
+	}
+
+
+	void DefaultFileAccess::UseFile(const std::string &name) 
+	{
+		Close();
 
 		m_error.clear();
 		auto f = fopen(name.c_str(), "rb+");
@@ -44,6 +74,27 @@ namespace metafile
 
 		m_file = f;
 		if (!m_file) m_error = std::string("Can not open file") + name;
+
+#ifdef _WIN32
+		// positioned WriteFile moves file pointer of a synchronous handle, stdio must not see it
+		else
+		{
+			HANDLE h = ReOpenFile((HANDLE)_get_osfhandle(_fileno(m_file)), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0);
+			m_positionalHandle = h == INVALID_HANDLE_VALUE ? nullptr : h;
+		}
+#endif
+	}
+
+	void DefaultFileAccess::UseFileReadOnly(const std::string &name)
+	{
+		Close();
+
+		m_error.clear();
+		m_file = fopen(name.c_str(), "rb");
+		if (!m_file) m_error = std::string("Can not open file") + name;
+
+		// another process may change the file, buffered data would go stale
+		else setvbuf(m_file, nullptr, _IONBF, 0);
 	}
 
 	bool DefaultFileAccess::IsValid() 
@@ -60,27 +111,66 @@ namespace metafile
 	{
 		if (!m_file) return;
 
+#ifdef _WIN32
 		bool res = 0 == _fseeki64(m_file, offset, SEEK_SET);
+#else
+		bool res = 0 == fseeko(m_file, offset, SEEK_SET);
+#endif
 		if (!res)
 		{
 			m_error = "_fseeki64 error " ;
 			m_error += strerror(errno);
-			fclose(m_file);
-			m_file = nullptr;
+			Close();
 		}
 	}
 
 	void DefaultFileAccess::SetFileSize(uint64_t size)
 	{
 		if (!m_file) return;
+#ifdef _WIN32
 		int filedes = _fileno(m_file);
 		_chsize_s(filedes, size);
+#else
+		fflush(m_file);
+		if (ftruncate(fileno(m_file), size) != 0)
+		{
+			m_error = "ftruncate error ";
+			m_error += strerror(errno);
+		}
+#endif
+	}
+
+	uint64_t DefaultFileAccess::GetFileSize()
+	{
+		if (!m_file) return 0;
+
+		// buffered writes count too
+		fflush(m_file);
+#ifdef _WIN32
+		int64_t size = _filelengthi64(_fileno(m_file));
+		return size > 0 ? (uint64_t)size : 0;
+#else
+		struct stat info;
+		return fstat(fileno(m_file), &info) == 0 ? (uint64_t)info.st_size : 0;
+#endif
 	}
 
 	uint32_t DefaultFileAccess::Read(void *buffer, uint32_t bufferSize)
 	{
 		if (!m_file) return 0;
-		return fread(buffer, 1, bufferSize, m_file);
+
+		// read buffer may hold bytes written by WriteAt since it was filled, flush drops it
+		if (m_positionalWrites.exchange(false)) fflush(m_file);
+		uint32_t res = fread(buffer, 1, bufferSize, m_file);
+
+		// short read at the end of file is not an error
+		if (res != bufferSize && ferror(m_file))
+		{
+			m_error = "Read error";
+			clearerr(m_file);
+		}
+
+		return res;
 	}
 
 	uint32_t DefaultFileAccess::Write(void *buffer, uint32_t bufferSize)
@@ -91,17 +181,121 @@ namespace metafile
 		if (res != bufferSize)
 		{
 			m_error = "Write error";
-			fclose(m_file);
-			m_file = nullptr;
+			Close();
 			return 0;
 		}
 
+		m_pendingWrites = true;
 		return res;
 	}
 
+	uint32_t DefaultFileAccess::WriteAt(uint64_t offset, const void *buffer, uint32_t bufferSize)
+	{
+		if (!m_file || bufferSize == 0) return 0;
+
+		// buffered bytes go first, a later fflush must not land on top of this write
+		if (m_pendingWrites)
+		{
+			fflush(m_file);
+			m_pendingWrites = false;
+		}
+
+		// errors are left to the fallback Write, it reports them
+#ifdef _WIN32
+		if (!m_positionalHandle) return 0;
+
+		OVERLAPPED position = {};
+		position.Offset = (DWORD)offset;
+		position.OffsetHigh = (DWORD)(offset >> 32);
+
+		DWORD res = 0;
+		if (!WriteFile(m_positionalHandle, buffer, bufferSize, &res, &position) || res != bufferSize) return 0;
+#else
+		if (pwrite(fileno(m_file), buffer, bufferSize, (off_t)offset) != (ssize_t)bufferSize) return 0;
+#endif
+
+		m_positionalWrites = true;
+		return bufferSize;
+	}
+
 	void DefaultFileAccess::Flush()
 	{
-		if (m_file) fflush(m_file);
+		if (!m_file) return;
+
+		fflush(m_file);
+		m_pendingWrites = false;
+	}
+
+	bool DefaultFileAccess::Sync()
+	{
+		if (!m_file) return false;
+
+#ifdef _WIN32
+		return 0 != FlushFileBuffers((HANDLE)_get_osfhandle(_fileno(m_file)));
+#elif defined(__APPLE__)
+		return 0 == fsync(fileno(m_file));
+#else
+		return 0 == fdatasync(fileno(m_file));
+#endif
+	}
+
+	bool DefaultFileAccess::LockForWriting()
+	{
+		if (!m_file) return false;
+
+#ifdef _WIN32
+		// byte range far past any data, windows locks block i/o of the range they cover
+		OVERLAPPED position = {};
+		position.OffsetHigh = 0x7fffffff;
+		return 0 != LockFileEx((HANDLE)_get_osfhandle(_fileno(m_file)), LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY,
+			0, 1, 0, &position);
+#else
+		return 0 == flock(fileno(m_file), LOCK_EX | LOCK_NB);
+#endif
+	}
+
+	uint64_t DefaultFileAccess::TransferTo(int fd, uint64_t offset, uint64_t size)
+	{
+#ifndef __linux__
+		// no zero copy primitive for arbitrary descriptors, leave it to buffered copy
+		return 0;
+#else
+		if (!m_file) return 0;
+
+		// stdio may still hold part of the data
+		fflush(m_file);
+
+		int source = fileno(m_file);
+		uint64_t transferred = 0;
+
+		struct stat target;
+		bool regularFile = fstat(fd, &target) == 0 && S_ISREG(target.st_mode);
+
+		while (transferred < size)
+		{
+			size_t chunk = (size_t)std::min(size - transferred, (uint64_t)(1u << 30));
+			ssize_t res = -1;
+
+			// file to file lets filesystem clone extents when it can
+			if (regularFile)
+			{
+				loff_t from = (loff_t)(offset + transferred);
+				res = copy_file_range(source, &from, fd, nullptr, chunk, 0);
+				if (res < 0) regularFile = false;
+			}
+
+			if (res < 0)
+			{
+				off_t from = (off_t)(offset + transferred);
+				res = sendfile(fd, source, &from, chunk);
+			}
+
+			if (res <= 0) break;
+			transferred += res;
+		}
+
+		return transferred;
+#endif
 	}
 
 } // namespace
@@ -0,0 +1,431 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "directfileaccess.h"
+#include "alignedbufferpool.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <assert.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace metafile
+{
+	static const intptr_t kInvalidFile = -1;
+
+#ifdef _WIN32
+
+	static intptr_t OsOpen(const std::string &name, bool readOnly)
+	{
+		HANDLE h = readOnly
+			? CreateFileA(name.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+				OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL)
+			: CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+				OPEN_ALWAYS, FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH, NULL);
+
+		return h == INVALID_HANDLE_VALUE ? kInvalidFile : (intptr_t)h;
+	}
+
+	static void OsClose(intptr_t file)
+	{
+		CloseHandle((HANDLE)file);
+	}
+
+	static int64_t OsRead(intptr_t file, void *buffer, uint32_t size, uint64_t offset)
+	{
+		OVERLAPPED position = {};
+		position.Offset = (DWORD)offset;
+		position.OffsetHigh = (DWORD)(offset >> 32);
+
+		DWORD res = 0;
+		if (!ReadFile((HANDLE)file, buffer, size, &res, &position))
+		{
+			return GetLastError() == ERROR_HANDLE_EOF ? 0 : -1;
+		}
+
+		return res;
+	}
+
+	static int64_t OsWrite(intptr_t file, const void *buffer, uint32_t size, uint64_t offset)
+	{
+		OVERLAPPED position = {};
+		position.Offset = (DWORD)offset;
+		position.OffsetHigh = (DWORD)(offset >> 32);
+
+		DWORD res = 0;
+		if (!WriteFile((HANDLE)file, buffer, size, &res, &position)) return -1;
+		return res;
+	}
+
+	static bool OsTruncate(intptr_t file, uint64_t size)
+	{
+		FILE_END_OF_FILE_INFO info;
+		info.EndOfFile.QuadPart = size;
+		return 0 != SetFileInformationByHandle((HANDLE)file, FileEndOfFileInfo, &info, sizeof(info));
+	}
+
+	static bool OsGetSize(intptr_t file, uint64_t &size)
+	{
+		LARGE_INTEGER res;
+		if (!GetFileSizeEx((HANDLE)file, &res)) return false;
+		size = res.QuadPart;
+		return true;
+	}
+
+	static bool OsSync(intptr_t file)
+	{
+		return 0 != FlushFileBuffers((HANDLE)file);
+	}
+
+	static std::string OsErrorText()
+	{
+		return std::to_string(GetLastError());
+	}
+
+	static bool OsLock(intptr_t file)
+	{
+		// byte range far past any data, windows locks block i/o of the range they cover
+		OVERLAPPED position = {};
+		position.OffsetHigh = 0x7fffffff;
+		return 0 != LockFileEx((HANDLE)file, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &position);
+	}
+
+#else
+
+	static intptr_t OsOpen(const std::string &name, bool readOnly)
+	{
+		int flags = readOnly ? O_RDONLY : O_RDWR | O_CREAT;
+#ifdef O_DIRECT
+		flags |= O_DIRECT;
+#endif
+		int fd = open(name.c_str(), flags, 0644);
+		if (fd < 0) return kInvalidFile;
+
+#if !defined(O_DIRECT) && defined(F_NOCACHE)
+		fcntl(fd, F_NOCACHE, 1);
+#endif
+		return fd;
+	}
+
+	static void OsClose(intptr_t file)
+	{
+		close((int)file);
+	}
+
+	static int64_t OsRead(intptr_t file, void *buffer, uint32_t size, uint64_t offset)
+	{
+		return pread((int)file, buffer, size, (off_t)offset);
+	}
+
+	static int64_t OsWrite(intptr_t file, const void *buffer, uint32_t size, uint64_t offset)
+	{
+		return pwrite((int)file, buffer, size, (off_t)offset);
+	}
+
+	static bool OsTruncate(intptr_t file, uint64_t size)
+	{
+		return 0 == ftruncate((int)file, (off_t)size);
+	}
+
+	static bool OsGetSize(intptr_t file, uint64_t &size)
+	{
+		struct stat info;
+		if (fstat((int)file, &info) != 0) return false;
+		size = info.st_size;
+		return true;
+	}
+
+	static bool OsSync(intptr_t file)
+	{
+		// page cache is bypassed, but the device cache and metadata still need it
+#ifdef __APPLE__
+		return 0 == fsync((int)file);
+#else
+		return 0 == fdatasync((int)file);
+#endif
+	}
+
+	static std::string OsErrorText()
+	{
+		return strerror(errno);
+	}
+
+	static bool OsLock(intptr_t file)
+	{
+		return 0 == flock((int)file, LOCK_EX | LOCK_NB);
+	}
+
+#endif
+
+	DirectFileAccess::DirectFileAccess(uint32_t alignment)
+		: m_file(kInvalidFile)
+		, m_position(0)
+		, m_fileSize(0)
+		, m_alignment(alignment)
+	{
+		assert(alignment != 0 && (alignment & (alignment - 1)) == 0);
+		m_bounceBuffers.reset(new AlignedBufferPool(m_alignment, std::max((uint32_t)kBounceBufferSize, m_alignment)));
+	}
+
+	DirectFileAccess::~DirectFileAccess()
+	{
+		Close();
+	}
+
+	void DirectFileAccess::Close()
+	{
+		if (m_file == kInvalidFile) return;
+
+		Flush();
+		OsClose(m_file);
+		m_file = kInvalidFile;
+	}
+
+	void DirectFileAccess::SetError(const std::string &message)
+	{
+		m_error = message + " " + OsErrorText();
+
+		if (m_file != kInvalidFile)
+		{
+			OsClose(m_file);
+			m_file = kInvalidFile;
+		}
+	}
+
+	void DirectFileAccess::UseFile(const std::string &name)
+	{
+		Open(name, false);
+	}
+
+	void DirectFileAccess::UseFileReadOnly(const std::string &name)
+	{
+		Open(name, true);
+	}
+
+	void DirectFileAccess::Open(const std::string &name, bool readOnly)
+	{
+		Close();
+
+		m_error.clear();
+		m_position = 0;
+		m_fileSize = 0;
+
+		m_file = OsOpen(name, readOnly);
+		if (m_file == kInvalidFile)
+		{
+			m_error = std::string("Can not open file") + name;
+			return;
+		}
+
+		uint64_t size;
+		if (!OsGetSize(m_file, size)) SetError("Can not get file size");
+		else m_fileSize = size;
+	}
+
+	bool DirectFileAccess::IsValid()
+	{
+		return m_file != kInvalidFile;
+	}
+
+	std::string DirectFileAccess::GetLastError()
+	{
+		return m_error;
+	}
+
+	void DirectFileAccess::SetPointerTo(uint64_t offset)
+	{
+		m_position = offset;
+	}
+
+	void DirectFileAccess::SetFileSize(uint64_t size)
+	{
+		if (m_file == kInvalidFile) return;
+
+		if (!OsTruncate(m_file, size))
+		{
+			SetError("Can not set file size");
+			return;
+		}
+
+		m_fileSize = size;
+	}
+
+	uint32_t DirectFileAccess::Read(void *buffer, uint32_t bufferSize)
+	{
+		return Transfer((char *)buffer, bufferSize, false);
+	}
+
+	uint32_t DirectFileAccess::Write(void *buffer, uint32_t bufferSize)
+	{
+		uint32_t res = Transfer((char *)buffer, bufferSize, true);
+		if (res != bufferSize) return 0;
+		return res;
+	}
+
+	void DirectFileAccess::Flush()
+	{
+		if (m_file == kInvalidFile) return;
+
+		// bounce writes always cover whole alignment units, give back the padding
+		uint64_t actualSize;
+		if (OsGetSize(m_file, actualSize) && actualSize > m_fileSize.load())
+		{
+			if (!OsTruncate(m_file, m_fileSize)) SetError("Can not set file size");
+		}
+	}
+
+	bool DirectFileAccess::LockForWriting()
+	{
+		return m_file != kInvalidFile && OsLock(m_file);
+	}
+
+	bool DirectFileAccess::Sync()
+	{
+		return m_file != kInvalidFile && OsSync(m_file);
+	}
+
+	uint64_t DirectFileAccess::GetFileSize()
+	{
+		// file may be longer on disk until aligned tail is trimmed
+		return m_file != kInvalidFile ? m_fileSize.load() : 0;
+	}
+
+	uint32_t DirectFileAccess::WriteAt(uint64_t offset, const void *buffer, uint32_t bufferSize)
+	{
+		// unaligned units are read, patched and written back, two writers could lose each other's bytes
+		const uint64_t mask = m_alignment - 1;
+		if (m_file == kInvalidFile || bufferSize == 0) return 0;
+		if ((offset & mask) != 0 || (bufferSize & mask) != 0 || ((uintptr_t)buffer & mask) != 0) return 0;
+
+		// errors are left to the fallback Write, it reports them
+		if (OsWrite(m_file, buffer, bufferSize, offset) != bufferSize) return 0;
+
+		GrowFileSize(offset + bufferSize);
+		return bufferSize;
+	}
+
+	void DirectFileAccess::GrowFileSize(uint64_t end)
+	{
+		uint64_t size = m_fileSize.load();
+		while (size < end && !m_fileSize.compare_exchange_weak(size, end));
+	}
+
+	uint32_t DirectFileAccess::GetAlignment()
+	{
+		return m_alignment;
+	}
+
+	uint32_t DirectFileAccess::Transfer(char *buffer, uint32_t size, bool write)
+	{
+		if (m_file == kInvalidFile) return 0;
+
+		const uint64_t mask = m_alignment - 1;
+		uint32_t processed = 0;
+
+		while (processed < size)
+		{
+			char *data = buffer + processed;
+			uint32_t left = size - processed;
+
+			if ((m_position & mask) == 0 && ((uintptr_t)data & mask) == 0 && left >= m_alignment)
+			{
+				// aligned part goes straight to the device
+				uint32_t sizeToProcess = (uint32_t)(left & ~mask);
+				int64_t res = write ? OsWrite(m_file, data, sizeToProcess, m_position)
+					: OsRead(m_file, data, sizeToProcess, m_position);
+
+				if (res < 0 || (write && res != sizeToProcess))
+				{
+					SetError(write ? "Write error" : "Read error");
+					return processed;
+				}
+
+				processed += (uint32_t)res;
+				m_position += res;
+				if (write) GrowFileSize(m_position);
+				if (res < sizeToProcess) return processed;
+				continue;
+			}
+
+			// unaligned segment goes through bounce buffer. if memory and file position
+			// are equally misaligned, only the head is staged and the rest takes the path above
+			uint64_t start = m_position & ~mask;
+			uint32_t head = (uint32_t)(m_position - start);
+			uint32_t sizeToProcess = std::min(left, m_bounceBuffers->GetBufferSize() - head);
+
+			if ((((uintptr_t)data - m_position) & mask) == 0)
+			{
+				sizeToProcess = std::min(sizeToProcess, m_alignment - head);
+			}
+
+			uint32_t span = (uint32_t)((head + sizeToProcess + mask) & ~mask);
+
+			char *bounce = m_bounceBuffers->Acquire();
+			if (!bounce)
+			{
+				m_error = "Out of memory";
+				return processed;
+			}
+
+			// partial units have to be read first. beyond end of file there is nothing to read
+			int64_t actuallyRead = 0;
+			bool partial = head != 0 || sizeToProcess != span;
+			if ((!write || partial) && start < m_fileSize)
+			{
+				actuallyRead = OsRead(m_file, bounce, span, start);
+			}
+
+			if (actuallyRead < 0)
+			{
+				m_bounceBuffers->Release(bounce);
+				SetError("Read error");
+				return processed;
+			}
+
+			memset(bounce + actuallyRead, 0, span - (uint32_t)actuallyRead);
+
+			if (write)
+			{
+				memcpy(bounce + head, data, sizeToProcess);
+				int64_t res = OsWrite(m_file, bounce, span, start);
+				m_bounceBuffers->Release(bounce);
+
+				if (res != span)
+				{
+					SetError("Write error");
+					return processed;
+				}
+
+				m_position += sizeToProcess;
+				GrowFileSize(m_position);
+				processed += sizeToProcess;
+				continue;
+			}
+
+			uint32_t available = actuallyRead > head ? std::min(sizeToProcess, (uint32_t)actuallyRead - head) : 0;
+			memcpy(data, bounce + head, available);
+			m_bounceBuffers->Release(bounce);
+
+			m_position += available;
+			processed += available;
+			if (available < sizeToProcess) return processed;
+		}
+
+		return processed;
+	}
+
+} // namespace
@@ -0,0 +1,74 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "directory.h"
+#include <cstring>
+
+namespace metafile
+{
+	void AppendDirectoryEntry(const FileThreadInfo &info, std::vector<char> &directory)
+	{
+		// records are allocated from the start, trailing zeros carry nothing
+		uint32_t numberOfRecords = FileThreadInfo::kNumberOfBlockRecords;
+		while (numberOfRecords > 0 && info.blocks[numberOfRecords - 1].offsetInUnderlyingFile == 0) numberOfRecords--;
+
+		DirectoryEntry entry;
+		entry.size = info.size;
+		entry.flags = info.flags;
+		entry.clusterShift = info.clusterShift;
+		entry.growth = info.growth;
+		entry.growthParameter = info.growthParameter;
+		entry.nameLength = (uint8_t)strnlen(info.name, sizeof(info.name) - 1);
+		entry.numberOfRecords = (uint8_t)numberOfRecords;
+
+		size_t position = directory.size();
+		size_t recordsSize = numberOfRecords * sizeof(FileThreadInfo::BlockRecord);
+		directory.resize(position + sizeof(entry) + entry.nameLength + recordsSize);
+
+		char *data = &directory[position];
+		memcpy(data, &entry, sizeof(entry));
+		memcpy(data + sizeof(entry), info.name, entry.nameLength);
+		if (recordsSize != 0) memcpy(data + sizeof(entry) + entry.nameLength, info.blocks, recordsSize);
+	}
+
+	bool ParseDirectory(const char *data, size_t size, std::vector<FileThreadInfo> &table)
+	{
+		size_t position = 0;
+
+		for (auto &info : table)
+		{
+			DirectoryEntry entry;
+			if (size - position < sizeof(entry)) return false;
+			memcpy(&entry, data + position, sizeof(entry));
+			position += sizeof(entry);
+
+			size_t recordsSize = entry.numberOfRecords * sizeof(FileThreadInfo::BlockRecord);
+			if (entry.nameLength >= sizeof(info.name) || entry.numberOfRecords > FileThreadInfo::kNumberOfBlockRecords ||
+				size - position < entry.nameLength + recordsSize)
+			{
+				return false;
+			}
+
+			memset(&info, 0, sizeof(info));
+			memcpy(info.name, data + position, entry.nameLength);
+			position += entry.nameLength;
+
+			if (recordsSize != 0) memcpy(info.blocks, data + position, recordsSize);
+			position += recordsSize;
+
+			info.size = entry.size;
+			info.flags = entry.flags;
+			info.clusterShift = entry.clusterShift;
+			info.growth = entry.growth;
+			info.growthParameter = entry.growthParameter;
+		}
+
+		return position == size;
+	}
+
+} // namespace
@@ -0,0 +1,23 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "layout.h"
+
+namespace metafile {
+
+	// version 2 table, see DirectoryEntry
+
+	void AppendDirectoryEntry(const FileThreadInfo &info, std::vector<char> &directory);
+
+	// fills all items of table, false if directory is damaged or does not match table size
+	bool ParseDirectory(const char *data, size_t size, std::vector<FileThreadInfo> &table);
+
+} // namespace
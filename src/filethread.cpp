@@ -40,9 +40,71 @@ namespace metafile
 		return m_impl->FileThreadRead(m_index, data, size);
 	}
 
+	const char *FileThread::GetNameRef()
+	{
+		return m_impl->FileThreadGetName(m_index);
+	}
+
+	uint64_t FileThread::ReadAt(uint64_t offset, void *data, uint64_t size)
+	{
+		return m_impl->FileThreadReadAt(m_index, offset, data, size);
+	}
+
+	uint64_t FileThread::WriteAt(uint64_t offset, const void *data, uint64_t size)
+	{
+		return m_impl->FileThreadWriteAt(m_index, offset, data, size);
+	}
+
 	void FileThread::SetPointerTo(uint64_t pos)
 	{
 		return m_impl->FileThreadSetPointerTo(m_index, pos);
 	}
 
+	StreamProfile FileThread::GetProfile()
+	{
+		return m_impl->FileThreadGetProfile(m_index);
+	}
+
+	void FileThread::Reserve(uint64_t size)
+	{
+		m_impl->FileThreadReserve(m_index, size);
+	}
+
+	uint64_t FileThread::Append(const void *data, uint32_t size)
+	{
+		return m_impl->FileThreadAppend(m_index, data, size);
+	}
+
+	char *FileThread::BeginWrite(uint32_t size, uint32_t &available)
+	{
+		return m_impl->FileThreadBeginWrite(m_index, size, available);
+	}
+
+	bool FileThread::CommitWrite(uint32_t used)
+	{
+		return m_impl->FileThreadCommitWrite(m_index, used);
+	}
+
+	uint64_t FileThread::Scan(uint64_t offset, uint64_t size, const ScanVisitor &visitor)
+	{
+		return m_impl->FileThreadScan(m_index, offset, size, visitor);
+	}
+
+	uint64_t FileThread::ExportTo(int fd, uint64_t offset, uint64_t size)
+	{
+		return m_impl->FileThreadExportTo(m_index, fd, offset, size);
+	}
+
+	std::future<AsyncResult> FileThread::ReadAsync(uint64_t offset, void *data, uint32_t size,
+		const AsyncCallback &callback, const CancellationToken &token)
+	{
+		return m_impl->FileThreadReadAsync(m_index, offset, data, size, callback, token);
+	}
+
+	std::future<AsyncResult> FileThread::WriteAsync(uint64_t offset, const void *data, uint32_t size,
+		const AsyncCallback &callback, const CancellationToken &token)
+	{
+		return m_impl->FileThreadWriteAsync(m_index, offset, data, size, callback, token);
+	}
+
 } // namespace
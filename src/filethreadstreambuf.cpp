@@ -0,0 +1,205 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "filethreadstreambuf.h"
+#include <algorithm>
+#include <cstring>
+#include <assert.h>
+
+namespace metafile
+{
+	// FileThread transfers are limited to 32 bit sizes
+	static const uint32_t kMaxTransferSize = 1u << 30;
+
+	FileThreadStreambuf::FileThreadStreambuf(FileThread *thread, size_t bufferSize)
+		: m_thread(thread)
+		, m_buffer(std::max(bufferSize, (size_t)1))
+		, m_bufferStart(0)
+	{
+		assert(m_thread);
+	}
+
+	FileThreadStreambuf::~FileThreadStreambuf()
+	{
+		FlushPutArea();
+	}
+
+	uint64_t FileThreadStreambuf::GetPosition()
+	{
+		if (pbase()) return m_bufferStart + (pptr() - pbase());
+		if (eback()) return m_bufferStart + (gptr() - eback());
+		return m_bufferStart;
+	}
+
+	bool FileThreadStreambuf::FlushPutArea()
+	{
+		if (!pbase()) return true;
+
+		// put area always starts at m_buffer[0]
+		uint32_t size = (uint32_t)(pptr() - pbase());
+		setp(nullptr, nullptr);
+		if (size == 0) return true;
+
+		m_thread->SetPointerTo(m_bufferStart);
+		uint32_t res = m_thread->Write(&m_buffer[0], size);
+		m_bufferStart += res;
+		return res == size;
+	}
+
+	void FileThreadStreambuf::DropGetArea()
+	{
+		if (!eback()) return;
+
+		m_bufferStart += gptr() - eback();
+		setg(nullptr, nullptr, nullptr);
+	}
+
+	FileThreadStreambuf::int_type FileThreadStreambuf::underflow()
+	{
+		if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+		if (!FlushPutArea()) return traits_type::eof();
+		DropGetArea();
+
+		if (m_bufferStart >= m_thread->GetSize()) return traits_type::eof();
+
+		m_thread->SetPointerTo(m_bufferStart);
+		uint32_t size = m_thread->Read(&m_buffer[0], (uint32_t)std::min(m_buffer.size(), (size_t)kMaxTransferSize));
+		if (size == 0) return traits_type::eof();
+
+		setg(&m_buffer[0], &m_buffer[0], &m_buffer[0] + size);
+		return traits_type::to_int_type(*gptr());
+	}
+
+	FileThreadStreambuf::int_type FileThreadStreambuf::overflow(int_type c)
+	{
+		DropGetArea();
+
+		if (pptr() == epptr() && !FlushPutArea()) return traits_type::eof();
+		if (!pbase()) setp(&m_buffer[0], &m_buffer[0] + m_buffer.size());
+
+		if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+		return c;
+	}
+
+	int FileThreadStreambuf::sync()
+	{
+		// buffered input may be stale after sync, next read goes to FileThread again
+		DropGetArea();
+		return FlushPutArea() ? 0 : -1;
+	}
+
+	std::streamsize FileThreadStreambuf::showmanyc()
+	{
+		uint64_t position = GetPosition();
+		uint64_t size = std::max(m_thread->GetSize(), m_bufferStart + (pbase() ? pptr() - pbase() : 0));
+		return position < size ? (std::streamsize)(size - position) : -1;
+	}
+
+	std::streamsize FileThreadStreambuf::xsgetn(char *s, std::streamsize n)
+	{
+		std::streamsize buffered = std::min(n, (std::streamsize)(egptr() - gptr()));
+		if (buffered > 0)
+		{
+			memcpy(s, gptr(), (size_t)buffered);
+			gbump((int)buffered);
+		}
+
+		// rest is small, refill buffer as usual
+		std::streamsize left = n - buffered;
+		if (left < (std::streamsize)m_buffer.size()) return buffered + std::streambuf::xsgetn(s + buffered, left);
+
+		if (!FlushPutArea()) return buffered;
+		DropGetArea();
+
+		std::streamsize done = buffered;
+		while (done < n && m_bufferStart < m_thread->GetSize())
+		{
+			uint32_t size = (uint32_t)std::min((std::streamsize)kMaxTransferSize, n - done);
+			m_thread->SetPointerTo(m_bufferStart);
+			uint32_t res = m_thread->Read(s + done, size);
+
+			m_bufferStart += res;
+			done += res;
+			if (res < size) break;
+		}
+
+		return done;
+	}
+
+	std::streamsize FileThreadStreambuf::xsputn(const char *s, std::streamsize n)
+	{
+		if (pbase() && n <= epptr() - pptr())
+		{
+			memcpy(pptr(), s, (size_t)n);
+			pbump((int)n);
+			return n;
+		}
+
+		if (n < (std::streamsize)m_buffer.size()) return std::streambuf::xsputn(s, n);
+
+		DropGetArea();
+		if (!FlushPutArea()) return 0;
+
+		std::streamsize done = 0;
+		while (done < n)
+		{
+			uint32_t size = (uint32_t)std::min((std::streamsize)kMaxTransferSize, n - done);
+			m_thread->SetPointerTo(m_bufferStart);
+			uint32_t res = m_thread->Write((void *)(s + done), size);
+
+			m_bufferStart += res;
+			done += res;
+			if (res < size) break;
+		}
+
+		return done;
+	}
+
+	FileThreadStreambuf::pos_type FileThreadStreambuf::seekoff(off_type off, std::ios_base::seekdir dir,
+		std::ios_base::openmode which)
+	{
+		// tellg/tellp must not lose the buffer
+		if (dir == std::ios_base::cur && off == 0) return pos_type((off_type)GetPosition());
+
+		int64_t base;
+		if (dir == std::ios_base::beg) base = 0;
+		else if (dir == std::ios_base::cur) base = (int64_t)GetPosition();
+		else
+		{
+			if (!FlushPutArea()) return pos_type(off_type(-1));
+			base = (int64_t)m_thread->GetSize();
+		}
+
+		if (base + off < 0) return pos_type(off_type(-1));
+		return seekpos(pos_type(base + off), which);
+	}
+
+	FileThreadStreambuf::pos_type FileThreadStreambuf::seekpos(pos_type pos, std::ios_base::openmode which)
+	{
+		if (off_type(pos) < 0) return pos_type(off_type(-1));
+		uint64_t target = (uint64_t)off_type(pos);
+
+		// seek inside data already read just moves the get pointer
+		if (eback() && target >= m_bufferStart && target <= m_bufferStart + (egptr() - eback()))
+		{
+			setg(eback(), eback() + (target - m_bufferStart), egptr());
+			return pos;
+		}
+
+		if (!FlushPutArea()) return pos_type(off_type(-1));
+		DropGetArea();
+
+		m_bufferStart = target;
+		return pos;
+	}
+
+} // namespace
@@ -0,0 +1,68 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "fingerprint.h"
+#include <cstring>
+
+namespace metafile
+{
+	static const uint64_t kPrime1 = 0x9E3779B185EBCA87ull;
+	static const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4Full;
+	static const uint64_t kPrime3 = 0x165667B19E3779F9ull;
+	static const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ull;
+
+	static const size_t kNumberOfLanes = 4;
+	static const size_t kStripeSize = kNumberOfLanes * sizeof(uint64_t);
+
+	static inline uint64_t Rotate(uint64_t value, int bits)
+	{
+		return (value << bits) | (value >> (64 - bits));
+	}
+
+	static inline uint64_t Round(uint64_t lane, uint64_t input)
+	{
+		return Rotate(lane + input * kPrime2, 31) * kPrime1;
+	}
+
+	static inline uint64_t Avalanche(uint64_t value)
+	{
+		value ^= value >> 33;
+		value *= kPrime2;
+		value ^= value >> 29;
+		value *= kPrime3;
+		value ^= value >> 32;
+		return value;
+	}
+
+	Fingerprint ComputeFingerprint(const void *data, size_t size)
+	{
+		const char *position = (const char *)data;
+
+		// lanes do not depend on each other, so the loop is vectorized
+		uint64_t lanes[kNumberOfLanes] = { kPrime1 + kPrime2, kPrime2, 0, 0 - kPrime1 };
+		uint64_t stripe[kNumberOfLanes];
+
+		for (size_t left = size / kStripeSize; left > 0; left--, position += kStripeSize)
+		{
+			memcpy(stripe, position, kStripeSize);
+			for (size_t lane = 0; lane < kNumberOfLanes; lane++) lanes[lane] = Round(lanes[lane], stripe[lane]);
+		}
+
+		// tail is padded with zeros, size keeps it apart from longer data
+		memset(stripe, 0, kStripeSize);
+		memcpy(stripe, position, size % kStripeSize);
+		for (size_t lane = 0; lane < kNumberOfLanes; lane++) lanes[lane] = Round(lanes[lane], stripe[lane]);
+
+		Fingerprint result;
+		result.size = size;
+		result.hash[0] = Avalanche(Rotate(lanes[0], 1) + Rotate(lanes[1], 7) + Rotate(lanes[2], 12) + Rotate(lanes[3], 18) + size);
+		result.hash[1] = Avalanche((lanes[0] ^ Rotate(lanes[1], 29) ^ Rotate(lanes[2], 41) ^ Rotate(lanes[3], 53)) + size * kPrime4);
+		return result;
+	}
+
+} // namespace
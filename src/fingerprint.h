@@ -0,0 +1,32 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#pragma once
+#include <cstddef>
+#include <stdint.h>
+
+namespace metafile {
+
+	// content of a whole block for deduplication. not cryptographic, equal
+	// fingerprints are confirmed by comparing the data
+	struct Fingerprint
+	{
+		uint64_t hash[2];
+		uint64_t size;
+
+		bool operator<(const Fingerprint &other) const
+		{
+			if (hash[0] != other.hash[0]) return hash[0] < other.hash[0];
+			if (hash[1] != other.hash[1]) return hash[1] < other.hash[1];
+			return size < other.size;
+		}
+	};
+
+	Fingerprint ComputeFingerprint(const void *data, size_t size);
+
+} // namespace
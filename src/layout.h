@@ -22,9 +22,40 @@
 			block
 			block
 	
-	each block belongs to one file.
+	first block starts right after the table, rounded up to FileAccessInterface::GetAlignment().
+	when a stream is added, blocks which overlap the grown table are moved to the end.
+	each block belongs to one file, unless it is shared by clones. number of references
+	to shared blocks is kept in hidden stream "$refcounts" as RefcountRecord array.
 	start position of all blocks is listed in FileThreadInfo
-	size of block depends on it's number in file. (see MetafileImpl::GetBlockSizeByIndex)
+	size of block depends on it's number in stream and on allocation profile of the stream:
+	cluster size and growth policy. (see MetafileImpl::BuildLayout)
+
+	version 2 keeps the table as a compact directory instead: one DirectoryEntry per stream,
+	packed without padding, followed by records up to the last used block only.
+	directory region is MetafileHeader::directoryCapacity bytes, blocks start after it.
+	when the directory outgrows the region on flush, region is doubled and blocks which
+	overlap it are moved to the end, same as for a grown version 1 table.
+	version 1 file (0 in files made before versions were set) is upgraded in place by
+	switching to version 2 with capacity covering the old table, so no block moves.
+	version 2 has another signature, older binaries don't open it (MetafileHeader::GetSignature).
+
+	streams not bigger than MetafileHeader::slabSlotSize are packed together. each takes
+	a slot of hidden stream "$slabs" instead of own blocks, and moves to own blocks
+	when it outgrows the slot.
+
+	container created with kFlagDedup shares blocks with equal content. whole blocks written
+	at once are indexed in hidden stream "$fingerprints" as FingerprintRecord array, a block
+	with content already in the index references that block instead, counted in "$refcounts".
+
+	overlay file has the same structure. its table starts as a copy of the base table with
+	all blocks marked kBlockInBase, blocks are copied into overlay when written.
+	header keeps a hash of the base table, opening over another base fails.
+
+	sealed file (version 3) is written once by Metafile::Seal and is only read afterwards.
+	header is followed by SealedEntry of every visible stream sorted by name, then their
+	names. each stream is one extent aligned to sizeOfCluster, which is a page at least.
+	open reads header and index at once, streams get kGrowthExtent instead of a block chain.
+	it has a signature of its own too, older binaries would open it writable.
 */
 
 #pragma once
@@ -34,32 +65,131 @@ namespace metafile {
 
 	struct MetafileHeader
 	{
-		static const uint32_t kSignature = 0x12345678;
+		// binaries made before version 2 check the signature only, so every later format
+		// has its own. they take such a file for a foreign one instead of overwriting it
+		static const uint32_t kSignature = 0x12345678;				// versions 0 and 1
+		static const uint32_t kSignatureDirectory = 0x12345679;
+		static const uint32_t kSignatureSealed = 0x1234567A;
 		static const uint32_t kMaxNumberOfThreads = 10000;
-		static const uint32_t kCurrentVersion = 1;
+		static const uint32_t kVersionTable = 1;		// fixed 1 KB FileThreadInfo per stream
+		static const uint32_t kVersionDirectory = 2;	// compact directory, see DirectoryEntry
+		static const uint32_t kCurrentVersion = kVersionDirectory;
+		static const uint32_t kVersionSealed = 3;		// read-only, see SealedEntry. never created writable
 		static const uint32_t kDefaultClusterSize = 4 * 1024;
 
+		// file is a copy-on-write overlay, unmodified blocks are in base container
+		static const uint32_t kFlagOverlay = 1;
+		// whole blocks with equal content are stored once, see FingerprintRecord
+		static const uint32_t kFlagDedup = 2;
+
+		static uint32_t GetSignature(uint32_t version)
+		{
+			if (version == kVersionSealed) return kSignatureSealed;
+			return version == kVersionDirectory ? kSignatureDirectory : kSignature;
+		}
+
 		uint32_t signature;
 		uint32_t version;
 		uint32_t numberOfThreads;
 		uint32_t sizeOfCluster;
+		uint32_t flags;
 
-		char reserved[64 - 4 * 4];
+		// streams up to this size live in slots of hidden stream "$slabs", 0 - never
+		uint32_t slabSlotSize;
+
+		// version 2 and 3. bytes used by directory and bytes reserved for it after the header
+		uint32_t directorySize;
+		uint32_t directoryCapacity;
+
+		// grows by 2 on each flush, odd while a single writer rewrites the table (see Refresh)
+		uint64_t generation;
+
+		// overlay only. hash of the base table it was made over, 0 in older overlays
+		uint64_t baseTableHash;
+
+		char reserved[64 - 8 * 4 - 8 - 8];
 	};
 
 	struct FileThreadInfo
 	{
+		// internal stream, not visible through Metafile interface
+		static const uint32_t kFlagHidden = 1;
+		// stream was created by Metafile::Snapshot, next snapshots skip it
+		static const uint32_t kFlagSnapshot = 2;
+		// small stream, its data is a slot of "$slabs" stream. blocks[0] holds offset
+		// of the slot in "$slabs" instead of an address, other records are 0
+		static const uint32_t kFlagSlab = 4;
+
 		char name[64];
 		uint64_t size;
-		uint64_t reserved;
+		uint32_t flags;
+
+		// allocation profile, all zeros is cluster of container with default growth
+		static const uint8_t kGrowthDefault = 0;
+		static const uint8_t kGrowthFixed = 1;		// growthParameter clusters per block
+		static const uint8_t kGrowthGeometric = 2;	// next block is growthParameter / 256 times bigger
+		static const uint8_t kGrowthSizeHint = 3;	// first block is growthParameter clusters, then doubles
+		static const uint8_t kGrowthExtent = 4;		// sealed file only. blocks[0] is the whole stream
+
+		uint8_t clusterShift;	// log2 of cluster size, 0 - MetafileHeader::sizeOfCluster
+		uint8_t growth;
+		uint16_t growthParameter;
 
 		struct BlockRecord
 		{
+			// upper bits carry the block state, use kOffsetMask to get the address
 			uint64_t offsetInUnderlyingFile;
 		};
 
+		// overlay only. block was not modified and lives in base container at the same address
+		static const uint64_t kBlockInBase = 1ull << 63;
+		// overlay only. block is being copied from base one cluster at a time.
+		// bitmap of copied clusters occupies whole clusters right before the block
+		static const uint64_t kBlockPartial = 1ull << 62;
+		static const uint64_t kOffsetMask = kBlockPartial - 1;
+
 		static const int kNumberOfBlockRecords = (1024 - 64 - 8 - 8) / sizeof(BlockRecord);
 		BlockRecord blocks[kNumberOfBlockRecords];
 	};
 
+	// version 2 directory entry, stored unaligned. followed by name (no terminating zero)
+	// and numberOfRecords BlockRecord values
+#pragma pack(push, 1)
+	struct DirectoryEntry
+	{
+		uint64_t size;
+		uint32_t flags;
+		uint8_t clusterShift;
+		uint8_t growth;
+		uint16_t growthParameter;
+		uint8_t nameLength;
+		uint8_t numberOfRecords;
+	};
+#pragma pack(pop)
+
+	// version 3 index entry, entries are sorted by name
+	struct SealedEntry
+	{
+		uint64_t offset;		// of stream data, 0 if stream is empty
+		uint64_t size;
+		uint32_t nameOffset;	// from the end of the entries
+		uint16_t flags;
+		uint8_t nameLength;
+		uint8_t reserved;
+	};
+
+	struct RefcountRecord
+	{
+		uint64_t offsetInUnderlyingFile;
+		uint64_t numberOfReferences;
+	};
+
+	// block at offsetInUnderlyingFile is not modified since it was written whole
+	struct FingerprintRecord
+	{
+		uint64_t hash[2];
+		uint64_t blockSize;
+		uint64_t offsetInUnderlyingFile;
+	};
+
 } // namespace
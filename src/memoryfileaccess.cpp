@@ -0,0 +1,394 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "memoryfileaccess.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace metafile
+{
+	struct MemoryImage
+	{
+		std::mutex lock;
+		uint64_t size;
+
+		// chunks are allocated on first write, missing chunk reads as zeros
+		std::vector< std::unique_ptr<char[]> > chunks;
+
+		bool writerLocked;
+
+		MemoryImage() : size(0), writerLocked(false) {}
+	};
+
+	class MemoryImageRegistry
+	{
+	public:
+		std::shared_ptr<MemoryImage> Get(const std::string &name)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			auto &image = m_images[name];
+			if (!image) image = std::make_shared<MemoryImage>();
+			return image;
+		}
+
+		// null if there is no such image
+		std::shared_ptr<MemoryImage> Find(const std::string &name)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			auto it = m_images.find(name);
+			return it != m_images.end() ? it->second : nullptr;
+		}
+
+		void Remove(const std::string &name)
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_images.erase(name);
+		}
+
+	private:
+		std::mutex m_lock;
+		std::map< std::string, std::shared_ptr<MemoryImage> > m_images;
+	};
+
+	static const uint32_t kChunkSize = MemoryFileAccess::kChunkSize;
+
+	static void ResizeImage(MemoryImage &image, uint64_t size)
+	{
+		size_t numberOfChunks = (size_t)((size + kChunkSize - 1) / kChunkSize);
+
+		// bytes past the new end must read as zeros if image grows again
+		if (size < image.size && size % kChunkSize != 0 && image.chunks[size / kChunkSize])
+		{
+			memset(image.chunks[size / kChunkSize].get() + size % kChunkSize, 0, kChunkSize - size % kChunkSize);
+		}
+
+		image.chunks.resize(numberOfChunks);
+		image.size = size;
+	}
+
+	MemoryFileAccess::MemoryFileAccess(const std::shared_ptr<MemoryImageRegistry> &registry)
+		: m_registry(registry)
+		, m_position(0)
+		, m_locked(false)
+	{
+	}
+
+	MemoryFileAccess::~MemoryFileAccess()
+	{
+		Unlock();
+	}
+
+	void MemoryFileAccess::Unlock()
+	{
+		if (!m_locked) return;
+
+		std::lock_guard<std::mutex> lock(m_image->lock);
+		m_image->writerLocked = false;
+		m_locked = false;
+	}
+
+	bool MemoryFileAccess::LockForWriting()
+	{
+		if (!m_image) return false;
+		if (m_locked) return true;
+
+		std::lock_guard<std::mutex> lock(m_image->lock);
+		if (m_image->writerLocked) return false;
+
+		m_image->writerLocked = true;
+		m_locked = true;
+		return true;
+	}
+
+	void MemoryFileAccess::UseFile(const std::string &name)
+	{
+		Unlock();
+		m_error.clear();
+		m_position = 0;
+		m_image = m_registry->Get(name);
+	}
+
+	void MemoryFileAccess::UseFileReadOnly(const std::string &name)
+	{
+		Unlock();
+		m_error.clear();
+		m_position = 0;
+		m_image = m_registry->Find(name);
+		if (!m_image) m_error = std::string("Can not open file") + name;
+	}
+
+	bool MemoryFileAccess::IsValid()
+	{
+		return m_image != nullptr;
+	}
+
+	std::string MemoryFileAccess::GetLastError()
+	{
+		return m_error;
+	}
+
+	void MemoryFileAccess::SetPointerTo(uint64_t offset)
+	{
+		m_position = offset;
+	}
+
+	void MemoryFileAccess::SetFileSize(uint64_t size)
+	{
+		if (!m_image) return;
+
+		std::lock_guard<std::mutex> lock(m_image->lock);
+		ResizeImage(*m_image, size);
+	}
+
+	uint64_t MemoryFileAccess::GetFileSize()
+	{
+		if (!m_image) return 0;
+
+		std::lock_guard<std::mutex> lock(m_image->lock);
+		return m_image->size;
+	}
+
+	uint32_t MemoryFileAccess::Read(void *buffer, uint32_t bufferSize)
+	{
+		if (!m_image) return 0;
+
+		std::lock_guard<std::mutex> lock(m_image->lock);
+		if (m_position >= m_image->size) return 0;
+
+		uint32_t size = (uint32_t)std::min((uint64_t)bufferSize, m_image->size - m_position);
+		char *data = (char *)buffer;
+		uint32_t processed = 0;
+
+		while (processed < size)
+		{
+			uint64_t offsetInChunk = m_position % kChunkSize;
+			uint32_t sizeToProcess = (uint32_t)std::min((uint64_t)(size - processed), kChunkSize - offsetInChunk);
+			const char *chunk = m_image->chunks[(size_t)(m_position / kChunkSize)].get();
+
+			if (chunk) memcpy(data + processed, chunk + offsetInChunk, sizeToProcess);
+			else memset(data + processed, 0, sizeToProcess);
+
+			processed += sizeToProcess;
+			m_position += sizeToProcess;
+		}
+
+		return processed;
+	}
+
+	uint64_t MemoryFileAccess::GetMappedData(uint64_t offset, uint64_t size, const char *&data)
+	{
+		if (!m_image) return 0;
+
+		std::lock_guard<std::mutex> lock(m_image->lock);
+		if (offset >= m_image->size) return 0;
+
+		// chunk which was never written is not there, reader zeroes it
+		const char *chunk = m_image->chunks[(size_t)(offset / kChunkSize)].get();
+		if (!chunk) return 0;
+
+		uint64_t offsetInChunk = offset % kChunkSize;
+		data = chunk + offsetInChunk;
+		return std::min(std::min(size, m_image->size - offset), kChunkSize - offsetInChunk);
+	}
+
+	uint64_t MemoryFileAccess::GetWritableData(uint64_t offset, uint64_t size, char *&data)
+	{
+		if (!m_image || size == 0) return 0;
+
+		uint64_t offsetInChunk = offset % kChunkSize;
+		size = std::min(size, kChunkSize - offsetInChunk);
+
+		std::lock_guard<std::mutex> lock(m_image->lock);
+		if (offset + size > m_image->size) ResizeImage(*m_image, offset + size);
+
+		auto &chunk = m_image->chunks[(size_t)(offset / kChunkSize)];
+		if (!chunk)
+		{
+			chunk.reset(new char[kChunkSize]);
+			memset(chunk.get(), 0, kChunkSize);
+		}
+
+		data = chunk.get() + offsetInChunk;
+		return size;
+	}
+
+	uint32_t MemoryFileAccess::Write(void *buffer, uint32_t bufferSize)
+	{
+		if (!m_image) return 0;
+
+		std::lock_guard<std::mutex> lock(m_image->lock);
+		if (m_position + bufferSize > m_image->size) ResizeImage(*m_image, m_position + bufferSize);
+
+		const char *data = (const char *)buffer;
+		uint32_t processed = 0;
+
+		while (processed < bufferSize)
+		{
+			uint64_t offsetInChunk = m_position % kChunkSize;
+			uint32_t sizeToProcess = (uint32_t)std::min((uint64_t)(bufferSize - processed), kChunkSize - offsetInChunk);
+			auto &chunk = m_image->chunks[(size_t)(m_position / kChunkSize)];
+
+			if (!chunk)
+			{
+				chunk.reset(new char[kChunkSize]);
+				memset(chunk.get(), 0, kChunkSize);
+			}
+
+			memcpy(chunk.get() + offsetInChunk, data + processed, sizeToProcess);
+			processed += sizeToProcess;
+			m_position += sizeToProcess;
+		}
+
+		return processed;
+	}
+
+	uint32_t MemoryFileAccess::WriteAt(uint64_t offset, const void *buffer, uint32_t bufferSize)
+	{
+		if (!m_image) return 0;
+
+		// chunks never move, so only finding them needs the lock and copies run in parallel
+		std::vector<char *> chunks;
+		{
+			std::lock_guard<std::mutex> lock(m_image->lock);
+			if (offset + bufferSize > m_image->size) ResizeImage(*m_image, offset + bufferSize);
+
+			for (uint64_t i = offset / kChunkSize; i * kChunkSize < offset + bufferSize; i++)
+			{
+				auto &chunk = m_image->chunks[(size_t)i];
+				if (!chunk)
+				{
+					chunk.reset(new char[kChunkSize]);
+					memset(chunk.get(), 0, kChunkSize);
+				}
+
+				chunks.push_back(chunk.get());
+			}
+		}
+
+		const char *data = (const char *)buffer;
+		uint32_t processed = 0;
+
+		for (size_t i = 0; processed < bufferSize; i++)
+		{
+			uint64_t offsetInChunk = (offset + processed) % kChunkSize;
+			uint32_t sizeToProcess = (uint32_t)std::min((uint64_t)(bufferSize - processed), kChunkSize - offsetInChunk);
+
+			memcpy(chunks[i] + offsetInChunk, data + processed, sizeToProcess);
+			processed += sizeToProcess;
+		}
+
+		return processed;
+	}
+
+	void MemoryFileAccess::Flush()
+	{
+	}
+
+	bool MemoryFileAccess::SaveTo(const std::string &path)
+	{
+		if (!m_image) return false;
+
+		FILE *f = fopen(path.c_str(), "wb");
+		if (!f)
+		{
+			m_error = std::string("Can not open file") + path;
+			return false;
+		}
+
+		// chunks are already large, stdio buffer would only add a copy
+		setvbuf(f, nullptr, _IONBF, 0);
+
+		std::vector<char> zeros;
+		bool res = true;
+
+		std::lock_guard<std::mutex> lock(m_image->lock);
+		for (size_t i = 0; i < m_image->chunks.size() && res; i++)
+		{
+			size_t size = (size_t)std::min((uint64_t)kChunkSize, m_image->size - (uint64_t)i * kChunkSize);
+			const char *chunk = m_image->chunks[i].get();
+
+			if (!chunk)
+			{
+				zeros.resize(kChunkSize);
+				chunk = &zeros[0];
+			}
+
+			res = fwrite(chunk, 1, size, f) == size;
+		}
+
+		res = fclose(f) == 0 && res;
+		if (!res) m_error = "Write error";
+		return res;
+	}
+
+	bool MemoryFileAccess::LoadFrom(const std::string &path)
+	{
+		if (!m_image) return false;
+
+		FILE *f = fopen(path.c_str(), "rb");
+		if (!f)
+		{
+			m_error = std::string("Can not open file") + path;
+			return false;
+		}
+
+		setvbuf(f, nullptr, _IONBF, 0);
+
+		std::lock_guard<std::mutex> lock(m_image->lock);
+		ResizeImage(*m_image, 0);
+
+		bool res = true;
+		while (res)
+		{
+			std::unique_ptr<char[]> chunk(new char[kChunkSize]);
+			size_t size = fread(chunk.get(), 1, kChunkSize, f);
+			if (size == 0)
+			{
+				res = ferror(f) == 0;
+				break;
+			}
+
+			memset(chunk.get() + size, 0, kChunkSize - size);
+			m_image->chunks.push_back(std::move(chunk));
+			m_image->size += size;
+		}
+
+		fclose(f);
+		if (!res) m_error = "Read error";
+		return res;
+	}
+
+	MemoryFileAccessFactory::MemoryFileAccessFactory()
+		: m_registry(std::make_shared<MemoryImageRegistry>())
+	{
+	}
+
+	bool MemoryFileAccessFactory::SaveTo(const std::string &name, const std::string &path)
+	{
+		MemoryFileAccess access(m_registry);
+		access.UseFile(name);
+		return access.SaveTo(path);
+	}
+
+	bool MemoryFileAccessFactory::LoadFrom(const std::string &name, const std::string &path)
+	{
+		MemoryFileAccess access(m_registry);
+		access.UseFile(name);
+		return access.LoadFrom(path);
+	}
+
+	void MemoryFileAccessFactory::Remove(const std::string &name)
+	{
+		m_registry->Remove(name);
+	}
+
+} // namespace
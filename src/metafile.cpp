@@ -32,33 +32,99 @@ namespace metafile
 		return m_impl->GetLastError();
 	}
 
+	ErrorCode Metafile::GetLastErrorCode()
+	{
+		return m_impl->GetLastErrorCode();
+	}
+
 	void Metafile::Flush()
 	{
-		m_impl->FlushToDisk();
+		m_impl->Flush();
 	}
 
-	std::vector< FileThread* > Metafile::GetAllFileThreads()
+	bool Metafile::StartBackgroundFlush(const FlushPolicy &policy)
+	{
+		return m_impl->StartBackgroundFlush(policy);
+	}
+
+	void Metafile::StopBackgroundFlush()
+	{
+		m_impl->StopBackgroundFlush();
+	}
+
+	void Metafile::SetBufferResource(const std::shared_ptr<BufferResource> &resource)
 	{
-		auto threads = m_impl->GetRefToAllThreads();
-		std::vector<FileThread *> result;
+		m_impl->SetBufferResource(resource);
+	}
 
-		for (auto &item : threads)
-		{
-			result.push_back(&*item);
-		}
+	std::shared_ptr<BufferResource> Metafile::GetBufferResource()
+	{
+		return m_impl->GetBufferResource();
+	}
 
-		return result;
+	bool Metafile::Refresh()
+	{
+		return m_impl->Refresh();
+	}
+
+	void Metafile::SetExecutor(const std::shared_ptr<Executor> &executor)
+	{
+		m_impl->SetExecutor(executor);
+	}
+
+	std::future<AsyncResult> Metafile::FlushAsync(const AsyncCallback &callback, const CancellationToken &token)
+	{
+		return m_impl->FlushAsync(callback, token);
+	}
+
+	std::vector< FileThread* > Metafile::GetAllFileThreads()
+	{
+		return m_impl->GetRefToAllThreads();
 	}
 
 	FileThread* Metafile::GetFileThread(const std::string &name)
 	{
-		auto &thread = m_impl->GetRefToAllThreads();
-		for (auto &item : thread)
-		{
-			if (item->GetName() == name) return &*item;
-		}
+		return m_impl->GetThread(name.c_str(), name.size());
+	}
+
+	const std::vector<FileThread *> &Metafile::GetFileThreadList()
+	{
+		return m_impl->GetRefToAllThreads();
+	}
+
+	FileThread* Metafile::GetFileThread(const char *name, size_t length)
+	{
+		return m_impl->GetThread(name, length);
+	}
+
+	bool Metafile::ReadMany(std::vector<ReadRequest> &requests, uint32_t numberOfThreads)
+	{
+		return m_impl->ReadMany(requests, numberOfThreads);
+	}
+
+	FileThread* Metafile::CloneFileThread(const std::string &source, const std::string &newName)
+	{
+		return m_impl->CloneThread(source, newName);
+	}
+
+	bool Metafile::Snapshot(const std::string &suffix)
+	{
+		return m_impl->Snapshot(suffix);
+	}
+
+	bool Metafile::UpgradeFormat()
+	{
+		return m_impl->UpgradeFormat();
+	}
 
-		return nullptr;
+	bool Metafile::Seal(const std::string &outputPath)
+	{
+		return m_impl->Seal(outputPath);
+	}
+
+	bool Metafile::Verify(VerifyReport &report, const VerifyOptions &options)
+	{
+		return m_impl->Verify(report, options);
 	}
 
 	void Metafile::SetFileAccessInterface(const std::shared_ptr<FileAccessInterface> &file)
@@ -66,14 +132,39 @@ namespace metafile
 		m_impl->SetFileAccessInterface(file);
 	}
 
+	void Metafile::SetReaderSource(const std::shared_ptr<FileAccessInterfaceAbstractFactory> &factory, const std::string &path)
+	{
+		m_impl->SetReaderSource(factory, path);
+	}
+
+	void Metafile::SetReadOnly()
+	{
+		m_impl->SetReadOnly();
+	}
+
+	void Metafile::SetSingleWriter()
+	{
+		m_impl->SetSingleWriter();
+	}
+
 	void Metafile::Init()
 	{
 		m_impl->Init();
 	}
 
-	void Metafile::InitEmpty(const std::vector<std::string> &threadNames)
+	void Metafile::InitEmpty(const std::vector<std::string> &threadNames, const CreateOptions &options)
+	{
+		m_impl->InitEmpty(threadNames, options);
+	}
+
+	void Metafile::SetBaseFileAccessInterface(const std::shared_ptr<FileAccessInterface> &base)
+	{
+		m_impl->SetBaseFileAccessInterface(base);
+	}
+
+	void Metafile::InitOverlay()
 	{
-		m_impl->InitEmpty(threadNames);
+		m_impl->InitOverlay();
 	}
 
 } // namespace
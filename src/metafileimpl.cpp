@@ -7,17 +7,71 @@
 */
 
 #include "metafileimpl.h"
+#include "asyncqueue.h"
+#include "backgroundflusher.h"
+#include "bulkreader.h"
+#include "directory.h"
 #include <algorithm>
+#include <cstring>
+#include <thread>
 #include <assert.h>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
 namespace metafile
 {
+	static const uint32_t kExportBufferSize = 256 * 1024;
+	static const uint32_t kCopyBufferSize = 1024 * 1024;
+	static const uint32_t kMaxTransferSize = 1u << 30;	// FileThreadRead/Write take 32 bit sizes
+	static const uint32_t kAsyncChunkSize = 1024 * 1024;	// running async operations check cancellation between chunks
+	static const char *kRefcountThreadName = "$refcounts";
+	static const char *kSlabThreadName = "$slabs";
+	static const char *kFingerprintThreadName = "$fingerprints";
+	static const uint32_t kMaxSlabSlotSize = 64 * 1024;
+	static const uint64_t kDirectoryGranularity = 4096;
+	static const uint64_t kMaxZoneSize = 16 * 1024 * 1024;
+	static const uint32_t kFirstReadSize = 4096;	// header and index of a sealed file, usually
+	static const uint32_t kSealedAlignment = 4096;
+
+	static bool WriteToDescriptor(int fd, const char *data, uint32_t size)
+	{
+		while (size > 0)
+		{
+#ifdef _WIN32
+			int res = _write(fd, data, size);
+#else
+			ssize_t res = write(fd, data, size);
+#endif
+			if (res <= 0) return false;
+			data += res;
+			size -= (uint32_t)res;
+		}
+
+		return true;
+	}
+
 	MetafileImpl::MetafileImpl()
+		: m_errorCode(ErrorCode::None)
+		, m_readOnly(false)
+		, m_singleWriter(false)
+		, m_numberOfListedThreads(0)
+		, m_refcountThread(kNoThread)
+		, m_fingerprintThread(kNoThread)
+		, m_slabThread(kNoThread)
+		, m_endOfBlocks(0)
+		, m_endOfZones(0)
+		, m_appendsInFlight(0)
+		, m_flushing(false)
 	{
 	};
 
 	MetafileImpl::~MetafileImpl()
 	{
+		StopBackgroundFlush();
 		FlushToDisk();
 	};
 
@@ -26,46 +80,144 @@ namespace metafile
 		m_fileAccess = fileAccess;
 	}
 
+	void MetafileImpl::SetReaderSource(const std::shared_ptr<FileAccessInterfaceAbstractFactory> &factory, const std::string &path)
+	{
+		m_readerFactory = factory;
+		m_path = path;
+	}
+
+	void MetafileImpl::SetReadOnly()
+	{
+		m_readOnly = true;
+	}
+
+	void MetafileImpl::SetSingleWriter()
+	{
+		m_singleWriter = true;
+	}
+
 	void MetafileImpl::Init()
 	{
 		assert(m_fileAccess);
+		m_endOfBlocks = 0;
+
+		if (m_singleWriter && !m_fileAccess->LockForWriting())
+		{
+			// table of the other writer must survive close
+			m_readOnly = true;
+			SetError(ErrorCode::Locked, "File is locked by another writer");
+			return;
+		}
 
+		char head[kFirstReadSize];
 		m_fileAccess->SetPointerTo(0);
-		m_fileAccess->Read(&m_file.header, sizeof(m_file.header));
+		uint32_t headSize = m_fileAccess->Read(head, kFirstReadSize);
+
+		if (!TakeAccessError(*m_fileAccess)) return;
 
-		m_errorMessage = m_fileAccess->GetLastError();
-		if (!m_errorMessage.empty()) return;
+		// short file leaves the header as it was
+		if (headSize >= sizeof(m_file.header)) memcpy(&m_file.header, head, sizeof(m_file.header));
 
-		if (m_file.header.signature != MetafileHeader::kSignature ||
+		if (headSize < sizeof(m_file.header) ||
+			m_file.header.signature != MetafileHeader::GetSignature(m_file.header.version) ||
 			m_file.header.numberOfThreads > MetafileHeader::kMaxNumberOfThreads)
 		{
-			m_errorMessage = "Is not a metafile";
+			SetError(ErrorCode::NotMetafile, "Is not a metafile");
+			return;
+		}
+
+		if (m_file.header.version == MetafileHeader::kVersionSealed)
+		{
+			LoadSealedIndex(head, headSize);
 			return;
 		}
 
+		std::vector<FileThreadInfo> table;
+		if (!ReadTable(*m_fileAccess, m_file.header, table)) return;
+
 		m_file.threads.resize(m_file.header.numberOfThreads);
 
 		for (uint32_t i = 0; i < m_file.threads.size(); i++)
 		{
 			auto &item = m_file.threads[i];
-			m_fileAccess->Read(&item.header, sizeof(item.header));
+			item.header = table[i];
 			item.interfaceObject.m_impl = this;
 			item.interfaceObject.m_index = i;
 			item.currentOffset = 0;
+
+			if (!IsValidProfile(item.header))
+			{
+				SetError(ErrorCode::UnsupportedFormat, "Unsupported stream profile");
+				return;
+			}
+		}
+
+		LoadSlabs();
+
+		// overlay never shares its own blocks, base blocks are copied per stream anyway
+		if (!(m_file.header.flags & MetafileHeader::kFlagOverlay))
+		{
+			LoadRefcounts();
+			LoadFingerprints();
+			if (!m_readOnly) FindFreeZones();
+			return;
+		}
+
+		MetafileHeader baseHeader;
+		if (!m_baseAccess)
+		{
+			SetError(ErrorCode::BaseMismatch, "Overlay needs its base container");
+			return;
 		}
 
-		m_errorMessage = m_fileAccess->GetLastError();
+		if (!LoadBaseTable(baseHeader)) return;
+
+		if (baseHeader.numberOfThreads > m_file.header.numberOfThreads ||
+			baseHeader.sizeOfCluster != m_file.header.sizeOfCluster || !CheckBase())
+		{
+			SetError(ErrorCode::BaseMismatch, "Base container does not match overlay");
+		}
 	}
 
-	void MetafileImpl::InitEmpty(const std::vector<std::string> &threadNames)
+	void MetafileImpl::InitEmpty(const std::vector<std::string> &threadNames, const CreateOptions &options)
 	{
 		assert(m_fileAccess);
+
+		m_endOfBlocks = 0;
+
+		if (threadNames.size() > MetafileHeader::kMaxNumberOfThreads)
+		{
+			SetError(ErrorCode::InvalidOptions, "Too many streams");
+			return;
+		}
+
 		m_fileAccess->SetPointerTo(0);
 
+		if (options.formatVersion > MetafileHeader::kCurrentVersion)
+		{
+			SetError(ErrorCode::UnsupportedFormat, "Unsupported format version");
+			return;
+		}
+
 		memset(&m_file.header, 0, sizeof(m_file.header));
-		m_file.header.signature = MetafileHeader::kSignature;
+		m_file.header.version = options.formatVersion ? options.formatVersion : MetafileHeader::kCurrentVersion;
+		m_file.header.signature = MetafileHeader::GetSignature(m_file.header.version);
 		m_file.header.numberOfThreads = threadNames.size();
-		m_file.header.sizeOfCluster = MetafileHeader::kDefaultClusterSize;
+		m_file.header.sizeOfCluster = options.clusterSize ? options.clusterSize : MetafileHeader::kDefaultClusterSize;
+
+		// block sizes are multiples of cluster, so aligned cluster keeps every block aligned
+		uint32_t alignment = std::max(1u, m_fileAccess->GetAlignment());
+		m_file.header.sizeOfCluster = (m_file.header.sizeOfCluster + alignment - 1) / alignment * alignment;
+
+		if (options.smallStreamSize > kMaxSlabSlotSize)
+		{
+			SetError(ErrorCode::InvalidOptions, "Small stream size is too big");
+			return;
+		}
+
+		m_file.header.slabSlotSize = options.smallStreamSize;
+		m_slabThread = kNoThread;
+		m_freeSlots.clear();
 
 		m_fileAccess->Write(&m_file.header, sizeof(m_file.header));
 
@@ -79,231 +231,2970 @@ namespace metafile
 			strncpy(item.header.name, threadNames[i].c_str(), sizeof(item.header.name) - 1);
 			item.header.size = 0;
 
+			auto profile = options.profiles.find(threadNames[i]);
+			if (!PackProfile(profile != options.profiles.end() ? profile->second : options.defaultProfile, item.header))
+			{
+				SetError(ErrorCode::InvalidOptions, "Invalid profile of stream " + threadNames[i]);
+				return;
+			}
+
 			item.interfaceObject.m_impl = this;
 			item.interfaceObject.m_index = i;
 
 			item.currentOffset = 0;
 		}
 
+		if (options.deduplicate)
+		{
+			m_file.header.flags |= MetafileHeader::kFlagDedup;
+			AddThread(kRefcountThreadName, FileThreadInfo::kFlagHidden, m_refcountThread);
+			AddThread(kFingerprintThreadName, FileThreadInfo::kFlagHidden, m_fingerprintThread);
+		}
+
 		FlushToDisk();
 	}
 
-	bool MetafileImpl::IsValid()
+	void MetafileImpl::SetBaseFileAccessInterface(const std::shared_ptr<FileAccessInterface> &baseAccess)
 	{
-		return m_errorMessage.empty();
+		m_baseAccess = baseAccess;
 	}
 
-	std::string MetafileImpl::GetLastError()
+	void MetafileImpl::InitOverlay()
 	{
-		return m_errorMessage;
-	}
+		assert(m_fileAccess && m_baseAccess);
+		m_endOfBlocks = 0;
 
-	std::vector< FileThread *> MetafileImpl::GetRefToAllThreads()
-	{
-		std::vector< FileThread *> res;
-		for (auto &item : m_file.threads)
+		if (!LoadBaseTable(m_file.header)) return;
+		m_file.header.flags |= MetafileHeader::kFlagOverlay;
+		m_file.header.baseTableHash = HashBaseTable();
+
+		m_file.threads.resize(m_file.header.numberOfThreads);
+
+		for (uint32_t i = 0; i < m_file.threads.size(); i++)
 		{
-			res.push_back(&item.interfaceObject);
+			auto &item = m_file.threads[i];
+			item.header = m_baseThreads[i];
+
+			// slot offset is not an address, slab data goes with "$slabs"
+			for (auto &block : item.header.blocks)
+			{
+				if (item.header.flags & FileThreadInfo::kFlagSlab) break;
+				if (block.offsetInUnderlyingFile != 0) block.offsetInUnderlyingFile |= FileThreadInfo::kBlockInBase;
+			}
+
+			item.interfaceObject.m_impl = this;
+			item.interfaceObject.m_index = i;
+			item.currentOffset = 0;
 		}
 
-		return res;
+		LoadSlabs();
+
+		// overlay blocks go right after the table, leftovers of old file would only take space
+		m_fileAccess->SetFileSize(0);
+		FlushToDisk();
 	}
 
-	void MetafileImpl::FlushToDisk()
+	bool MetafileImpl::LoadBaseTable(MetafileHeader &baseHeader)
 	{
-		m_fileAccess->SetPointerTo(0);
-		m_fileAccess->Write(&m_file.header, sizeof(MetafileHeader));
+		m_baseAccess->SetPointerTo(0);
+		m_baseAccess->Read(&baseHeader, sizeof(baseHeader));
 
-		for (auto &item : m_file.threads)
+		if (!TakeAccessError(*m_baseAccess)) return false;
+
+		if (baseHeader.signature != MetafileHeader::GetSignature(baseHeader.version) ||
+			baseHeader.numberOfThreads > MetafileHeader::kMaxNumberOfThreads ||
+			(baseHeader.flags & MetafileHeader::kFlagOverlay))
 		{
-			m_fileAccess->Write(&item.header, sizeof(FileThreadInfo));
+			SetError(ErrorCode::BaseMismatch, "Base is not a metafile");
+			return false;
 		}
 
-		m_fileAccess->Flush();
-		m_errorMessage = m_fileAccess->GetLastError();
+		return ReadTable(*m_baseAccess, baseHeader, m_baseThreads);
 	}
 
-	std::string MetafileImpl::FileThreadGetName(uint32_t index)
+	uint64_t MetafileImpl::HashBaseTable()
 	{
-		assert(index < m_file.threads.size());
-		return std::string(m_file.threads[index].header.name);
+		// what overlay depends on: names, sizes and where the blocks are
+		std::vector<char> table;
+		for (auto &info : m_baseThreads)
+		{
+			table.insert(table.end(), info.name, info.name + strnlen(info.name, sizeof(info.name)));
+			table.push_back(0);
+			table.insert(table.end(), (const char *)&info.size, (const char *)&info.size + sizeof(info.size));
+			table.insert(table.end(), (const char *)info.blocks, (const char *)(info.blocks + FileThreadInfo::kNumberOfBlockRecords));
+		}
+
+		// 0 is kept for overlays made without the hash
+		uint64_t hash = table.empty() ? 0 : ComputeFingerprint(&table[0], table.size()).hash[0];
+		return hash != 0 ? hash : 1;
 	}
 
-	uint64_t MetafileImpl::FileThreadGetSize(uint32_t index)
+	bool MetafileImpl::CheckBase()
 	{
-		assert(index < m_file.threads.size());
-		return m_file.threads[index].header.size;
+		if (m_file.header.baseTableHash != 0 && m_file.header.baseTableHash != HashBaseTable()) return false;
+
+		// older overlays have no hash, unmodified blocks still must be where base has them
+		for (uint32_t i = 0; i < m_baseThreads.size(); i++)
+		{
+			if (m_file.threads[i].header.flags & FileThreadInfo::kFlagSlab) continue;
+
+			for (uint32_t j = 0; j < FileThreadInfo::kNumberOfBlockRecords; j++)
+			{
+				uint64_t record = m_file.threads[i].header.blocks[j].offsetInUnderlyingFile;
+				if ((record & FileThreadInfo::kBlockInBase) &&
+					(record & FileThreadInfo::kOffsetMask) != m_baseThreads[i].blocks[j].offsetInUnderlyingFile)
+				{
+					return false;
+				}
+			}
+		}
+
+		return true;
 	}
 
-	bool MetafileImpl::FileThreadSetSize(uint32_t index, uint64_t newFileSize)
+	bool MetafileImpl::ReadTable(FileAccessInterface &access, const MetafileHeader &header, std::vector<FileThreadInfo> &table)
 	{
-		assert(index < m_file.threads.size());
-		RuntimeThreadInfo &item = m_file.threads[index];
-		item.header.size = newFileSize;
+		if (header.version > MetafileHeader::kCurrentVersion)
+		{
+			SetError(ErrorCode::UnsupportedFormat, "Unsupported format version");
+			return false;
+		}
 
-		uint32_t blockNumber;
-		uint64_t offsetInBlock;
+		table.resize(header.numberOfThreads);
 
-		bool res = GetBlockByAddress(item.header.size, blockNumber, offsetInBlock);
-		if (!res)	return false;
+		// whole table in one request, unbuffered backends would turn each record into a read-modify cycle
+		access.SetPointerTo(sizeof(MetafileHeader));
+		if (header.version < MetafileHeader::kVersionDirectory)
+		{
+			if (!table.empty()) access.Read(&table[0], (uint32_t)(sizeof(FileThreadInfo) * table.size()));
 
-		if (offsetInBlock != 0) blockNumber++;
+			return TakeAccessError(access);
+		}
 
-		while (blockNumber < FileThreadInfo::kNumberOfBlockRecords && item.header.blocks[blockNumber].offsetInUnderlyingFile != 0)
+		if (header.directorySize > header.directoryCapacity)
 		{
-			item.header.blocks[blockNumber].offsetInUnderlyingFile = 0;
-			blockNumber++;
+			SetError(ErrorCode::Damaged, "Damaged directory");
+			return false;
+		}
+
+		std::vector<char> directory(header.directorySize);
+		if (!directory.empty()) access.Read(&directory[0], header.directorySize);
+
+		if (!TakeAccessError(access)) return false;
+
+		if (!ParseDirectory(directory.data(), directory.size(), table))
+		{
+			SetError(ErrorCode::Damaged, "Damaged directory");
+			return false;
 		}
 
-		uint64_t futherstPosInFile = FindAddressToAppendNewBlock();
-		m_fileAccess->SetFileSize(futherstPosInFile);
 		return true;
 	}
 
-
-	uint32_t MetafileImpl::FileThreadWrite(uint32_t index, void *data, uint32_t size)
+	bool MetafileImpl::LoadSealedIndex(const char *head, uint32_t headSize)
 	{
-		assert(index < m_file.threads.size());
-		RuntimeThreadInfo &item = m_file.threads[index];
+		// nothing is ever written to a sealed file
+		m_readOnly = true;
 
-		if (item.currentOffset + size > item.header.size)
+		const MetafileHeader &header = m_file.header;
+		uint64_t entriesSize = (uint64_t)header.numberOfThreads * sizeof(SealedEntry);
+
+		if (header.directorySize > header.directoryCapacity || header.directorySize < entriesSize ||
+			(header.flags & MetafileHeader::kFlagOverlay))
 		{
-			item.header.size = item.currentOffset + size;
+			SetError(ErrorCode::Damaged, "Damaged directory");
+			return false;
 		}
 
-		return FileIoOperation(index, data, size, &FileAccessInterface::Write);
-	}
+		// index is usually in the first read already
+		std::vector<char> index(header.directorySize);
+		uint32_t inHead = std::min(header.directorySize, headSize - (uint32_t)sizeof(MetafileHeader));
+		if (inHead != 0) memcpy(&index[0], head + sizeof(MetafileHeader), inHead);
 
-	uint32_t MetafileImpl::FileThreadRead(uint32_t index, void *data, uint32_t size)
-	{
-		assert(index < m_file.threads.size());
-		RuntimeThreadInfo &item = m_file.threads[index];
+		if (inHead < index.size())
+		{
+			m_fileAccess->SetPointerTo(sizeof(MetafileHeader) + inHead);
+			m_fileAccess->Read(&index[inHead], (uint32_t)(index.size() - inHead));
+			if (!TakeAccessError(*m_fileAccess)) return false;
+		}
 
-		if (item.currentOffset + size > item.header.size)
+		const char *names = index.data() + entriesSize;
+		uint64_t namesSize = index.size() - entriesSize;
+		uint64_t dataRegionStart = GetDataRegionStart();
+
+		m_file.threads.resize(header.numberOfThreads);
+
+		for (uint32_t i = 0; i < m_file.threads.size(); i++)
 		{
-			assert(item.currentOffset <= item.header.size);
-			size = static_cast<uint32_t>(item.header.size - item.currentOffset);
+			SealedEntry entry;
+			memcpy(&entry, &index[i * sizeof(SealedEntry)], sizeof(entry));
+
+			auto &item = m_file.threads[i];
+			memset(&item.header, 0, sizeof(item.header));
+			item.interfaceObject.m_impl = this;
+			item.interfaceObject.m_index = i;
+			item.currentOffset = 0;
+
+			if (entry.nameLength >= sizeof(item.header.name) || entry.nameOffset > namesSize || namesSize - entry.nameOffset < entry.nameLength ||
+				(entry.size != 0 && (entry.offset < dataRegionStart || entry.size > FileThreadInfo::kOffsetMask - entry.offset)))
+			{
+				SetError(ErrorCode::Damaged, "Damaged directory");
+				return false;
+			}
+
+			memcpy(item.header.name, names + entry.nameOffset, entry.nameLength);
+			item.header.size = entry.size;
+			item.header.flags = entry.flags;
+			item.header.growth = FileThreadInfo::kGrowthExtent;
+			item.header.blocks[0].offsetInUnderlyingFile = entry.size != 0 ? entry.offset : 0;
+
+			// FindThread searches by halves
+			if (i != 0 && strcmp(m_file.threads[i - 1].header.name, item.header.name) >= 0)
+			{
+				SetError(ErrorCode::Damaged, "Damaged directory");
+				return false;
+			}
 		}
 
-		return FileIoOperation(index, data, size, &FileAccessInterface::Read);
+		return true;
 	}
 
-	uint32_t MetafileImpl::FileIoOperation(uint32_t index, void *data, uint32_t size, MetafileImpl::IoOperationFunction operation)
+	bool MetafileImpl::Seal(const std::string &outputPath)
 	{
-		assert(index < m_file.threads.size());
-		RuntimeThreadInfo &item = m_file.threads[index];
+		auto lock = LockTable();
+		if (!IsValid()) return false;
 
-		uint32_t actuallyProcessed = 0;
-		char *_data = (char *)data;
+		if (!m_readerFactory)
+		{
+			SetError(ErrorCode::InvalidOptions, "No backend to create " + outputPath);
+			return false;
+		}
 
-		uint32_t blockNumber;
-		uint64_t offsetInBlock;
-		bool res = GetBlockByAddress(item.currentOffset, blockNumber, offsetInBlock);
-		if (!res)	return false;
+		// visible streams by name
+		std::vector<uint32_t> order;
+		for (uint32_t i = 0; i < m_file.threads.size(); i++)
+		{
+			if (!(m_file.threads[i].header.flags & FileThreadInfo::kFlagHidden)) order.push_back(i);
+		}
+
+		std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b)
+		{
+			return strcmp(m_file.threads[a].header.name, m_file.threads[b].header.name) < 0;
+		});
+
+		auto output = m_readerFactory->CreateFile();
+		output->UseFile(outputPath);
+		if (output->IsValid()) output->SetFileSize(0);
+
+		if (!output->IsValid())
+		{
+			SetError(ErrorCode::IoError, output->GetLastError());
+			return false;
+		}
+
+		MetafileHeader header;
+		memset(&header, 0, sizeof(header));
+		header.version = MetafileHeader::kVersionSealed;
+		header.signature = MetafileHeader::GetSignature(header.version);
+		header.numberOfThreads = (uint32_t)order.size();
+		header.sizeOfCluster = std::max(kSealedAlignment, output->GetAlignment());
+
+		// header, entries and names are written at once
+		std::vector<char> table(sizeof(MetafileHeader) + order.size() * sizeof(SealedEntry));
+		std::vector<SealedEntry> entries(order.size());
+		uint64_t namesSize = 0;
+
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			const FileThreadInfo &info = m_file.threads[order[i]].header;
+			uint8_t nameLength = (uint8_t)strnlen(info.name, sizeof(info.name) - 1);
+
+			memset(&entries[i], 0, sizeof(SealedEntry));
+			entries[i].size = FileThreadGetSize(order[i]);
+			entries[i].nameOffset = (uint32_t)namesSize;
+			entries[i].flags = (uint16_t)(info.flags & FileThreadInfo::kFlagSnapshot);
+			entries[i].nameLength = nameLength;
+
+			table.insert(table.end(), info.name, info.name + nameLength);
+			namesSize += nameLength;
+		}
 
-		while (actuallyProcessed < size && m_fileAccess->IsValid())
+		uint64_t alignment = header.sizeOfCluster;
+		uint64_t offset = (table.size() + alignment - 1) / alignment * alignment;
+		header.directorySize = (uint32_t)(table.size() - sizeof(MetafileHeader));
+		header.directoryCapacity = (uint32_t)(offset - sizeof(MetafileHeader));
+
+		// streams first, file is not a metafile until the header is there
+		for (size_t i = 0; i < order.size() && IsValid(); i++)
 		{
-			for (unsigned i = 0; i <= blockNumber && item.header.blocks[blockNumber].offsetInUnderlyingFile == 0; i++)
+			SealedEntry &entry = entries[i];
+			if (entry.size == 0) continue;
+
+			entry.offset = offset;
+			offset = (offset + entry.size + alignment - 1) / alignment * alignment;
+
+			output->SetPointerTo(entry.offset);
+			uint64_t copied = FileThreadScan(order[i], 0, entry.size, [&](uint64_t, const char *data, size_t size)
 			{
-				if (item.header.blocks[i].offsetInUnderlyingFile != 0) continue;
-				item.header.blocks[i].offsetInUnderlyingFile = FindAddressToAppendNewBlock();
-			}
+				return output->Write((void *)data, (uint32_t)size) == size;
+			});
 
-			uint64_t blockSize = GetBlockSizeByIndex(blockNumber);
-			uint64_t sizeToEndOfBlock = blockSize - offsetInBlock;
-			uint32_t sizeToProcess = (uint32_t)std::min(sizeToEndOfBlock, (uint64_t)(size - actuallyProcessed));
+			if (copied != entry.size && IsValid()) SetError(ErrorCode::IoError, "Can not write " + outputPath);
+		}
 
-			m_fileAccess->SetPointerTo(item.header.blocks[blockNumber].offsetInUnderlyingFile + offsetInBlock);
+		if (!IsValid()) return false;
 
-			(&*m_fileAccess->*operation)(_data + actuallyProcessed, sizeToProcess);
-			actuallyProcessed += sizeToProcess;
-			item.currentOffset += sizeToProcess;
+		memcpy(&table[0], &header, sizeof(header));
+		if (!entries.empty()) memcpy(&table[sizeof(header)], &entries[0], entries.size() * sizeof(SealedEntry));
 
-			blockNumber++;
-			offsetInBlock = 0;
+		output->SetPointerTo(0);
+		output->Write(&table[0], (uint32_t)table.size());
+		output->Sync();
+
+		if (!output->GetLastError().empty())
+		{
+			SetError(ErrorCode::IoError, "Can not write " + outputPath);
+			return false;
 		}
 
-		m_errorMessage = m_fileAccess->GetLastError();
-		return actuallyProcessed;
+		return true;
 	}
 
-	void MetafileImpl::FileThreadSetPointerTo(uint32_t index, uint64_t pos)
+	bool MetafileImpl::Refresh()
 	{
-		assert(index < m_file.threads.size());
-		RuntimeThreadInfo &item = m_file.threads[index];
-		item.currentOffset = pos;
-	}
+		// writer's own view is always current
+		if (!m_readOnly || !IsValid()) return IsValid();
 
-	uint64_t MetafileImpl::FindAddressToAppendNewBlock()
-	{
-		uint64_t ans = sizeof(MetafileHeader) + sizeof(FileThreadInfo) * m_file.threads.size();
+		MetafileHeader header;
+		m_fileAccess->SetPointerTo(0);
+		if (m_fileAccess->Read(&header, sizeof(header)) != sizeof(header))
+		{
+			TakeAccessError(*m_fileAccess);
+			return false;
+		}
 
-		for (auto &item : m_file.threads)
+		// odd - writer is in the middle of a flush, next Refresh picks it up
+		if (header.generation == m_file.header.generation || (header.generation & 1)) return true;
+
+		if (header.signature != MetafileHeader::GetSignature(header.version) || header.numberOfThreads > MetafileHeader::kMaxNumberOfThreads ||
+			header.numberOfThreads < m_file.threads.size())
 		{
-			uint32_t sizeOfBlocksArray = 0;
+			SetError(ErrorCode::NotMetafile, "Is not a metafile");
+			return false;
+		}
 
-			for (uint32_t i = 0; i < sizeof(item.header.blocks); i++)
+		std::vector<FileThreadInfo> table;
+		if (!ReadTable(*m_fileAccess, header, table)) return false;
+
+		// table read while writer was flushing may be torn, it's skipped until the next Refresh
+		MetafileHeader check;
+		m_fileAccess->SetPointerTo(0);
+		m_fileAccess->Read(&check, sizeof(check));
+		if (check.generation != header.generation) return true;
+
+		for (uint32_t i = 0; i < table.size(); i++)
+		{
+			if (!IsValidProfile(table[i]))
 			{
-				if (item.header.blocks[i].offsetInUnderlyingFile == 0)
-				{
-					sizeOfBlocksArray = i;
-					break;
-				}
+				SetError(ErrorCode::UnsupportedFormat, "Unsupported stream profile");
+				return false;
 			}
 
-			if (sizeOfBlocksArray == 0) continue;
+			if (i == m_file.threads.size())
+			{
+				m_file.threads.push_back(RuntimeThreadInfo());
+				m_file.threads[i].interfaceObject.m_impl = this;
+				m_file.threads[i].interfaceObject.m_index = i;
+			}
 
-			uint64_t candidate = item.header.blocks[sizeOfBlocksArray - 1].offsetInUnderlyingFile
-				+ GetBlockSizeByIndex(sizeOfBlocksArray - 1);
+			RuntimeThreadInfo &item = m_file.threads[i];
+			if (memcmp(&item.header, &table[i], sizeof(FileThreadInfo)) == 0) continue;
 
-			if (ans < candidate) ans = candidate;
+			item.header = table[i];
+			item.currentOffset = std::min(item.currentOffset, item.header.size);
 		}
 
-		return ans;
+		m_file.header = header;
+		m_endOfBlocks = 0;
+		LoadSlabs();
+		return IsValid();
+	}
+
+	static void AddProblem(VerifyReport &report, const std::string &problem, bool repaired)
+	{
+		report.problems.push_back(repaired ? problem + ", repaired" : problem);
+		if (repaired) report.numberOfRepaired++;
 	}
 
-	uint64_t MetafileImpl::GetBlockSizeByIndex(uint32_t index)
+	bool MetafileImpl::Verify(VerifyReport &report, const VerifyOptions &options)
 	{
-		if (index == 0) return m_file.header.sizeOfCluster;
-		if (index < 5) return index * m_file.header.sizeOfCluster;
+		auto lock = LockTable();
+
+		report = VerifyReport();
+
+		if (!IsValid())
+		{
+			AddProblem(report, m_errorMessage, false);
+			return false;
+		}
 
-		uint32_t currentIndex = 4;
-		uint64_t val = 4;
+		bool repair = options.repair && !m_readOnly;
+		uint32_t numberOfThreads = options.numberOfThreads ? options.numberOfThreads : std::max(1u, std::thread::hardware_concurrency());
 
-		int stepNumber = 0;
-		while (currentIndex < index)
+		if (m_file.header.sizeOfCluster == 0) AddProblem(report, "Cluster size is 0", false);
+
+		// single writer stopped in the middle of a flush
+		if (m_file.header.generation & 1)
 		{
-			if (stepNumber % 2 == 0) val = val / 2 * 3;
-			else val = val / 3 * 4;
+			AddProblem(report, "Table was not completely written", repair);
+			if (repair) m_file.header.generation++;
+		}
 
-			stepNumber++;
-			currentIndex++;
+		// fixes which may move blocks come last, extents stay valid until then
+		std::vector<BlockExtent> extents;
+		VerifyStreams(extents, report);
+		VerifyExtents(extents, repair, report);
+		VerifyFingerprints(extents, repair, report);
+		if (options.readBlocks) ScanBlocks(extents, numberOfThreads, repair, report);
+		VerifySharing(repair, report);
+
+		if (repair && report.numberOfRepaired != 0)
+		{
+			FlushToDisk();
+			if (!IsValid()) AddProblem(report, m_errorMessage, false);
 		}
 
-		return val * m_file.header.sizeOfCluster;
+		return report.problems.size() == report.numberOfRepaired;
 	}
 
-	bool MetafileImpl::GetBlockByAddress(uint64_t address, uint32_t &block, uint64_t &offsetInBlock)
+	std::string MetafileImpl::DescribeBlock(uint32_t index, uint32_t block)
 	{
-		block = 0;
-		uint64_t currertStartAddress = 0;
+		return std::string("Stream ") + m_file.threads[index].header.name + " block " + std::to_string(block);
+	}
 
-		while (block < FileThreadInfo::kNumberOfBlockRecords)
+	void MetafileImpl::VerifyStreams(std::vector<BlockExtent> &extents, VerifyReport &report)
+	{
+		for (uint32_t index = 0; index < m_file.threads.size(); index++)
 		{
-			uint64_t currentSize = GetBlockSizeByIndex(block);
+			const FileThreadInfo &header = m_file.threads[index].header;
+			std::string name = std::string("Stream ") + header.name;
+
+			uint32_t first;
+			if (FindThread(header.name, strlen(header.name), first) && first != index) AddProblem(report, name + ": name is used twice", false);
+
+			// slots are checked on open
+			if (IsSlab(index)) continue;
 
-			if (currertStartAddress + currentSize <= address)
+			uint32_t lastBlock;
+			uint64_t offsetInBlock;
+			if (header.size != 0 && !GetBlockByAddress(index, header.size - 1, lastBlock, offsetInBlock))
 			{
-				block++;
-				currertStartAddress += currentSize;
-				continue;
+				AddProblem(report, name + ": size is beyond the last block", false);
 			}
 
-			offsetInBlock = address - currertStartAddress;
-			return true;
+			// blocks are allocated from the start, zero record ends them
+			bool hole = false;
+			uint64_t previousEnd = 0;
+			for (uint32_t block = 0; block < FileThreadInfo::kNumberOfBlockRecords; block++)
+			{
+				uint64_t record = header.blocks[block].offsetInUnderlyingFile;
+				if (record == 0)
+				{
+					hole = true;
+					continue;
+				}
+
+				if (hole) AddProblem(report, DescribeBlock(index, block) + " is allocated after a hole", false);
+				hole = false;
+
+				if (record & FileThreadInfo::kBlockInBase) continue;
+
+				uint64_t address = record & FileThreadInfo::kOffsetMask;
+				uint64_t prefix = (record & FileThreadInfo::kBlockPartial) ? GetClusterBitmapSize(index, block) : 0;
+
+				BlockExtent extent = { address - std::min(prefix, address), address + GetBlockSize(index, block), record, index, block };
+				extents.push_back(extent);
+
+				if (extent.start != previousEnd) report.numberOfFragments++;
+				previousEnd = extent.end;
+			}
 		}
+	}
 
-		return false;
+	void MetafileImpl::VerifyExtents(std::vector<BlockExtent> &extents, bool repair, VerifyReport &report)
+	{
+		std::sort(extents.begin(), extents.end(), [](const BlockExtent &a, const BlockExtent &b)
+		{
+			return a.start != b.start ? a.start < b.start : a.end < b.end;
+		});
+
+		uint64_t dataRegionStart = GetDataRegionStart();
+		uint64_t usedEnd = dataRegionStart;
+		const BlockExtent *last = nullptr;	// extent which reaches usedEnd
+
+		for (auto &extent : extents)
+		{
+			if (extent.start < dataRegionStart)
+			{
+				AddProblem(report, DescribeBlock(extent.index, extent.block) + " overlaps the table", false);
+			}
+			else if (last && extent.start < usedEnd)
+			{
+				// shared block is listed once for every stream
+				if (extent.start != last->start || extent.end != last->end)
+				{
+					AddProblem(report, DescribeBlock(extent.index, extent.block) + " overlaps " + DescribeBlock(last->index, last->block), false);
+				}
+			}
+			else if (extent.start > usedEnd)
+			{
+				// released blocks are not reused, so some of this is normal
+				report.leakedSize += extent.start - usedEnd;
+			}
+
+			if (extent.end > usedEnd)
+			{
+				usedEnd = extent.end;
+				last = &extent;
+			}
+		}
+
+		// file ends inside the last block until it is written up to its end. anything
+		// after it was written by a writer which stopped before saving the table
+		uint64_t fileSize = m_fileAccess->GetFileSize();
+		if (fileSize > usedEnd)
+		{
+			report.leakedSize += fileSize - usedEnd;
+			AddProblem(report, std::to_string(fileSize - usedEnd) + " bytes after the last block are not used", repair);
+			if (repair) m_fileAccess->SetFileSize(usedEnd);
+		}
+	}
+
+	void MetafileImpl::VerifyFingerprints(const std::vector<BlockExtent> &extents, bool repair, VerifyReport &report)
+	{
+		if (m_fingerprintThread == kNoThread) return;
+
+		// saved again on repair
+		if (FileThreadGetSize(m_fingerprintThread) % sizeof(FingerprintRecord) != 0) AddProblem(report, "Fingerprint stream is damaged", repair);
+
+		std::map<uint64_t, uint64_t> blockSizes;
+		for (auto &extent : extents) blockSizes[extent.record] = extent.end - extent.start;
+
+		std::vector<uint64_t> stale;
+		for (auto &item : m_fingerprintOf)
+		{
+			auto block = blockSizes.find(item.first);
+			if (block == blockSizes.end() || block->second != item.second.size) stale.push_back(item.first);
+		}
+
+		for (auto address : stale)
+		{
+			AddProblem(report, "Fingerprint of block at " + std::to_string(address) + " does not match any block", repair);
+			if (repair) ForgetFingerprint(address);
+		}
+	}
+
+	void MetafileImpl::ScanBlocks(const std::vector<BlockExtent> &extents, uint32_t numberOfThreads, bool repair, VerifyReport &report)
+	{
+		// extents are sorted, shared block is read once
+		std::vector<const BlockExtent *> blocks;
+		for (auto &extent : extents)
+		{
+			if (!blocks.empty() && blocks.back()->start == extent.start && blocks.back()->end == extent.end) continue;
+			blocks.push_back(&extent);
+			report.scannedSize += extent.end - extent.start;
+		}
+
+		if (blocks.empty()) return;
+
+		// other handles must see everything written through this one
+		m_fileAccess->Flush();
+
+		auto factory = m_readerFactory;
+		auto path = m_path;
+		auto buffers = GetBufferResource();
+		if (!factory) numberOfThreads = 1;
+		uint32_t numberOfWorkers = (uint32_t)std::min((size_t)numberOfThreads, blocks.size());
+
+		// every worker reads its own contiguous part of the file, parts have about the same size
+		std::vector<size_t> bounds(numberOfWorkers + 1, blocks.size());
+		bounds[0] = 0;
+		uint64_t scanned = 0;
+		for (size_t i = 0, worker = 1; i < blocks.size() && worker < numberOfWorkers; i++)
+		{
+			scanned += blocks[i]->end - blocks[i]->start;
+			while (worker < numberOfWorkers && scanned >= report.scannedSize * worker / numberOfWorkers) bounds[worker++] = i + 1;
+		}
+
+		std::mutex resultLock;
+		std::vector<std::string> problems;
+		std::vector<uint64_t> mismatched;
+
+		auto work = [&](size_t begin, size_t end)
+		{
+			auto openReader = [&]() -> std::shared_ptr<FileAccessInterface>
+			{
+				if (!factory) return m_fileAccess;
+				auto access = factory->CreateFile();
+				access->UseFileReadOnly(path);
+				return access;
+			};
+
+			std::shared_ptr<FileAccessInterface> reader = openReader();
+			std::vector<char, BufferAllocator<char> > buffer((BufferAllocator<char>(buffers.get())));
+
+			for (size_t i = begin; i < end; i++)
+			{
+				const BlockExtent &extent = *blocks[i];
+				uint64_t size = extent.end - extent.start;
+
+				// fingerprint needs whole block, others are only read through
+				auto fingerprint = m_fingerprintOf.find(extent.record);
+				bool whole = fingerprint != m_fingerprintOf.end();
+				buffer.resize((size_t)(whole ? size : std::min(size, (uint64_t)kCopyBufferSize)));
+
+				uint64_t done = 0;
+				while (done < size)
+				{
+					uint32_t sizeToProcess = (uint32_t)std::min(size - done, whole ? (uint64_t)kMaxTransferSize : (uint64_t)buffer.size());
+					char *data = whole ? &buffer[(size_t)done] : &buffer[0];
+
+					reader->SetPointerTo(extent.start + done);
+					uint32_t res = reader->Read(data, sizeToProcess);
+					done += res;
+
+					// block is allocated but not written up to here, it reads as zeros
+					if (res < sizeToProcess) break;
+				}
+
+				std::string error = reader->IsValid() ? reader->GetLastError() : "file is closed";
+				if (!error.empty())
+				{
+					std::lock_guard<std::mutex> lock(resultLock);
+					problems.push_back(DescribeBlock(extent.index, extent.block) + " can not be read: " + error);
+
+					reader = openReader();
+					continue;
+				}
+
+				if (!whole) continue;
+				memset(&buffer[(size_t)done], 0, (size_t)(size - done));
+
+				Fingerprint actual = ComputeFingerprint(&buffer[0], (size_t)size);
+				if (actual.hash[0] != fingerprint->second.hash[0] || actual.hash[1] != fingerprint->second.hash[1])
+				{
+					std::lock_guard<std::mutex> lock(resultLock);
+					mismatched.push_back(extent.record);
+				}
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (uint32_t i = 1; i < numberOfWorkers; i++) workers.push_back(std::thread(work, bounds[i], bounds[i + 1]));
+		work(bounds[0], bounds[1]);
+		for (auto &worker : workers) worker.join();
+
+		std::sort(problems.begin(), problems.end());
+		for (auto &problem : problems) AddProblem(report, problem, false);
+
+		// content changed after the index was saved, it must not be shared any more
+		std::sort(mismatched.begin(), mismatched.end());
+		for (auto address : mismatched)
+		{
+			AddProblem(report, "Block at " + std::to_string(address) + " does not match its fingerprint", repair);
+			if (repair) ForgetFingerprint(address);
+		}
+	}
+
+	void MetafileImpl::CountReferences(std::map<uint64_t, uint64_t> &references)
+	{
+		references.clear();
+
+		for (uint32_t index = 0; index < m_file.threads.size(); index++)
+		{
+			if (IsSlab(index)) continue;
+
+			for (auto &block : m_file.threads[index].header.blocks)
+			{
+				if (block.offsetInUnderlyingFile != 0) references[block.offsetInUnderlyingFile]++;
+			}
+		}
+	}
+
+	void MetafileImpl::VerifySharing(bool repair, VerifyReport &report)
+	{
+		// overlay copies base blocks per stream, it never shares
+		if (m_file.header.flags & MetafileHeader::kFlagOverlay) return;
+
+		if (m_refcountThread != kNoThread && FileThreadGetSize(m_refcountThread) % sizeof(RefcountRecord) != 0)
+		{
+			AddProblem(report, "Reference count stream is damaged", repair);
+		}
+
+		std::map<uint64_t, uint64_t> references;
+		CountReferences(references);
+
+		// write to a shared block which is not counted would change all streams
+		bool damaged = false;
+		for (auto &item : references)
+		{
+			auto counted = m_refcounts.find(item.first);
+			uint64_t numberOfCounted = counted != m_refcounts.end() ? counted->second : 1;
+			if (item.second < 2 || numberOfCounted == item.second) continue;
+
+			AddProblem(report, "Block at " + std::to_string(item.first) + " is used " + std::to_string(item.second) +
+				" times, counted " + std::to_string(numberOfCounted), repair);
+			damaged = true;
+		}
+
+		for (auto &item : m_refcounts)
+		{
+			auto used = references.find(item.first);
+			if (used != references.end() && used->second >= 2) continue;
+
+			AddProblem(report, "Reference count of block at " + std::to_string(item.first) + " is stale", repair);
+			damaged = true;
+		}
+
+		if (!repair || !damaged) return;
+
+		if (m_refcountThread == kNoThread && !AddThread(kRefcountThreadName, FileThreadInfo::kFlagHidden, m_refcountThread))
+		{
+			AddProblem(report, "Reference count stream can not be added", false);
+			return;
+		}
+
+		// adding the stream may move blocks, so they are counted again
+		CountReferences(references);
+		m_refcounts.clear();
+
+		for (auto &item : references)
+		{
+			if (item.second >= 2) m_refcounts[item.first] = item.second;
+		}
+	}
+
+	bool MetafileImpl::UpgradeFormat()
+	{
+		auto lock = LockTable();
+
+		if (m_readOnly) return false;
+		if (m_file.header.version >= MetafileHeader::kVersionDirectory) return IsValid();
+
+		// directory takes the place of the old table, blocks stay where they are
+		m_file.header.directoryCapacity = (uint32_t)(GetDataRegionStart() - sizeof(MetafileHeader));
+		m_file.header.version = MetafileHeader::kVersionDirectory;
+		m_file.header.signature = MetafileHeader::GetSignature(m_file.header.version);
+
+		FlushToDisk();
+		return IsValid();
+	}
+
+	bool MetafileImpl::IsValid()
+	{
+		// flusher sets the error too
+		auto lock = LockTable();
+		return m_errorCode == ErrorCode::None;
+	}
+
+	std::string MetafileImpl::GetLastError()
+	{
+		auto lock = LockTable();
+		return m_errorMessage;
+	}
+
+	ErrorCode MetafileImpl::GetLastErrorCode()
+	{
+		auto lock = LockTable();
+		return m_errorCode;
+	}
+
+	void MetafileImpl::SetError(ErrorCode code, const std::string &message)
+	{
+		m_errorCode = code;
+		m_errorMessage = message;
+	}
+
+	bool MetafileImpl::TakeAccessError(FileAccessInterface &access)
+	{
+		// runs after every transfer, empty message is copied without allocation
+		m_errorMessage = access.GetLastError();
+		m_errorCode = m_errorMessage.empty() ? ErrorCode::None : ErrorCode::IoError;
+		return m_errorCode == ErrorCode::None;
+	}
+
+	FileThread *MetafileImpl::GetThread(const char *name, size_t length)
+	{
+		uint32_t index;
+		if (!FindThread(name, length, index) || (m_file.threads[index].header.flags & FileThreadInfo::kFlagHidden)) return nullptr;
+		return &m_file.threads[index].interfaceObject;
+	}
+
+	const std::vector<FileThread *> &MetafileImpl::GetRefToAllThreads()
+	{
+		// streams are only added, at the end of table
+		for (; m_numberOfListedThreads < m_file.threads.size(); m_numberOfListedThreads++)
+		{
+			RuntimeThreadInfo &item = m_file.threads[m_numberOfListedThreads];
+			if (!(item.header.flags & FileThreadInfo::kFlagHidden)) m_visibleThreads.push_back(&item.interfaceObject);
+		}
+
+		return m_visibleThreads;
+	}
+
+	std::unique_lock<std::recursive_mutex> MetafileImpl::LockTable()
+	{
+		// calls come from one thread at a time, only the flusher runs with them
+		if (!m_flusher) return std::unique_lock<std::recursive_mutex>(m_tableLock, std::defer_lock);
+		return std::unique_lock<std::recursive_mutex>(m_tableLock);
+	}
+
+	bool MetafileImpl::StartBackgroundFlush(const FlushPolicy &policy)
+	{
+		if (m_readOnly || !IsValid()) return false;
+
+		StopBackgroundFlush();
+		m_flusher.reset(new BackgroundFlusher(policy, [this, policy] { return SaveInBackground(policy.sync); }));
+		return true;
+	}
+
+	void MetafileImpl::StopBackgroundFlush()
+	{
+		// last flush still looks at m_flusher, it is cleared afterwards
+		if (m_flusher) m_flusher->Stop();
+		m_flusher.reset();
+	}
+
+	void MetafileImpl::Flush()
+	{
+		if (m_flusher) m_flusher->WaitForFlush();
+		else FlushToDisk();
+	}
+
+	bool MetafileImpl::SaveInBackground(bool sync)
+	{
+		{
+			std::lock_guard<std::recursive_mutex> lock(m_tableLock);
+
+			m_flushing = true;
+			while (m_appendsInFlight.load() != 0) std::this_thread::yield();
+
+			SaveTable(sync);
+			m_flushing = false;
+
+			if (!IsValid()) return false;
+		}
+
+		// data is on the disk already, writers go on while the table gets there
+		if (!sync || m_fileAccess->Sync()) return true;
+
+		std::lock_guard<std::recursive_mutex> lock(m_tableLock);
+		SetError(ErrorCode::IoError, "Can not sync file");
+		return false;
+	}
+
+	void MetafileImpl::EnterAppend()
+	{
+		while (true)
+		{
+			m_appendsInFlight++;
+			if (!m_flushing.load()) return;
+
+			// flusher waits for appenders to leave
+			m_appendsInFlight--;
+			while (m_flushing.load()) std::this_thread::yield();
+		}
+	}
+
+	void MetafileImpl::MarkDirty(uint64_t size)
+	{
+		// table change without data counts as a byte, so time limits see it
+		if (m_flusher) m_flusher->AddDirty(std::max(size, (uint64_t)1));
+	}
+
+	void MetafileImpl::FlushToDisk()
+	{
+		auto lock = LockTable();
+		SaveTable();
+	}
+
+	void MetafileImpl::SaveTable(bool sync)
+	{
+		if (m_readOnly) return;
+		ReclaimZones();
+
+		std::vector<char> buffer;
+
+		while (true)
+		{
+			// bitmaps first, table must never point to partial block with stale bitmap
+			FlushClusterBitmaps();
+			if (m_fingerprintThread != kNoThread) SaveFingerprints();
+			if (m_refcountThread != kNoThread) SaveRefcounts();
+
+			if (m_file.header.version < MetafileHeader::kVersionDirectory)
+			{
+				buffer.resize(sizeof(MetafileHeader) + sizeof(FileThreadInfo) * m_file.threads.size());
+
+				for (uint32_t i = 0; i < m_file.threads.size(); i++)
+				{
+					memcpy(&buffer[sizeof(MetafileHeader) + sizeof(FileThreadInfo) * i], &m_file.threads[i].header, sizeof(FileThreadInfo));
+				}
+
+				break;
+			}
+
+			buffer.resize(sizeof(MetafileHeader));
+			for (auto &item : m_file.threads)
+			{
+				AppendDirectoryEntry(item.header, buffer);
+			}
+
+			uint64_t directorySize = buffer.size() - sizeof(MetafileHeader);
+			if (directorySize <= m_file.header.directoryCapacity)
+			{
+				m_file.header.directorySize = (uint32_t)directorySize;
+				break;
+			}
+
+			// moving blocks changes records, bitmaps and refcounts, so all of it is saved again
+			GrowDirectory(directorySize);
+		}
+
+		// synced table must not point to blocks which are not on the disk yet
+		if (sync)
+		{
+			m_fileAccess->Flush();
+			if (!m_fileAccess->Sync())
+			{
+				SetError(ErrorCode::IoError, "Can not sync file");
+				return;
+			}
+		}
+
+		// odd generation tells readers that the table is being rewritten. even one is
+		// written last and on its own, so a reader which sees it twice has the whole table
+		uint64_t generation = m_file.header.generation + 2;
+		if (m_singleWriter)
+		{
+			m_file.header.generation = generation - 1;
+			m_fileAccess->SetPointerTo(0);
+			m_fileAccess->Write(&m_file.header, sizeof(MetafileHeader));
+			m_fileAccess->Flush();
+
+			if (buffer.size() > sizeof(MetafileHeader))
+			{
+				m_fileAccess->Write(&buffer[sizeof(MetafileHeader)], (uint32_t)(buffer.size() - sizeof(MetafileHeader)));
+				m_fileAccess->Flush();
+			}
+
+			m_file.header.generation = generation;
+			m_fileAccess->SetPointerTo(0);
+			m_fileAccess->Write(&m_file.header, sizeof(MetafileHeader));
+		}
+		else
+		{
+			m_file.header.generation = generation;
+			memcpy(&buffer[0], &m_file.header, sizeof(MetafileHeader));
+
+			m_fileAccess->SetPointerTo(0);
+			m_fileAccess->Write(&buffer[0], (uint32_t)buffer.size());
+		}
+
+		m_fileAccess->Flush();
+		TakeAccessError(*m_fileAccess);
+	}
+
+	FileThread *MetafileImpl::CloneThread(const std::string &source, const std::string &newName, bool moveBlocks)
+	{
+		auto lock = LockTable();
+		MarkDirty(0);
+
+		uint32_t sourceIndex, index;
+
+		if (m_readOnly || (m_file.header.flags & MetafileHeader::kFlagOverlay)) return nullptr;
+		if (!FindThread(source, sourceIndex) || FindThread(newName, index)) return nullptr;
+		if (m_file.threads[sourceIndex].header.flags & FileThreadInfo::kFlagHidden) return nullptr;
+
+		// blocks become shared, next append must copy the last one first
+		StopAppends(sourceIndex);
+
+		if (m_refcountThread == kNoThread && !AddThread(kRefcountThreadName, FileThreadInfo::kFlagHidden, m_refcountThread, moveBlocks))
+		{
+			return nullptr;
+		}
+
+		// adding may move source blocks, so they are copied afterwards
+		if (!AddThread(newName, 0, index, moveBlocks)) return nullptr;
+
+		RuntimeThreadInfo &item = m_file.threads[index];
+		const RuntimeThreadInfo &sourceItem = m_file.threads[sourceIndex];
+		item.header.size = sourceItem.header.size;
+		item.header.clusterShift = sourceItem.header.clusterShift;
+		item.header.growth = sourceItem.header.growth;
+		item.header.growthParameter = sourceItem.header.growthParameter;
+
+		// small stream is cheaper to copy than to share
+		if (IsSlab(sourceIndex))
+		{
+			std::vector<char> data((size_t)item.header.size);
+			uint64_t pointer = m_file.threads[sourceIndex].currentOffset;
+
+			FileThreadSetPointerTo(sourceIndex, 0);
+			if (!data.empty()) FileThreadRead(sourceIndex, &data[0], (uint32_t)data.size());
+			FileThreadSetPointerTo(sourceIndex, pointer);
+
+			item.header.size = 0;
+			if (!data.empty()) FileThreadWrite(index, &data[0], (uint32_t)data.size());
+			FileThreadSetPointerTo(index, 0);
+			return &item.interfaceObject;
+		}
+
+		memcpy(item.header.blocks, sourceItem.header.blocks, sizeof(item.header.blocks));
+
+		for (auto &block : item.header.blocks)
+		{
+			if (block.offsetInUnderlyingFile == 0) break;
+
+			uint64_t &references = m_refcounts[block.offsetInUnderlyingFile];
+			references = std::max(references, (uint64_t)1) + 1;
+		}
+
+		return &item.interfaceObject;
+	}
+
+	bool MetafileImpl::Snapshot(const std::string &suffix)
+	{
+		auto lock = LockTable();
+
+		std::vector<uint32_t> sources;
+		if (m_readOnly) return false;
+
+		for (uint32_t i = 0; i < m_file.threads.size(); i++)
+		{
+			const FileThreadInfo &header = m_file.threads[i].header;
+			if (header.flags & (FileThreadInfo::kFlagHidden | FileThreadInfo::kFlagSnapshot)) continue;
+
+			// all or nothing, check names before anything is added
+			uint32_t existing;
+			std::string name = std::string(header.name) + suffix;
+			if (name.size() >= sizeof(header.name) || FindThread(name, existing)) return false;
+
+			sources.push_back(i);
+		}
+
+		if (m_file.threads.size() + sources.size() + 1 > MetafileHeader::kMaxNumberOfThreads) return false;
+
+		// blocks under the grown table are moved once for all entries, not once per stream.
+		// moving updates records of clones, which point to the same blocks
+		bool res = true;
+		for (auto i : sources)
+		{
+			std::string name = m_file.threads[i].header.name;
+			FileThread *clone = CloneThread(name, name + suffix, false);
+			if (!clone)
+			{
+				res = false;
+				break;
+			}
+
+			m_file.threads[clone->m_index].header.flags |= FileThreadInfo::kFlagSnapshot;
+		}
+
+		MoveBlocksFromTable();
+		return res;
+	}
+
+	bool MetafileImpl::FindThread(const std::string &name, uint32_t &index)
+	{
+		return FindThread(name.c_str(), name.size(), index);
+	}
+
+	bool MetafileImpl::FindThread(const char *name, size_t length, uint32_t &index)
+	{
+		if (length >= sizeof(FileThreadInfo::name)) return false;
+
+		// sealed index is sorted by name
+		if (m_file.header.version == MetafileHeader::kVersionSealed)
+		{
+			uint32_t first = 0;
+			uint32_t last = (uint32_t)m_file.threads.size();
+
+			while (first < last)
+			{
+				index = first + (last - first) / 2;
+				const char *other = m_file.threads[index].header.name;
+
+				int res = strncmp(other, name, length);
+				if (res == 0 && other[length] == 0) return true;
+
+				if (res < 0) first = index + 1;
+				else last = index;
+			}
+
+			return false;
+		}
+
+		for (index = 0; index < m_file.threads.size(); index++)
+		{
+			const char *other = m_file.threads[index].header.name;
+			if (other[length] == 0 && memcmp(name, other, length) == 0) return true;
+		}
+
+		return false;
+	}
+
+	bool MetafileImpl::AddThread(const std::string &name, uint32_t flags, uint32_t &index, bool moveBlocks)
+	{
+		if (m_file.threads.size() >= MetafileHeader::kMaxNumberOfThreads) return false;
+		if (name.size() >= sizeof(FileThreadInfo::name)) return false;
+
+		uint64_t oldDataRegionStart = GetDataRegionStart();
+
+		index = (uint32_t)m_file.threads.size();
+		m_file.threads.push_back(RuntimeThreadInfo());
+		m_file.header.numberOfThreads = (uint32_t)m_file.threads.size();
+
+		auto &item = m_file.threads[index];
+		memset(&item.header, 0, sizeof(item.header));
+		strncpy(item.header.name, name.c_str(), sizeof(item.header.name) - 1);
+		item.header.flags = flags;
+		item.interfaceObject.m_impl = this;
+		item.interfaceObject.m_index = index;
+		item.currentOffset = 0;
+
+		m_endOfBlocks = 0;
+		if (moveBlocks && GetDataRegionStart() > oldDataRegionStart) MoveBlocksFromTable();
+
+		return true;
+	}
+
+	void MetafileImpl::MoveBlocksFromTable()
+	{
+		// version 1 table grows with every stream, directory only on flush
+		if (m_file.header.version >= MetafileHeader::kVersionDirectory) return;
+
+		DropZones();
+		RelocateBlocksBelow(GetDataRegionStart());
+	}
+
+	void MetafileImpl::RelocateBlocksBelow(uint64_t limit)
+	{
+		for (uint32_t index = 0; index < m_file.threads.size(); index++)
+		{
+			if (IsSlab(index)) continue;
+
+			for (uint32_t block = 0; block < FileThreadInfo::kNumberOfBlockRecords; block++)
+			{
+				uint64_t record = m_file.threads[index].header.blocks[block].offsetInUnderlyingFile;
+				if (record == 0) break;
+				if (record & FileThreadInfo::kBlockInBase) continue;
+
+				uint64_t address = record & FileThreadInfo::kOffsetMask;
+				uint64_t prefix = 0;
+
+				if (record & FileThreadInfo::kBlockPartial)
+				{
+					// bitmap is written to the new place on flush
+					prefix = GetClusterBitmapSize(index, block);
+					GetClusterBitmap(index, block).dirty = true;
+				}
+
+				if (address - prefix >= limit) continue;
+
+				uint64_t newAddress = AllocateBlock(index, block, prefix);
+				CopyData(address, newAddress, GetBlockSize(index, block));
+
+				// clones point to the same block
+				uint64_t newRecord = newAddress | (record & ~FileThreadInfo::kOffsetMask);
+				for (auto &item : m_file.threads)
+				{
+					if (item.header.flags & FileThreadInfo::kFlagSlab) continue;
+
+					for (auto &other : item.header.blocks)
+					{
+						if (other.offsetInUnderlyingFile == record) other.offsetInUnderlyingFile = newRecord;
+					}
+				}
+
+				auto it = m_refcounts.find(address);
+				if (it != m_refcounts.end())
+				{
+					m_refcounts[newAddress] = it->second;
+					m_refcounts.erase(it);
+				}
+
+				auto fingerprint = m_fingerprintOf.find(address);
+				if (fingerprint != m_fingerprintOf.end())
+				{
+					m_fingerprints[fingerprint->second] = newAddress;
+					m_fingerprintOf[newAddress] = fingerprint->second;
+					m_fingerprintOf.erase(fingerprint);
+				}
+			}
+		}
+	}
+
+	void MetafileImpl::CopyData(uint64_t from, uint64_t to, uint64_t size)
+	{
+		auto buffers = GetBufferResource();
+		ScopedBuffer buffer(*buffers, (size_t)std::min(size, (uint64_t)kCopyBufferSize), m_fileAccess->GetAlignment());
+		char *data = buffer.Get();
+
+		if (!data)
+		{
+			SetError(ErrorCode::IoError, "Out of memory");
+			return;
+		}
+
+		for (uint64_t processed = 0; processed < size && m_fileAccess->IsValid();)
+		{
+			uint32_t sizeToProcess = (uint32_t)std::min(size - processed, (uint64_t)buffer.GetSize());
+
+			m_fileAccess->SetPointerTo(from + processed);
+			uint32_t actuallyRead = m_fileAccess->Read(data, sizeToProcess);
+			memset(data + actuallyRead, 0, sizeToProcess - actuallyRead);
+
+			m_fileAccess->SetPointerTo(to + processed);
+			m_fileAccess->Write(data, sizeToProcess);
+			processed += sizeToProcess;
+		}
+	}
+
+	void MetafileImpl::CopySharedBlock(uint32_t index, uint32_t block)
+	{
+		FileThreadInfo::BlockRecord &record = m_file.threads[index].header.blocks[block];
+		uint64_t address = record.offsetInUnderlyingFile;
+		uint64_t newAddress = AllocateBlock(index, block, 0);
+
+		CopyData(address, newAddress, GetBlockSize(index, block));
+		record.offsetInUnderlyingFile = newAddress;
+		ReleaseBlock(address);
+	}
+
+	void MetafileImpl::ReleaseBlock(uint64_t address)
+	{
+		auto it = m_refcounts.find(address);
+		if (it == m_refcounts.end()) return;
+
+		if (--it->second <= 1) m_refcounts.erase(it);
+	}
+
+	void MetafileImpl::LoadRefcounts()
+	{
+		m_refcounts.clear();
+
+		for (uint32_t i = 0; i < m_file.threads.size(); i++)
+		{
+			const FileThreadInfo &header = m_file.threads[i].header;
+			if (!(header.flags & FileThreadInfo::kFlagHidden) || strcmp(header.name, kRefcountThreadName) != 0) continue;
+
+			m_refcountThread = i;
+			std::vector<RefcountRecord> records((size_t)(header.size / sizeof(RefcountRecord)));
+			if (records.empty()) return;
+
+			FileThreadSetPointerTo(i, 0);
+			FileThreadRead(i, &records[0], (uint32_t)(records.size() * sizeof(RefcountRecord)));
+
+			for (auto &record : records)
+			{
+				m_refcounts[record.offsetInUnderlyingFile] = record.numberOfReferences;
+			}
+
+			return;
+		}
+	}
+
+	void MetafileImpl::SaveRefcounts()
+	{
+		std::vector<RefcountRecord> records;
+		records.reserve(m_refcounts.size());
+
+		for (auto &item : m_refcounts)
+		{
+			RefcountRecord record = { item.first, item.second };
+			records.push_back(record);
+		}
+
+		uint64_t size = records.size() * sizeof(RefcountRecord);
+
+		FileThreadSetPointerTo(m_refcountThread, 0);
+		if (!records.empty()) FileThreadWrite(m_refcountThread, &records[0], (uint32_t)size);
+		if (size < FileThreadGetSize(m_refcountThread)) FileThreadSetSize(m_refcountThread, size);
+	}
+
+	bool MetafileImpl::IsDeduplicated(uint32_t index)
+	{
+		return m_fingerprintThread != kNoThread && !(m_file.threads[index].header.flags & FileThreadInfo::kFlagHidden);
+	}
+
+	bool MetafileImpl::ShareBlock(uint32_t index, uint32_t block, const Fingerprint &fingerprint, const char *data)
+	{
+		auto it = m_fingerprints.find(fingerprint);
+		if (it == m_fingerprints.end() || !IsSameContent(it->second, data, fingerprint.size)) return false;
+
+		m_file.threads[index].header.blocks[block].offsetInUnderlyingFile = it->second;
+
+		uint64_t &references = m_refcounts[it->second];
+		references = std::max(references, (uint64_t)1) + 1;
+		return true;
+	}
+
+	bool MetafileImpl::IsSameContent(uint64_t address, const char *data, uint64_t size)
+	{
+		auto buffers = GetBufferResource();
+		ScopedBuffer buffer(*buffers, (size_t)std::min(size, (uint64_t)kCopyBufferSize), m_fileAccess->GetAlignment());
+		char *content = buffer.Get();
+		if (!content) return false;
+
+		for (uint64_t processed = 0; processed < size;)
+		{
+			uint32_t sizeToProcess = (uint32_t)std::min(size - processed, (uint64_t)buffer.GetSize());
+
+			m_fileAccess->SetPointerTo(address + processed);
+			if (m_fileAccess->Read(content, sizeToProcess) != sizeToProcess) return false;
+			if (memcmp(content, data + processed, sizeToProcess) != 0) return false;
+			processed += sizeToProcess;
+		}
+
+		return true;
+	}
+
+	void MetafileImpl::AddFingerprint(uint64_t address, const Fingerprint &fingerprint)
+	{
+		// first block with the content stays, later ones are not referenced
+		if (m_fingerprints.count(fingerprint)) return;
+
+		m_fingerprints[fingerprint] = address;
+		m_fingerprintOf[address] = fingerprint;
+	}
+
+	void MetafileImpl::ForgetFingerprint(uint64_t address)
+	{
+		auto it = m_fingerprintOf.find(address);
+		if (it == m_fingerprintOf.end()) return;
+
+		m_fingerprints.erase(it->second);
+		m_fingerprintOf.erase(it);
+	}
+
+	void MetafileImpl::LoadFingerprints()
+	{
+		m_fingerprintThread = kNoThread;
+		m_fingerprints.clear();
+		m_fingerprintOf.clear();
+
+		if (!(m_file.header.flags & MetafileHeader::kFlagDedup) || !FindThread(kFingerprintThreadName, m_fingerprintThread)) return;
+
+		// shared blocks are counted there, so both streams must exist
+		if (m_refcountThread == kNoThread || !(m_file.threads[m_fingerprintThread].header.flags & FileThreadInfo::kFlagHidden))
+		{
+			m_fingerprintThread = kNoThread;
+			SetError(ErrorCode::Damaged, "Invalid fingerprint stream");
+			return;
+		}
+
+		std::vector<FingerprintRecord> records((size_t)(FileThreadGetSize(m_fingerprintThread) / sizeof(FingerprintRecord)));
+		if (records.empty()) return;
+
+		FileThreadSetPointerTo(m_fingerprintThread, 0);
+		FileThreadRead(m_fingerprintThread, &records[0], (uint32_t)(records.size() * sizeof(FingerprintRecord)));
+
+		for (auto &record : records)
+		{
+			Fingerprint fingerprint;
+			fingerprint.hash[0] = record.hash[0];
+			fingerprint.hash[1] = record.hash[1];
+			fingerprint.size = record.blockSize;
+			AddFingerprint(record.offsetInUnderlyingFile, fingerprint);
+		}
+	}
+
+	void MetafileImpl::SaveFingerprints()
+	{
+		std::vector<FingerprintRecord> records;
+		records.reserve(m_fingerprintOf.size());
+
+		for (auto &item : m_fingerprintOf)
+		{
+			FingerprintRecord record = { { item.second.hash[0], item.second.hash[1] }, item.second.size, item.first };
+			records.push_back(record);
+		}
+
+		uint64_t size = records.size() * sizeof(FingerprintRecord);
+
+		FileThreadSetPointerTo(m_fingerprintThread, 0);
+		if (!records.empty()) FileThreadWrite(m_fingerprintThread, &records[0], (uint32_t)size);
+		if (size < FileThreadGetSize(m_fingerprintThread)) FileThreadSetSize(m_fingerprintThread, size);
+	}
+
+	void MetafileImpl::LoadSlabs()
+	{
+		m_slabThread = kNoThread;
+		m_freeSlots.clear();
+
+		uint32_t slotSize = m_file.header.slabSlotSize;
+		if (slotSize == 0 || !FindThread(kSlabThreadName, m_slabThread)) return;
+
+		if (slotSize > kMaxSlabSlotSize || !(m_file.threads[m_slabThread].header.flags & FileThreadInfo::kFlagHidden))
+		{
+			SetError(ErrorCode::Damaged, "Invalid slab stream");
+			return;
+		}
+
+		std::vector<bool> used((size_t)(FileThreadGetSize(m_slabThread) / slotSize), false);
+		for (auto &item : m_file.threads)
+		{
+			if (!(item.header.flags & FileThreadInfo::kFlagSlab)) continue;
+
+			uint64_t slot = item.header.blocks[0].offsetInUnderlyingFile / slotSize;
+			if (slot >= used.size() || used[(size_t)slot] || item.header.size > slotSize)
+			{
+				SetError(ErrorCode::Damaged, "Invalid slab stream");
+				return;
+			}
+
+			used[(size_t)slot] = true;
+		}
+
+		// lowest slots are handed out first
+		for (size_t slot = used.size(); slot-- > 0; )
+		{
+			if (!used[slot]) m_freeSlots.push_back((uint64_t)slot * slotSize);
+		}
+	}
+
+	bool MetafileImpl::IsSlab(uint32_t index)
+	{
+		return (m_file.threads[index].header.flags & FileThreadInfo::kFlagSlab) != 0;
+	}
+
+	bool MetafileImpl::MoveToSlab(uint32_t index)
+	{
+		const FileThreadInfo &header = m_file.threads[index].header;
+		uint32_t slotSize = m_file.header.slabSlotSize;
+
+		if (slotSize == 0 || header.size > slotSize || header.blocks[0].offsetInUnderlyingFile != 0) return false;
+		if (header.flags & FileThreadInfo::kFlagHidden) return false;
+
+		if (m_slabThread == kNoThread)
+		{
+			// overlay table can't grow, its data region starts right after the base table
+			if (m_file.header.flags & MetafileHeader::kFlagOverlay) return false;
+			if (!AddThread(kSlabThreadName, FileThreadInfo::kFlagHidden, m_slabThread)) return false;
+		}
+
+		uint64_t slot = FileThreadGetSize(m_slabThread);
+		if (!m_freeSlots.empty())
+		{
+			slot = m_freeSlots.back();
+			m_freeSlots.pop_back();
+		}
+
+		// stream may already have a size without any data, that part reads as zeros
+		std::vector<char> zeros(slotSize, 0);
+		FileThreadSetPointerTo(m_slabThread, slot);
+		if (FileThreadWrite(m_slabThread, &zeros[0], slotSize) != slotSize) return false;
+
+		// adding "$slabs" moves the table, item is taken afterwards
+		RuntimeThreadInfo &item = m_file.threads[index];
+		item.header.flags |= FileThreadInfo::kFlagSlab;
+		item.header.blocks[0].offsetInUnderlyingFile = slot;
+		return true;
+	}
+
+	bool MetafileImpl::MoveFromSlab(uint32_t index)
+	{
+		RuntimeThreadInfo &item = m_file.threads[index];
+		uint64_t pointer = item.currentOffset;
+
+		std::vector<char> data((size_t)item.header.size);
+		item.currentOffset = 0;
+		if (!data.empty() && SlabIo(index, &data[0], (uint32_t)data.size(), false) != data.size()) return false;
+
+		FreeSlot(index);
+
+		item.currentOffset = 0;
+		if (!data.empty() && WriteBlocks(index, &data[0], (uint32_t)data.size()) != data.size()) return false;
+
+		item.currentOffset = pointer;
+		return true;
+	}
+
+	void MetafileImpl::FreeSlot(uint32_t index)
+	{
+		FileThreadInfo &header = m_file.threads[index].header;
+
+		m_freeSlots.push_back(header.blocks[0].offsetInUnderlyingFile);
+		header.blocks[0].offsetInUnderlyingFile = 0;
+		header.flags &= ~FileThreadInfo::kFlagSlab;
+	}
+
+	uint32_t MetafileImpl::SlabIo(uint32_t index, void *data, uint32_t size, bool write)
+	{
+		RuntimeThreadInfo &item = m_file.threads[index];
+
+		FileThreadSetPointerTo(m_slabThread, item.header.blocks[0].offsetInUnderlyingFile + item.currentOffset);
+		uint32_t res = write ? FileThreadWrite(m_slabThread, data, size) : FileThreadRead(m_slabThread, data, size);
+
+		item.currentOffset += res;
+		if (item.currentOffset > item.header.size) item.header.size = item.currentOffset;
+		return res;
+	}
+
+	const char *MetafileImpl::FileThreadGetName(uint32_t index)
+	{
+		assert(index < m_file.threads.size());
+		return m_file.threads[index].header.name;
+	}
+
+	uint64_t MetafileImpl::FileThreadGetSize(uint32_t index)
+	{
+		assert(index < m_file.threads.size());
+		const RuntimeThreadInfo &item = m_file.threads[index];
+
+		if (item.append.phase.load() == AppendState::kActive) return item.append.size.load(std::memory_order_acquire);
+		return item.header.size;
+	}
+
+	bool MetafileImpl::FileThreadSetSize(uint32_t index, uint64_t newFileSize)
+	{
+		auto lock = LockTable();
+		MarkDirty(0);
+
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+		if (m_readOnly) return false;
+
+		StopAppends(index);
+
+		if (IsSlab(index))
+		{
+			if (newFileSize == 0)
+			{
+				FreeSlot(index);
+				item.header.size = 0;
+				return true;
+			}
+
+			if (newFileSize > m_file.header.slabSlotSize && !MoveFromSlab(index)) return false;
+		}
+
+		if (IsSlab(index))
+		{
+			// slot tail past the end is kept zero, so growing needs no work
+			if (newFileSize < item.header.size)
+			{
+				std::vector<char> zeros((size_t)(item.header.size - newFileSize), 0);
+				FileThreadSetPointerTo(m_slabThread, item.header.blocks[0].offsetInUnderlyingFile + newFileSize);
+				FileThreadWrite(m_slabThread, &zeros[0], (uint32_t)zeros.size());
+			}
+
+			item.header.size = newFileSize;
+			return true;
+		}
+
+		item.header.size = newFileSize;
+
+		uint32_t blockNumber;
+		uint64_t offsetInBlock;
+
+		bool res = GetBlockByAddress(index, item.header.size, blockNumber, offsetInBlock);
+		if (!res)	return false;
+
+		if (offsetInBlock != 0) blockNumber++;
+
+		while (blockNumber < FileThreadInfo::kNumberOfBlockRecords && item.header.blocks[blockNumber].offsetInUnderlyingFile != 0)
+		{
+			// last reference, content is gone
+			uint64_t address = item.header.blocks[blockNumber].offsetInUnderlyingFile;
+			if (!m_fingerprintOf.empty() && !m_refcounts.count(address)) ForgetFingerprint(address);
+
+			ReleaseBlock(address);
+			item.header.blocks[blockNumber].offsetInUnderlyingFile = 0;
+			m_clusterBitmaps.erase((uint64_t)index << 32 | blockNumber);
+			blockNumber++;
+		}
+
+		m_endOfBlocks = 0;
+		uint64_t futherstPosInFile = FindAddressToAppendNewBlock();
+		m_fileAccess->SetFileSize(futherstPosInFile);
+		return true;
+	}
+
+
+	uint32_t MetafileImpl::FileThreadWrite(uint32_t index, void *data, uint32_t size)
+	{
+		auto lock = LockTable();
+		MarkDirty(size);
+
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+		uint64_t end = item.currentOffset + size;
+		if (m_readOnly) return 0;
+
+		StopAppends(index);
+
+		if (IsSlab(index) && end > m_file.header.slabSlotSize && !MoveFromSlab(index)) return 0;
+		if (IsSlab(index) || (size != 0 && end <= m_file.header.slabSlotSize && MoveToSlab(index))) return SlabIo(index, data, size, true);
+
+		return WriteBlocks(index, data, size);
+	}
+
+	uint32_t MetafileImpl::WriteBlocks(uint32_t index, void *data, uint32_t size)
+	{
+		RuntimeThreadInfo &item = m_file.threads[index];
+
+		if (item.currentOffset + size > item.header.size)
+		{
+			item.header.size = item.currentOffset + size;
+		}
+
+		return FileIoOperation(index, data, size, &FileAccessInterface::Write);
+	}
+
+	uint32_t MetafileImpl::FileThreadRead(uint32_t index, void *data, uint32_t size)
+	{
+		auto lock = LockTable();
+
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+		uint64_t streamSize = FileThreadGetSize(index);
+
+		if (item.currentOffset + size > streamSize)
+		{
+			assert(item.currentOffset <= streamSize);
+			size = static_cast<uint32_t>(streamSize - item.currentOffset);
+		}
+
+		if (IsSlab(index)) return SlabIo(index, data, size, false);
+
+		if (item.append.phase.load() == AppendState::kActive)
+		{
+			// appenders share the file, only the written prefix is read
+			std::lock_guard<std::mutex> lock(m_appendLock);
+			return FileIoOperation(index, data, size, &FileAccessInterface::Read);
+		}
+
+		return FileIoOperation(index, data, size, &FileAccessInterface::Read);
+	}
+
+	uint32_t MetafileImpl::FileIoOperation(uint32_t index, void *data, uint32_t size, MetafileImpl::IoOperationFunction operation)
+	{
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+
+		uint32_t actuallyProcessed = 0;
+		char *_data = (char *)data;
+
+		uint32_t blockNumber;
+		uint64_t offsetInBlock;
+		bool res = GetBlockByAddress(index, item.currentOffset, blockNumber, offsetInBlock);
+		if (!res)	return false;
+
+		bool write = operation == &FileAccessInterface::Write;
+
+		bool deduplicate = write && IsDeduplicated(index);
+
+		// stream can't grow past its last block record
+		while (actuallyProcessed < size && blockNumber < FileThreadInfo::kNumberOfBlockRecords && m_fileAccess->IsValid())
+		{
+			FileThreadInfo::BlockRecord &record = item.header.blocks[blockNumber];
+			uint64_t blockSize = GetBlockSize(index, blockNumber);
+			uint64_t sizeToEndOfBlock = blockSize - offsetInBlock;
+			uint32_t sizeToProcess = (uint32_t)std::min(sizeToEndOfBlock, (uint64_t)(size - actuallyProcessed));
+			char *blockData = _data + actuallyProcessed;
+
+			// whole block is known before anything is written, equal one is referenced instead
+			bool wholeBlock = deduplicate && offsetInBlock == 0 && sizeToProcess == blockSize;
+			bool shared = false;
+			Fingerprint fingerprint;
+
+			if (wholeBlock)
+			{
+				fingerprint = ComputeFingerprint(blockData, sizeToProcess);
+
+				// old content of shared block is not needed, so it is not copied
+				if (m_refcounts.count(record.offsetInUnderlyingFile))
+				{
+					ReleaseBlock(record.offsetInUnderlyingFile);
+					record.offsetInUnderlyingFile = 0;
+				}
+
+				if (record.offsetInUnderlyingFile == 0)
+				{
+					if (blockNumber > 0) AllocateBlocksUpTo(index, blockNumber - 1);
+					shared = ShareBlock(index, blockNumber, fingerprint, blockData);
+				}
+			}
+
+			if (write && !shared) AllocateBlocksUpTo(index, blockNumber);
+
+			// hole left by SetSize reads as zeros, reading must not allocate
+			if (shared);
+			else if (record.offsetInUnderlyingFile == 0) memset(blockData, 0, sizeToProcess);
+			else
+			{
+				uint32_t res = BlockIo(index, blockNumber, offsetInBlock, blockData, sizeToProcess, operation);
+
+				// base container failed, its error is kept
+				if (res < sizeToProcess && m_baseAccess && !TakeAccessError(*m_baseAccess))
+				{
+					item.currentOffset += res;
+					return actuallyProcessed + res;
+				}
+
+				if (wholeBlock) AddFingerprint(record.offsetInUnderlyingFile, fingerprint);
+			}
+
+			actuallyProcessed += sizeToProcess;
+			item.currentOffset += sizeToProcess;
+
+			blockNumber++;
+			offsetInBlock = 0;
+		}
+
+		TakeAccessError(*m_fileAccess);
+		return actuallyProcessed;
+	}
+
+	uint32_t MetafileImpl::BlockIo(uint32_t index, uint32_t block, uint64_t offsetInBlock, char *data, uint32_t size, IoOperationFunction operation)
+	{
+		FileThreadInfo::BlockRecord &record = m_file.threads[index].header.blocks[block];
+		bool write = operation == &FileAccessInterface::Write;
+
+		if (write && (record.offsetInUnderlyingFile & FileThreadInfo::kBlockInBase))
+		{
+			MaterializeBlock(index, block);
+		}
+
+		if (write && !m_refcounts.empty() && m_refcounts.count(record.offsetInUnderlyingFile))
+		{
+			CopySharedBlock(index, block);
+		}
+
+		// own block changes in place, others must not share it any more
+		if (write && !m_fingerprintOf.empty()) ForgetFingerprint(record.offsetInUnderlyingFile);
+
+		uint64_t address = record.offsetInUnderlyingFile & FileThreadInfo::kOffsetMask;
+
+		if (record.offsetInUnderlyingFile & FileThreadInfo::kBlockInBase)
+		{
+			return ReadFromBase(address + offsetInBlock, data, size);
+		}
+
+		if (record.offsetInUnderlyingFile & FileThreadInfo::kBlockPartial)
+		{
+			return PartialBlockIo(index, block, offsetInBlock, data, size, write);
+		}
+
+		m_fileAccess->SetPointerTo(address + offsetInBlock);
+		return (&*m_fileAccess->*operation)(data, size);
+	}
+
+	uint32_t MetafileImpl::PartialBlockIo(uint32_t index, uint32_t block, uint64_t offsetInBlock, char *data, uint32_t size, bool write)
+	{
+		FileThreadInfo::BlockRecord &record = m_file.threads[index].header.blocks[block];
+		uint64_t address = record.offsetInUnderlyingFile & FileThreadInfo::kOffsetMask;
+		uint64_t baseAddress = m_baseThreads[index].blocks[block].offsetInUnderlyingFile;
+		uint64_t cluster = GetClusterSize(index);
+
+		ClusterBitmap &bitmap = GetClusterBitmap(index, block);
+		uint64_t end = offsetInBlock + size;
+
+		if (!write)
+		{
+			uint32_t processed = 0;
+
+			// runs of clusters with the same state, each run is one request
+			while (processed < size)
+			{
+				uint64_t position = offsetInBlock + processed;
+				uint64_t clusterIndex = position / cluster;
+				bool copied = 0 != (bitmap.bits[clusterIndex / 8] & (1 << clusterIndex % 8));
+
+				uint64_t runEnd = (clusterIndex + 1) * cluster;
+				while (runEnd < end && copied == (0 != (bitmap.bits[runEnd / cluster / 8] & (1 << runEnd / cluster % 8))))
+				{
+					runEnd += cluster;
+				}
+
+				uint32_t sizeToProcess = (uint32_t)(std::min(runEnd, end) - position);
+
+				if (copied)
+				{
+					m_fileAccess->SetPointerTo(address + position);
+					m_fileAccess->Read(data + processed, sizeToProcess);
+				}
+				else
+				{
+					uint32_t res = ReadFromBase(baseAddress + position, data + processed, sizeToProcess);
+					if (res < sizeToProcess) return processed + res;
+				}
+
+				processed += sizeToProcess;
+			}
+
+			return processed;
+		}
+
+		// clusters which are touched only in part get their base content first
+		auto buffers = GetBufferResource();
+		std::vector<char, BufferAllocator<char> > buffer((BufferAllocator<char>(buffers.get())));
+		for (uint64_t clusterIndex = offsetInBlock / cluster; clusterIndex * cluster < end; clusterIndex++)
+		{
+			uint8_t &bits = bitmap.bits[clusterIndex / 8];
+			uint8_t mask = (uint8_t)(1 << clusterIndex % 8);
+			if (bits & mask) continue;
+
+			uint64_t clusterStart = clusterIndex * cluster;
+			if (clusterStart < offsetInBlock || clusterStart + cluster > end)
+			{
+				buffer.resize((size_t)cluster);
+
+				// cluster stays in base, nothing is written over it
+				if (ReadFromBase(baseAddress + clusterStart, &buffer[0], (uint32_t)cluster) < cluster) return 0;
+
+				m_fileAccess->SetPointerTo(address + clusterStart);
+				m_fileAccess->Write(&buffer[0], (uint32_t)cluster);
+			}
+
+			bits |= mask;
+			bitmap.numberOfCopied++;
+			bitmap.dirty = true;
+		}
+
+		m_fileAccess->SetPointerTo(address + offsetInBlock);
+		uint32_t res = m_fileAccess->Write(data, size);
+
+		// everything is copied, base is not needed for this block anymore
+		if (bitmap.numberOfCopied == GetBlockSize(index, block) / cluster)
+		{
+			record.offsetInUnderlyingFile = address;
+			m_clusterBitmaps.erase((uint64_t)index << 32 | block);
+		}
+
+		return res;
+	}
+
+	uint32_t MetafileImpl::ReadFromBase(uint64_t address, char *data, uint32_t size)
+	{
+		m_baseAccess->SetPointerTo(address);
+		uint32_t res = m_baseAccess->Read(data, size);
+		if (!TakeAccessError(*m_baseAccess)) return res;
+
+		// base block may end past the end of base file
+		memset(data + res, 0, size - res);
+		return size;
+	}
+
+	void MetafileImpl::MaterializeBlock(uint32_t index, uint32_t block)
+	{
+		uint64_t cluster = GetClusterSize(index);
+		uint64_t numberOfClusters = GetBlockSize(index, block) / cluster;
+
+		// only address space is taken here, clusters are copied on first write
+		uint64_t address = AllocateBlock(index, block, GetClusterBitmapSize(index, block));
+
+		ClusterBitmap &bitmap = m_clusterBitmaps[(uint64_t)index << 32 | block];
+		bitmap.bits.assign((size_t)((numberOfClusters + 7) / 8), 0);
+		bitmap.numberOfCopied = 0;
+		bitmap.dirty = true;
+
+		m_file.threads[index].header.blocks[block].offsetInUnderlyingFile = address | FileThreadInfo::kBlockPartial;
+	}
+
+	MetafileImpl::ClusterBitmap &MetafileImpl::GetClusterBitmap(uint32_t index, uint32_t block)
+	{
+		auto it = m_clusterBitmaps.find((uint64_t)index << 32 | block);
+		if (it != m_clusterBitmaps.end()) return it->second;
+
+		uint64_t numberOfClusters = GetBlockSize(index, block) / GetClusterSize(index);
+		uint64_t address = m_file.threads[index].header.blocks[block].offsetInUnderlyingFile & FileThreadInfo::kOffsetMask;
+
+		ClusterBitmap &bitmap = m_clusterBitmaps[(uint64_t)index << 32 | block];
+		bitmap.bits.assign((size_t)((numberOfClusters + 7) / 8), 0);
+		bitmap.numberOfCopied = 0;
+		bitmap.dirty = false;
+
+		m_fileAccess->SetPointerTo(address - GetClusterBitmapSize(index, block));
+		m_fileAccess->Read(&bitmap.bits[0], (uint32_t)bitmap.bits.size());
+
+		for (uint64_t i = 0; i < numberOfClusters; i++)
+		{
+			if (bitmap.bits[i / 8] & (1 << i % 8)) bitmap.numberOfCopied++;
+		}
+
+		return bitmap;
+	}
+
+	uint64_t MetafileImpl::GetClusterBitmapSize(uint32_t index, uint32_t block)
+	{
+		uint64_t cluster = GetClusterSize(index);
+		uint64_t bytes = (GetBlockSize(index, block) / cluster + 7) / 8;
+		return (bytes + cluster - 1) / cluster * cluster;
+	}
+
+	void MetafileImpl::FlushClusterBitmaps()
+	{
+		for (auto &item : m_clusterBitmaps)
+		{
+			if (!item.second.dirty) continue;
+
+			uint32_t index = (uint32_t)(item.first >> 32);
+			uint32_t block = (uint32_t)item.first;
+			uint64_t address = m_file.threads[index].header.blocks[block].offsetInUnderlyingFile & FileThreadInfo::kOffsetMask;
+
+			m_fileAccess->SetPointerTo(address - GetClusterBitmapSize(index, block));
+			m_fileAccess->Write(&item.second.bits[0], (uint32_t)item.second.bits.size());
+			item.second.dirty = false;
+		}
+	}
+
+	void MetafileImpl::FileThreadReserve(uint32_t index, uint64_t size)
+	{
+		auto lock = LockTable();
+		MarkDirty(0);
+
+		assert(index < m_file.threads.size());
+
+		uint32_t blockNumber;
+		uint64_t offsetInBlock;
+		if (size == 0 || m_readOnly) return;
+		if (IsSlab(index) && (size <= m_file.header.slabSlotSize || !MoveFromSlab(index))) return;
+		if (!GetBlockByAddress(index, size - 1, blockNumber, offsetInBlock)) return;
+
+		AllocateBlocksUpTo(index, blockNumber);
+	}
+
+	uint64_t MetafileImpl::FileThreadAppend(uint32_t index, const void *data, uint32_t size)
+	{
+		if (!m_flusher) return AppendRange(index, data, size);
+
+		// flusher must not save the table while appends change it
+		EnterAppend();
+		uint64_t res = AppendRange(index, data, size);
+		m_appendsInFlight--;
+
+		m_flusher->AddDirty(size);
+		return res;
+	}
+
+	uint64_t MetafileImpl::AppendRange(uint32_t index, const void *data, uint32_t size)
+	{
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+		AppendState &state = item.append;
+
+		if (m_readOnly || (m_file.header.flags & MetafileHeader::kFlagOverlay)) return FileThread::kAppendFailed;
+		if (!StartAppends(index)) return FileThread::kAppendFailed;
+
+		uint64_t offset = state.reserved.fetch_add(size);
+		bool written = AppendToBlocks(index, offset, (const char *)data, size);
+
+		// ranges become visible in the order they were reserved
+		while (state.committed.load(std::memory_order_acquire) != offset) std::this_thread::yield();
+
+		if (!written) state.failed = true;
+		bool visible = !state.failed;
+
+		// only the committing appender is here, so the header is not shared
+		if (visible)
+		{
+			item.header.size = offset + size;
+			state.size.store(offset + size, std::memory_order_release);
+		}
+
+		state.committed.store(offset + size, std::memory_order_release);
+		return visible ? offset : FileThread::kAppendFailed;
+	}
+
+	bool MetafileImpl::StartAppends(uint32_t index)
+	{
+		RuntimeThreadInfo &item = m_file.threads[index];
+		AppendState &state = item.append;
+
+		uint32_t phase = AppendState::kIdle;
+		if (!state.phase.compare_exchange_strong(phase, AppendState::kStarting))
+		{
+			while ((phase = state.phase.load()) == AppendState::kStarting) std::this_thread::yield();
+			return phase == AppendState::kActive;
+		}
+
+		std::lock_guard<std::mutex> lock(m_appendLock);
+		bool ready = !IsSlab(index) || MoveFromSlab(index);
+
+		// appends start in the last block, it must be own. lookup also fills layout cache,
+		// so concurrent appenders only read it
+		uint32_t block = 0;
+		uint64_t offsetInBlock;
+		if (ready && GetBlockByAddress(index, item.header.size, block, offsetInBlock) &&
+			!m_refcounts.empty() && m_refcounts.count(item.header.blocks[block].offsetInUnderlyingFile))
+		{
+			CopySharedBlock(index, block);
+		}
+
+		uint32_t allocatedBlocks = 0;
+		while (allocatedBlocks < FileThreadInfo::kNumberOfBlockRecords && item.header.blocks[allocatedBlocks].offsetInUnderlyingFile != 0)
+		{
+			// appends write own blocks in place, from the last one on
+			if (ready && allocatedBlocks >= block && !m_fingerprintOf.empty())
+			{
+				ForgetFingerprint(item.header.blocks[allocatedBlocks].offsetInUnderlyingFile);
+			}
+
+			allocatedBlocks++;
+		}
+
+		state.reserved = item.header.size;
+		state.committed = item.header.size;
+		state.size = item.header.size;
+		state.allocatedBlocks = allocatedBlocks;
+		state.failed = false;
+		state.phase.store(ready ? AppendState::kActive : AppendState::kIdle);
+		return ready;
+	}
+
+	void MetafileImpl::StopAppends(uint32_t index)
+	{
+		// header already has the size, other calls never run together with appends
+		m_file.threads[index].append.phase = AppendState::kIdle;
+	}
+
+	bool MetafileImpl::AppendToBlocks(uint32_t index, uint64_t offset, const char *data, uint32_t size)
+	{
+		const FileThreadInfo &header = m_file.threads[index].header;
+		AppendState &state = m_file.threads[index].append;
+		if (size == 0) return true;
+
+		uint32_t block, lastBlock;
+		uint64_t offsetInBlock, offsetInLastBlock;
+		if (!GetBlockByAddress(index, offset + size - 1, lastBlock, offsetInLastBlock)) return false;
+
+		if (lastBlock >= state.allocatedBlocks.load(std::memory_order_acquire))
+		{
+			std::lock_guard<std::mutex> lock(m_appendLock);
+
+			// one block ahead of demand, so appenders seldom meet here
+			uint32_t ahead = std::min(lastBlock + 1, (uint32_t)FileThreadInfo::kNumberOfBlockRecords - 1);
+			if (lastBlock >= state.allocatedBlocks.load())
+			{
+				AllocateBlocksUpTo(index, ahead);
+				state.allocatedBlocks.store(ahead + 1, std::memory_order_release);
+			}
+		}
+
+		GetBlockByAddress(index, offset, block, offsetInBlock);
+
+		for (uint32_t done = 0; done < size; block++)
+		{
+			uint64_t address = header.blocks[block].offsetInUnderlyingFile + offsetInBlock;
+			uint32_t sizeToProcess = (uint32_t)std::min(GetBlockSize(index, block) - offsetInBlock, (uint64_t)(size - done));
+
+			if (!AppendIo(address, data + done, sizeToProcess)) return false;
+
+			done += sizeToProcess;
+			offsetInBlock = 0;
+		}
+
+		return true;
+	}
+
+	bool MetafileImpl::AppendIo(uint64_t address, const char *data, uint32_t size)
+	{
+		if (m_fileAccess->WriteAt(address, data, size) == size) return true;
+
+		// backend without positional writes, one copy at a time
+		std::lock_guard<std::mutex> lock(m_appendLock);
+		m_fileAccess->SetPointerTo(address);
+		if (m_fileAccess->Write(const_cast<char *>(data), size) == size) return true;
+
+		TakeAccessError(*m_fileAccess);
+		return false;
+	}
+
+	void MetafileImpl::FileThreadSetPointerTo(uint32_t index, uint64_t pos)
+	{
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+		item.currentOffset = pos;
+	}
+
+	uint64_t MetafileImpl::FileThreadReadAt(uint32_t index, uint64_t offset, void *data, uint64_t size)
+	{
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+
+		uint64_t streamSize = FileThreadGetSize(index);
+		if (offset >= streamSize) return 0;
+		size = std::min(size, streamSize - offset);
+
+		uint64_t pointer = item.currentOffset;
+		uint64_t processed = 0;
+
+		while (processed < size)
+		{
+			uint32_t sizeToProcess = (uint32_t)std::min(size - processed, (uint64_t)kMaxTransferSize);
+			item.currentOffset = offset + processed;
+
+			uint32_t res = FileThreadRead(index, (char *)data + processed, sizeToProcess);
+			processed += res;
+			if (res < sizeToProcess) break;
+		}
+
+		item.currentOffset = pointer;
+		return processed;
+	}
+
+	uint64_t MetafileImpl::FileThreadWriteAt(uint32_t index, uint64_t offset, const void *data, uint64_t size)
+	{
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+
+		uint64_t pointer = item.currentOffset;
+		uint64_t processed = 0;
+
+		while (processed < size)
+		{
+			uint32_t sizeToProcess = (uint32_t)std::min(size - processed, (uint64_t)kMaxTransferSize);
+			item.currentOffset = offset + processed;
+
+			uint32_t res = FileThreadWrite(index, (char *)data + processed, sizeToProcess);
+			processed += res;
+			if (res < sizeToProcess) break;
+		}
+
+		item.currentOffset = pointer;
+		return processed;
+	}
+
+	void MetafileImpl::SetBufferResource(const std::shared_ptr<BufferResource> &resource)
+	{
+		std::lock_guard<std::mutex> lock(m_buffersLock);
+		m_buffers = resource;
+	}
+
+	std::shared_ptr<BufferResource> MetafileImpl::GetBufferResource()
+	{
+		std::lock_guard<std::mutex> lock(m_buffersLock);
+		if (m_buffers) return m_buffers;
+
+		// clusters are the usual unit of transfers, so classes are multiples of it
+		BufferArena::Options options;
+		uint64_t cluster = m_file.header.sizeOfCluster;
+		if (cluster != 0 && (cluster & (cluster - 1)) == 0) options.granularity = (size_t)cluster;
+
+		m_buffers = std::make_shared<BufferArena>(options);
+		return m_buffers;
+	}
+
+	void MetafileImpl::SetExecutor(const std::shared_ptr<Executor> &executor)
+	{
+		std::lock_guard<std::mutex> lock(m_asyncLock);
+		m_executor = executor;
+		if (m_asyncQueue) m_asyncQueue->SetExecutor(executor);
+	}
+
+	bool MetafileImpl::ReadMany(std::vector<ReadRequest> &requests, uint32_t numberOfThreads)
+	{
+		auto lock = LockTable();
+
+		if (numberOfThreads == 0) numberOfThreads = std::max(1u, std::thread::hardware_concurrency());
+
+		// overlay blocks may live in base, they take the usual path
+		bool sequential = !m_readerFactory || m_baseAccess;
+
+		auto factory = m_readerFactory;
+		auto path = m_path;
+		auto buffers = GetBufferResource();
+		BulkReader reader([factory, path]
+		{
+			auto access = factory->CreateFile();
+			access->UseFileReadOnly(path);
+			return access;
+		}, *buffers);
+
+		for (auto &request : requests)
+		{
+			assert(request.thread && request.thread->m_impl == this);
+			uint32_t index = request.thread->m_index;
+			RuntimeThreadInfo &item = m_file.threads[index];
+			char *data = (char *)request.data;
+
+			request.bytesRead = std::min(request.size, item.header.size);
+
+			if (sequential)
+			{
+				uint64_t pointer = item.currentOffset;
+				item.currentOffset = 0;
+
+				for (uint64_t done = 0; done < request.bytesRead; )
+				{
+					uint32_t size = (uint32_t)std::min(request.bytesRead - done, (uint64_t)(1u << 30));
+					uint32_t res = FileThreadRead(index, data + done, size);
+					done += res;
+					if (res < size) break;
+				}
+
+				item.currentOffset = pointer;
+				continue;
+			}
+
+			if (IsSlab(index)) AddExtents(reader, m_slabThread, item.header.blocks[0].offsetInUnderlyingFile, request.bytesRead, data);
+			else AddExtents(reader, index, 0, request.bytesRead, data);
+		}
+
+		if (sequential) return IsValid();
+
+		// other handles must see everything written through this one
+		m_fileAccess->Flush();
+
+		std::string error;
+		if (!reader.ReadAll(numberOfThreads, error))
+		{
+			SetError(ErrorCode::IoError, error);
+			return false;
+		}
+
+		return true;
+	}
+
+	void MetafileImpl::AddExtents(BulkReader &reader, uint32_t index, uint64_t offset, uint64_t size, char *data)
+	{
+		const FileThreadInfo &header = m_file.threads[index].header;
+
+		uint32_t block;
+		uint64_t offsetInBlock;
+		if (size == 0 || !GetBlockByAddress(index, offset, block, offsetInBlock)) return;
+
+		for (uint64_t done = 0; done < size; block++)
+		{
+			uint64_t extent = std::min(GetBlockSize(index, block) - offsetInBlock, size - done);
+			uint64_t address = header.blocks[block].offsetInUnderlyingFile & FileThreadInfo::kOffsetMask;
+
+			if (address != 0) reader.Add(address + offsetInBlock, extent, data + done);
+			else memset(data + done, 0, (size_t)extent);
+
+			done += extent;
+			offsetInBlock = 0;
+		}
+	}
+
+	std::future<AsyncResult> MetafileImpl::RunAsync(const std::function<AsyncResult()> &operation,
+		const AsyncCallback &callback, const CancellationToken &token)
+	{
+		std::shared_ptr<AsyncQueue> queue;
+
+		{
+			std::lock_guard<std::mutex> lock(m_asyncLock);
+			if (!m_executor) m_executor = IoThreadPool::GetDefault();
+			if (!m_asyncQueue) m_asyncQueue = std::make_shared<AsyncQueue>(m_executor);
+			queue = m_asyncQueue;
+		}
+
+		auto promise = std::make_shared< std::promise<AsyncResult> >();
+		auto self = shared_from_this();
+
+		queue->Post([self, promise, operation, callback, token]
+		{
+			AsyncResult result(AsyncStatus::Cancelled);
+			if (!token.IsCancelled()) result = operation();
+
+			promise->set_value(result);
+			if (callback) callback(result);
+		});
+
+		return promise->get_future();
+	}
+
+	std::future<AsyncResult> MetafileImpl::FlushAsync(const AsyncCallback &callback, const CancellationToken &token)
+	{
+		return RunAsync([this, token]
+		{
+			auto lock = LockTable();
+
+			// data is flushed first, file stays as the last table describes it until the table is written
+			m_fileAccess->Flush();
+			if (token.IsCancelled()) return AsyncResult(AsyncStatus::Cancelled);
+
+			SaveTable();
+			return AsyncResult(IsValid() ? AsyncStatus::Ok : AsyncStatus::Failed);
+		}, callback, token);
+	}
+
+	std::future<AsyncResult> MetafileImpl::FileThreadReadAsync(uint32_t index, uint64_t offset, void *data, uint32_t size,
+		const AsyncCallback &callback, const CancellationToken &token)
+	{
+		return RunAsync([this, index, offset, data, size, token]
+		{
+			// reading past the end gives nothing, like Read at the end of stream
+			if (offset >= FileThreadGetSize(index)) return AsyncResult(AsyncStatus::Ok, 0);
+
+			uint32_t done = 0;
+			while (done < size)
+			{
+				if (token.IsCancelled()) return AsyncResult(AsyncStatus::Cancelled, done);
+
+				uint32_t sizeToProcess = std::min(size - done, kAsyncChunkSize);
+				FileThreadSetPointerTo(index, offset + done);
+				uint32_t res = FileThreadRead(index, (char *)data + done, sizeToProcess);
+
+				done += res;
+				if (res < sizeToProcess) break;
+			}
+
+			return AsyncResult(IsValid() ? AsyncStatus::Ok : AsyncStatus::Failed, done);
+		}, callback, token);
+	}
+
+	std::future<AsyncResult> MetafileImpl::FileThreadWriteAsync(uint32_t index, uint64_t offset, const void *data, uint32_t size,
+		const AsyncCallback &callback, const CancellationToken &token)
+	{
+		return RunAsync([this, index, offset, data, size, token]
+		{
+			uint32_t done = 0;
+			while (done < size)
+			{
+				// chunks written so far stay written
+				if (token.IsCancelled()) return AsyncResult(AsyncStatus::Cancelled, done);
+
+				uint32_t sizeToProcess = std::min(size - done, kAsyncChunkSize);
+				FileThreadSetPointerTo(index, offset + done);
+				uint32_t res = FileThreadWrite(index, const_cast<char *>((const char *)data) + done, sizeToProcess);
+
+				done += res;
+				if (res < sizeToProcess) return AsyncResult(AsyncStatus::Failed, done);
+			}
+
+			return AsyncResult(AsyncStatus::Ok, done);
+		}, callback, token);
+	}
+
+	uint64_t MetafileImpl::FileThreadExportTo(uint32_t index, int fd, uint64_t offset, uint64_t size)
+	{
+		auto lock = LockTable();
+
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+
+		if (offset >= item.header.size) return 0;
+		size = std::min(size, item.header.size - offset);
+
+		if (IsSlab(index))
+		{
+			return FileThreadExportTo(m_slabThread, fd, item.header.blocks[0].offsetInUnderlyingFile + offset, size);
+		}
+
+		uint32_t blockNumber;
+		uint64_t offsetInBlock;
+		bool res = GetBlockByAddress(index, offset, blockNumber, offsetInBlock);
+		if (!res)	return 0;
+
+		auto buffers = GetBufferResource();
+		std::vector<char, BufferAllocator<char> > buffer((BufferAllocator<char>(buffers.get())));
+		uint64_t exported = 0;
+
+		while (exported < size && m_fileAccess->IsValid())
+		{
+			uint64_t record = item.header.blocks[blockNumber].offsetInUnderlyingFile;
+			uint64_t blockAddress = record & FileThreadInfo::kOffsetMask;
+			uint64_t sizeToProcess = std::min(GetBlockSize(index, blockNumber) - offsetInBlock, size - exported);
+			uint64_t processed = 0;
+
+			// whole extent goes kernel side if backend can do it. partial overlay block is mixed, it's copied
+			if (record != 0 && !(record & FileThreadInfo::kBlockPartial))
+			{
+				auto &access = (record & FileThreadInfo::kBlockInBase) ? m_baseAccess : m_fileAccess;
+				processed = access->TransferTo(fd, blockAddress + offsetInBlock, sizeToProcess);
+			}
+
+			// buffered copy of whatever is left. not allocated block reads as zeros
+			while (processed < sizeToProcess)
+			{
+				uint32_t chunk = (uint32_t)std::min((uint64_t)kExportBufferSize, sizeToProcess - processed);
+				buffer.resize(kExportBufferSize);
+
+				uint32_t actuallyRead = 0;
+				if (record != 0)
+				{
+					actuallyRead = BlockIo(index, blockNumber, offsetInBlock + processed, &buffer[0], chunk, &FileAccessInterface::Read);
+				}
+
+				memset(&buffer[actuallyRead], 0, chunk - actuallyRead);
+
+				if (!WriteToDescriptor(fd, &buffer[0], chunk))
+				{
+					SetError(ErrorCode::IoError, "Can not write to descriptor");
+					return exported + processed;
+				}
+
+				processed += chunk;
+			}
+
+			exported += processed;
+			blockNumber++;
+			offsetInBlock = 0;
+		}
+
+		TakeAccessError(*m_fileAccess);
+		return exported;
+	}
+
+	char *MetafileImpl::FileThreadBeginWrite(uint32_t index, uint32_t size, uint32_t &available)
+	{
+		auto lock = LockTable();
+		MarkDirty(0);
+
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+		PendingWrite &pending = item.pending;
+		uint64_t end = item.currentOffset + size;
+
+		pending.data = nullptr;
+		available = 0;
+		if (m_readOnly || size == 0) return nullptr;
+
+		StopAppends(index);
+		if (IsSlab(index) && end > m_file.header.slabSlotSize && !MoveFromSlab(index)) return nullptr;
+
+		pending.offset = item.currentOffset;
+		pending.inPlace = false;
+
+		// in place only where Write would store the data as is: own plain block, no slot
+		// and no fingerprint of the whole block
+		uint32_t block;
+		uint64_t offsetInBlock;
+		if (!IsSlab(index) && end > m_file.header.slabSlotSize && !IsDeduplicated(index) &&
+			GetBlockByAddress(index, item.currentOffset, block, offsetInBlock))
+		{
+			AllocateBlocksUpTo(index, block);
+			FileThreadInfo::BlockRecord &record = item.header.blocks[block];
+
+			if (!m_refcounts.empty() && m_refcounts.count(record.offsetInUnderlyingFile)) CopySharedBlock(index, block);
+			if (!m_fingerprintOf.empty()) ForgetFingerprint(record.offsetInUnderlyingFile);
+
+			if (!(record.offsetInUnderlyingFile & (FileThreadInfo::kBlockInBase | FileThreadInfo::kBlockPartial)))
+			{
+				uint64_t piece = std::min((uint64_t)size, GetBlockSize(index, block) - offsetInBlock);
+				piece = m_fileAccess->GetWritableData(record.offsetInUnderlyingFile + offsetInBlock, piece, pending.data);
+				pending.inPlace = piece != 0;
+				pending.size = (uint32_t)piece;
+			}
+		}
+
+		// copied once on commit
+		if (!pending.inPlace)
+		{
+			pending.size = std::min(size, kCopyBufferSize);
+			if (pending.buffer.size() < pending.size) pending.buffer.resize(pending.size);
+			pending.data = &pending.buffer[0];
+		}
+
+		TakeAccessError(*m_fileAccess);
+		available = pending.size;
+		return pending.data;
+	}
+
+	bool MetafileImpl::FileThreadCommitWrite(uint32_t index, uint32_t used)
+	{
+		auto lock = LockTable();
+
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+		PendingWrite &pending = item.pending;
+
+		char *data = pending.data;
+		pending.data = nullptr;
+		if (!data || used > pending.size || pending.offset != item.currentOffset) return false;
+		if (used == 0) return true;
+
+		if (!pending.inPlace) return FileThreadWrite(index, data, used) == used;
+
+		MarkDirty(used);
+		item.currentOffset += used;
+		if (item.currentOffset > item.header.size) item.header.size = item.currentOffset;
+		return true;
+	}
+
+	uint64_t MetafileImpl::FileThreadScan(uint32_t index, uint64_t offset, uint64_t size, const FileThread::ScanVisitor &visitor)
+	{
+		auto lock = LockTable();
+
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+
+		uint64_t streamSize = FileThreadGetSize(index);
+		if (offset >= streamSize) return 0;
+		size = std::min(size, streamSize - offset);
+
+		if (IsSlab(index))
+		{
+			// slot lives inside slab stream, visitor sees offsets of this stream
+			uint64_t slot = item.header.blocks[0].offsetInUnderlyingFile;
+			return FileThreadScan(m_slabThread, slot + offset, size, [&](uint64_t pieceOffset, const char *data, size_t pieceSize)
+			{
+				return visitor(pieceOffset - slot, data, pieceSize);
+			});
+		}
+
+		// appenders share the file, only the written prefix is visited
+		std::unique_lock<std::mutex> appendLock(m_appendLock, std::defer_lock);
+		if (item.append.phase.load() == AppendState::kActive) appendLock.lock();
+
+		uint32_t blockNumber;
+		uint64_t offsetInBlock;
+		bool res = GetBlockByAddress(index, offset, blockNumber, offsetInBlock);
+		if (!res)	return 0;
+
+		auto buffers = GetBufferResource();
+		std::vector<char, BufferAllocator<char> > buffer((BufferAllocator<char>(buffers.get())));
+		uint64_t scanned = 0;
+
+		while (scanned < size && m_fileAccess->IsValid())
+		{
+			uint64_t record = item.header.blocks[blockNumber].offsetInUnderlyingFile;
+			uint64_t blockAddress = record & FileThreadInfo::kOffsetMask;
+			uint64_t sizeToProcess = std::min(GetBlockSize(index, blockNumber) - offsetInBlock, size - scanned);
+
+			for (uint64_t processed = 0; processed < sizeToProcess;)
+			{
+				const char *data = nullptr;
+				uint64_t piece = 0;
+
+				// in place if backend keeps the file in memory
+				if (record != 0 && !(record & (FileThreadInfo::kBlockInBase | FileThreadInfo::kBlockPartial)))
+				{
+					piece = m_fileAccess->GetMappedData(blockAddress + offsetInBlock + processed, sizeToProcess - processed, data);
+				}
+
+				// large reads otherwise. not allocated block reads as zeros
+				if (piece == 0)
+				{
+					piece = std::min((uint64_t)kCopyBufferSize, sizeToProcess - processed);
+					buffer.resize(std::max(buffer.size(), (size_t)piece));
+
+					uint32_t actuallyRead = 0;
+					if (record != 0)
+					{
+						actuallyRead = BlockIo(index, blockNumber, offsetInBlock + processed, &buffer[0], (uint32_t)piece, &FileAccessInterface::Read);
+					}
+
+					memset(&buffer[actuallyRead], 0, (size_t)piece - actuallyRead);
+					data = &buffer[0];
+				}
+
+				processed += piece;
+				if (!visitor(offset + scanned + processed - piece, data, (size_t)piece))
+				{
+					TakeAccessError(*m_fileAccess);
+					return scanned + processed;
+				}
+			}
+
+			scanned += sizeToProcess;
+			blockNumber++;
+			offsetInBlock = 0;
+		}
+
+		TakeAccessError(*m_fileAccess);
+		return scanned;
+	}
+
+	void MetafileImpl::AllocateBlocksUpTo(uint32_t index, uint32_t block)
+	{
+		FileThreadInfo &header = m_file.threads[index].header;
+		if (header.blocks[block].offsetInUnderlyingFile != 0) return;
+
+		for (uint32_t i = 0; i <= block; i++)
+		{
+			if (header.blocks[i].offsetInUnderlyingFile != 0) continue;
+			header.blocks[i].offsetInUnderlyingFile = AllocateInZone(index, i);
+		}
+	}
+
+	uint64_t MetafileImpl::AllocateBlock(uint32_t index, uint32_t block, uint64_t prefix)
+	{
+		// copied and moved blocks don't make streams grow, they go after all zones
+		uint64_t address = std::max(FindAddressToAppendNewBlock(), m_endOfZones) + prefix;
+		m_endOfBlocks = address + GetBlockSize(index, block);
+		return address;
+	}
+
+	uint64_t MetafileImpl::AllocateInZone(uint32_t index, uint32_t block)
+	{
+		uint64_t size = GetBlockSize(index, block);
+		AllocationZone &zone = m_file.threads[index].zone;
+		if (zone.end - zone.next < size) OpenZone(index, size);
+
+		uint64_t address = zone.next;
+		zone.next += size;
+		zone.growth += size;
+
+		m_endOfBlocks = std::max(FindAddressToAppendNewBlock(), zone.next);
+		return address;
+	}
+
+	void MetafileImpl::OpenZone(uint32_t index, uint64_t size)
+	{
+		AllocationZone &zone = m_file.threads[index].zone;
+		uint64_t tail = std::max(FindAddressToAppendNewBlock(), m_endOfZones);
+
+		// nobody allocated after the zone, it grows in place by what is needed
+		if (zone.end != 0 && zone.end == tail)
+		{
+			zone.end = zone.next + size;
+			m_endOfZones = zone.end;
+			return;
+		}
+
+		// other streams grow too. as much as this one grew lately is reserved, so
+		// a steady writer needs a new zone about once per flush
+		uint64_t cluster = GetClusterSize(index);
+		uint64_t reserve = std::max(size, std::min(std::max(zone.size, zone.growth), kMaxZoneSize));
+		reserve = (reserve + cluster - 1) / cluster * cluster;
+
+		ReleaseZone(zone);
+
+		for (auto it = m_freeZones.begin(); it != m_freeZones.end(); ++it)
+		{
+			if (it->second - it->first < reserve) continue;
+
+			zone.next = it->first;
+			zone.end = it->first + reserve;
+
+			uint64_t end = it->second;
+			m_freeZones.erase(it);
+			if (zone.end < end) m_freeZones[zone.end] = end;
+			return;
+		}
+
+		zone.next = tail;
+		zone.end = tail + reserve;
+		m_endOfZones = zone.end;
+	}
+
+	void MetafileImpl::ReleaseZone(AllocationZone &zone)
+	{
+		uint64_t start = zone.next;
+		uint64_t end = zone.end;
+		zone.next = zone.end = 0;
+		if (start == end) return;
+
+		// neighbours are merged, so large zones can be taken from them again
+		auto next = m_freeZones.lower_bound(start);
+		if (next != m_freeZones.end() && next->first == end)
+		{
+			end = next->second;
+			next = m_freeZones.erase(next);
+		}
+
+		if (next != m_freeZones.begin())
+		{
+			auto previous = std::prev(next);
+			if (previous->second == start)
+			{
+				start = previous->first;
+				m_freeZones.erase(previous);
+			}
+		}
+
+		m_freeZones[start] = end;
+	}
+
+	void MetafileImpl::ReclaimZones()
+	{
+		// streams which stopped growing give their zones back. growth of the interval sizes the next zone
+		uint64_t endOfZones = 0;
+		for (auto &item : m_file.threads)
+		{
+			AllocationZone &zone = item.zone;
+			if (zone.growth == 0) ReleaseZone(zone);
+
+			zone.size = zone.growth;
+			zone.growth = 0;
+			endOfZones = std::max(endOfZones, zone.end);
+		}
+
+		// unused space at the end is not reserved any more
+		uint64_t tail = std::max(FindAddressToAppendNewBlock(), endOfZones);
+		m_freeZones.erase(m_freeZones.lower_bound(tail), m_freeZones.end());
+		if (!m_freeZones.empty()) endOfZones = std::max(endOfZones, m_freeZones.rbegin()->second);
+		m_endOfZones = endOfZones;
+	}
+
+	void MetafileImpl::DropZones()
+	{
+		for (auto &item : m_file.threads)
+		{
+			item.zone.next = item.zone.end = 0;
+		}
+
+		m_freeZones.clear();
+		m_endOfZones = 0;
+	}
+
+	void MetafileImpl::FindFreeZones()
+	{
+		// unused ends of zones of the last session lie between blocks, new zones are taken
+		// from them. overlay is not searched, its bitmaps and base blocks are not in the list
+		std::vector< std::pair<uint64_t, uint64_t> > used;
+		for (uint32_t index = 0; index < m_file.threads.size(); index++)
+		{
+			if (IsSlab(index)) continue;
+
+			for (uint32_t i = 0; i < FileThreadInfo::kNumberOfBlockRecords; i++)
+			{
+				uint64_t record = m_file.threads[index].header.blocks[i].offsetInUnderlyingFile;
+				if (record == 0) break;
+
+				uint64_t address = record & FileThreadInfo::kOffsetMask;
+				used.push_back(std::make_pair(address, address + GetBlockSize(index, i)));
+			}
+		}
+
+		std::sort(used.begin(), used.end());
+
+		m_freeZones.clear();
+		uint64_t end = GetDataRegionStart();
+		for (auto &range : used)
+		{
+			if (range.first > end) m_freeZones[end] = range.first;
+			end = std::max(end, range.second);
+		}
+	}
+
+	uint64_t MetafileImpl::FindAddressToAppendNewBlock()
+	{
+		// known while blocks are only added. 0 after anything was released or moved
+		if (m_endOfBlocks != 0) return m_endOfBlocks;
+
+		uint64_t ans = GetDataRegionStart();
+
+		// relocated, copied and overlay blocks break allocation order, so every block is checked
+		for (uint32_t index = 0; index < m_file.threads.size(); index++)
+		{
+			if (IsSlab(index)) continue;
+
+			for (uint32_t i = 0; i < FileThreadInfo::kNumberOfBlockRecords; i++)
+			{
+				uint64_t record = m_file.threads[index].header.blocks[i].offsetInUnderlyingFile;
+				if (record == 0) break;
+				if (record & FileThreadInfo::kBlockInBase) continue;
+
+				uint64_t candidate = (record & FileThreadInfo::kOffsetMask) + GetBlockSize(index, i);
+				if (ans < candidate) ans = candidate;
+			}
+		}
+
+		m_endOfBlocks = ans;
+		return ans;
+	}
+
+	uint64_t MetafileImpl::GetDataRegionStart()
+	{
+		uint64_t alignment = std::max(1u, m_fileAccess->GetAlignment());
+		uint64_t tableEnd = sizeof(MetafileHeader) + sizeof(FileThreadInfo) * m_file.threads.size();
+
+		if (m_file.header.version >= MetafileHeader::kVersionDirectory)
+		{
+			tableEnd = sizeof(MetafileHeader) + m_file.header.directoryCapacity;
+		}
+
+		return (tableEnd + alignment - 1) / alignment * alignment;
+	}
+
+	void MetafileImpl::GrowDirectory(uint64_t directorySize)
+	{
+		// twice the need, so streams can grow and be added for a while without moving blocks again
+		uint64_t end = (sizeof(MetafileHeader) + directorySize * 2 + kDirectoryGranularity - 1) / kDirectoryGranularity * kDirectoryGranularity;
+		m_file.header.directoryCapacity = (uint32_t)(end - sizeof(MetafileHeader));
+
+		// zones may start below the new data region
+		m_endOfBlocks = 0;
+		DropZones();
+		RelocateBlocksBelow(GetDataRegionStart());
+	}
+
+	bool MetafileImpl::PackProfile(const StreamProfile &profile, FileThreadInfo &header)
+	{
+		header.clusterShift = 0;
+		uint64_t cluster = m_file.header.sizeOfCluster;
+
+		if (profile.clusterSize != 0)
+		{
+			if (profile.clusterSize & (profile.clusterSize - 1)) return false;
+
+			// blocks must stay aligned for the backend
+			uint32_t size = std::max(profile.clusterSize, m_fileAccess->GetAlignment());
+			while ((1u << header.clusterShift) < size) header.clusterShift++;
+			if (header.clusterShift < kMinClusterShift || header.clusterShift > kMaxClusterShift) return false;
+
+			cluster = 1ull << header.clusterShift;
+		}
+
+		uint64_t parameter = profile.parameter;
+		switch (profile.growth)
+		{
+		case BlockGrowth::Default:
+			header.growth = FileThreadInfo::kGrowthDefault;
+			parameter = 0;
+			break;
+
+		case BlockGrowth::Fixed:
+			header.growth = FileThreadInfo::kGrowthFixed;
+			break;
+
+		case BlockGrowth::Geometric:
+			header.growth = FileThreadInfo::kGrowthGeometric;
+			break;
+
+		case BlockGrowth::SizeHint:
+			header.growth = FileThreadInfo::kGrowthSizeHint;
+			parameter = std::max((uint64_t)1, std::min((parameter + cluster - 1) / cluster, (uint64_t)UINT16_MAX));
+			break;
+
+		default:
+			return false;
+		}
+
+		if (parameter > UINT16_MAX) return false;
+		header.growthParameter = (uint16_t)parameter;
+		return IsValidProfile(header);
+	}
+
+	bool MetafileImpl::IsValidProfile(const FileThreadInfo &header)
+	{
+		if (header.clusterShift != 0 && (header.clusterShift < kMinClusterShift || header.clusterShift > kMaxClusterShift)) return false;
+
+		switch (header.growth)
+		{
+		case FileThreadInfo::kGrowthDefault: return true;
+		case FileThreadInfo::kGrowthFixed: return header.growthParameter != 0;
+		case FileThreadInfo::kGrowthGeometric: return header.growthParameter >= 256;
+		case FileThreadInfo::kGrowthSizeHint: return header.growthParameter != 0;
+		case FileThreadInfo::kGrowthExtent: return m_file.header.version == MetafileHeader::kVersionSealed;
+		}
+
+		return false;
+	}
+
+	StreamProfile MetafileImpl::FileThreadGetProfile(uint32_t index)
+	{
+		assert(index < m_file.threads.size());
+		const FileThreadInfo &header = m_file.threads[index].header;
+		uint32_t cluster = (uint32_t)GetClusterSize(index);
+
+		switch (header.growth)
+		{
+		case FileThreadInfo::kGrowthFixed: return StreamProfile::Fixed(header.growthParameter, cluster);
+		case FileThreadInfo::kGrowthGeometric: return StreamProfile::Geometric(header.growthParameter / 256.0, cluster);
+		case FileThreadInfo::kGrowthSizeHint: return StreamProfile::SizeHint((uint64_t)header.growthParameter * cluster, cluster);
+		}
+
+		StreamProfile res;
+		res.clusterSize = cluster;
+		return res;
+	}
+
+	void MetafileImpl::BuildLayout(const FileThreadInfo &header, BlockLayout &layout)
+	{
+		layout.clusterSize = header.clusterShift ? 1ull << header.clusterShift : m_file.header.sizeOfCluster;
+		uint64_t maxClusters = kMaxBlockSize / layout.clusterSize;
+
+		uint64_t clusters = 1;
+		uint64_t scaled = 256;	// geometric growth, clusters * 256
+		layout.starts[0] = 0;
+
+		// sealed stream, first block is bigger than any stream. GetBlockSize gives its real size
+		if (header.growth == FileThreadInfo::kGrowthExtent)
+		{
+			for (uint32_t i = 0; i < FileThreadInfo::kNumberOfBlockRecords; i++)
+			{
+				layout.sizes[i] = i == 0 ? kMaxBlockSize : 0;
+				layout.starts[i + 1] = kMaxBlockSize;
+			}
+
+			return;
+		}
+
+		for (uint32_t i = 0; i < FileThreadInfo::kNumberOfBlockRecords; i++)
+		{
+			switch (header.growth)
+			{
+			case FileThreadInfo::kGrowthFixed:
+				clusters = header.growthParameter;
+				break;
+
+			case FileThreadInfo::kGrowthGeometric:
+				clusters = (scaled + 255) / 256;
+				if (clusters < maxClusters) scaled = scaled / 256 * header.growthParameter + scaled % 256 * header.growthParameter / 256;
+				break;
+
+			case FileThreadInfo::kGrowthSizeHint:
+				if (i == 0) clusters = header.growthParameter;
+				else if (clusters < maxClusters) clusters *= 2;
+				break;
+
+			default:
+				// 1, 2, 3, 4, then alternately *3/2 and *4/3
+				if (i < 5) clusters = std::max(i, 1u);
+				else if (i % 2 == 1) clusters = clusters / 2 * 3;
+				else clusters = clusters / 3 * 4;
+			}
+
+			layout.sizes[i] = std::min(clusters, maxClusters) * layout.clusterSize;
+			layout.starts[i + 1] = layout.starts[i] + layout.sizes[i];
+		}
+	}
+
+	const MetafileImpl::BlockLayout &MetafileImpl::GetLayout(uint32_t index)
+	{
+		assert(index < m_file.threads.size());
+		RuntimeThreadInfo &item = m_file.threads[index];
+
+		uint64_t key = (uint64_t)m_file.header.sizeOfCluster << 32 | (uint64_t)item.header.growthParameter << 16 |
+			item.header.growth << 8 | item.header.clusterShift;
+
+		// streams with the same profile share one layout, computed once
+		if (item.layout && item.layoutKey == key) return *item.layout;
+
+		auto it = m_layouts.find(key);
+		if (it == m_layouts.end())
+		{
+			it = m_layouts.insert(std::make_pair(key, BlockLayout())).first;
+			BuildLayout(item.header, it->second);
+		}
+
+		item.layout = &it->second;
+		item.layoutKey = key;
+		return it->second;
+	}
+
+	uint64_t MetafileImpl::GetClusterSize(uint32_t index)
+	{
+		return GetLayout(index).clusterSize;
+	}
+
+	uint64_t MetafileImpl::GetBlockSize(uint32_t index, uint32_t block)
+	{
+		const FileThreadInfo &header = m_file.threads[index].header;
+		if (header.growth == FileThreadInfo::kGrowthExtent) return block == 0 ? header.size : 0;
+
+		return GetLayout(index).sizes[block];
+	}
+
+	bool MetafileImpl::GetBlockByAddress(uint32_t index, uint64_t address, uint32_t &block, uint64_t &offsetInBlock)
+	{
+		const BlockLayout &layout = GetLayout(index);
+		const uint64_t *end = layout.starts + FileThreadInfo::kNumberOfBlockRecords + 1;
+
+		// first block which ends after address
+		const uint64_t *next = std::upper_bound(layout.starts + 1, end, address);
+		if (next == end) return false;
+
+		block = (uint32_t)(next - layout.starts - 1);
+		offsetInBlock = address - layout.starts[block];
+		return true;
 	}
 
 } // namespace
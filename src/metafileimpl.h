@@ -7,63 +7,328 @@
 */
 
 #pragma once
+#include <atomic>
+#include <deque>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <vector>
+#include "asyncio.h"
 #include "fileaccessinterface.h"
 #include "filethread.h"
+#include "fingerprint.h"
 #include "layout.h"
+#include "metafile.h"
+#include "streamprofile.h"
 
 namespace metafile {
 
-	class MetafileImpl
+	class AsyncQueue;
+	class BackgroundFlusher;
+	class BulkReader;
+
+	class MetafileImpl : public std::enable_shared_from_this<MetafileImpl>
 	{
 	public:
 		MetafileImpl();
 		~MetafileImpl();
 
 		void SetFileAccessInterface(const  std::shared_ptr<FileAccessInterface> &fileAccess);
+
+		// lets ReadMany open more handles of the same file, one per thread
+		void SetReaderSource(const std::shared_ptr<FileAccessInterfaceAbstractFactory> &factory, const std::string &path);
+		void SetReadOnly();
+		void SetSingleWriter();
 		void Init();
-		void InitEmpty(const std::vector<std::string> &threadNames);
+		void InitEmpty(const std::vector<std::string> &threadNames, const CreateOptions &options);
+
+		// overlay: base container is only read. must be set before Init/InitOverlay
+		void SetBaseFileAccessInterface(const std::shared_ptr<FileAccessInterface> &baseAccess);
+		void InitOverlay();
 
 		bool IsValid();
 		std::string GetLastError();
-		std::vector< FileThread *> GetRefToAllThreads();
+		ErrorCode GetLastErrorCode();
+		const std::vector<FileThread *> &GetRefToAllThreads();
+		FileThread *GetThread(const char *name, size_t length);
+		bool ReadMany(std::vector<ReadRequest> &requests, uint32_t numberOfThreads);
 		void FlushToDisk();
 
+		// background flush. Flush waits for it if it runs
+		bool StartBackgroundFlush(const FlushPolicy &policy);
+		void StopBackgroundFlush();
+		void Flush();
+
+		// async operations run one at a time on executor, pending ones keep this object alive
+		void SetExecutor(const std::shared_ptr<Executor> &executor);
+		std::future<AsyncResult> FlushAsync(const AsyncCallback &callback, const CancellationToken &token);
+
+		void SetBufferResource(const std::shared_ptr<BufferResource> &resource);
+		std::shared_ptr<BufferResource> GetBufferResource();
+
+		// moveBlocks false leaves blocks under the grown table to one MoveBlocksFromTable call
+		FileThread *CloneThread(const std::string &source, const std::string &newName, bool moveBlocks = true);
+		bool Snapshot(const std::string &suffix);
+		bool UpgradeFormat();
+		bool Seal(const std::string &outputPath);
+		bool Refresh();
+		bool Verify(VerifyReport &report, const VerifyOptions &options);
+
 		// threads
 
-		std::string FileThreadGetName(uint32_t index);
+		const char *FileThreadGetName(uint32_t index);
 		uint64_t	FileThreadGetSize(uint32_t index);
 		bool		FileThreadSetSize(uint32_t index, uint64_t newFileSize);
 		uint32_t	FileThreadWrite(uint32_t index, void *data, uint32_t size);
 		uint32_t	FileThreadRead(uint32_t index, void *data, uint32_t size);
 		void		FileThreadSetPointerTo(uint32_t index, uint64_t pos);
+		uint64_t	FileThreadReadAt(uint32_t index, uint64_t offset, void *data, uint64_t size);
+		uint64_t	FileThreadWriteAt(uint32_t index, uint64_t offset, const void *data, uint64_t size);
+		void		FileThreadReserve(uint32_t index, uint64_t size);
+		uint64_t	FileThreadAppend(uint32_t index, const void *data, uint32_t size);
+		StreamProfile FileThreadGetProfile(uint32_t index);
+		uint64_t	FileThreadExportTo(uint32_t index, int fd, uint64_t offset, uint64_t size);
+		char	   *FileThreadBeginWrite(uint32_t index, uint32_t size, uint32_t &available);
+		bool		FileThreadCommitWrite(uint32_t index, uint32_t used);
+		uint64_t	FileThreadScan(uint32_t index, uint64_t offset, uint64_t size, const FileThread::ScanVisitor &visitor);
+		std::future<AsyncResult> FileThreadReadAsync(uint32_t index, uint64_t offset, void *data, uint32_t size,
+			const AsyncCallback &callback, const CancellationToken &token);
+		std::future<AsyncResult> FileThreadWriteAsync(uint32_t index, uint64_t offset, const void *data, uint32_t size,
+			const AsyncCallback &callback, const CancellationToken &token);
 
 	private:
 
+		// sizes and start offsets of blocks for one profile
+		struct BlockLayout
+		{
+			uint64_t clusterSize;
+			uint64_t sizes[FileThreadInfo::kNumberOfBlockRecords];
+			uint64_t starts[FileThreadInfo::kNumberOfBlockRecords + 1];
+		};
+
+		// FileThread::Append. ranges are reserved by fetch_add and become visible in the same order
+		struct AppendState
+		{
+			static const uint32_t kIdle = 0;
+			static const uint32_t kStarting = 1;	// first appender prepares the stream, others wait
+			static const uint32_t kActive = 2;
+
+			std::atomic<uint32_t> phase;
+			std::atomic<uint64_t> reserved;			// end of the last reserved range
+			std::atomic<uint64_t> committed;		// ranges below are finished, written or not
+			std::atomic<uint64_t> size;				// written prefix, size of stream while active
+			std::atomic<uint32_t> allocatedBlocks;	// records below are set and stay while active
+			std::atomic<bool> failed;				// nothing after a failed range becomes visible
+
+			AppendState() : phase(kIdle), reserved(0), committed(0), size(0), allocatedBlocks(0), failed(false) {}
+
+			// stream is copied only while idle, state starts over
+			AppendState(const AppendState &) : phase(kIdle), reserved(0), committed(0), size(0), allocatedBlocks(0), failed(false) {}
+		};
+
+		// blocks of a growing stream are carved from address space reserved for it, so streams
+		// which grow at the same time don't interleave. runtime only, nothing of it is saved,
+		// space between blocks is found again on open (FindFreeZones)
+		struct AllocationZone
+		{
+			uint64_t next;		// next block goes here
+			uint64_t end;		// 0 if stream has no zone
+			uint64_t growth;	// bytes allocated since last flush
+			uint64_t size;		// growth in the previous flush interval
+
+			AllocationZone() : next(0), end(0), growth(0), size(0) {}
+		};
+
+		// FileThread::BeginWrite. piece handed out and not committed yet
+		struct PendingWrite
+		{
+			char *data;		// nullptr if there is none
+			uint32_t size;
+			uint64_t offset;	// in stream
+			bool inPlace;	// memory of the backend, buffer otherwise
+			std::vector<char> buffer;	// kept for next pieces
+
+			PendingWrite() : data(nullptr), size(0), offset(0), inPlace(false) {}
+		};
+
 		struct RuntimeThreadInfo
 		{
 			FileThreadInfo header;
 			FileThread interfaceObject;
 			uint64_t currentOffset;
+
+			const BlockLayout *layout;	// cached GetLayout, valid while layoutKey matches
+			uint64_t layoutKey;
+
+			AppendState append;
+			AllocationZone zone;
+			PendingWrite pending;
+
+			RuntimeThreadInfo() : currentOffset(0), layout(nullptr), layoutKey(0) {}
 		};
 
 		struct RuntimeFileInfo
 		{
 			MetafileHeader header;
-			std::vector<RuntimeThreadInfo> threads;
+			std::deque<RuntimeThreadInfo> threads;	// deque, FileThread pointers survive adding a stream
+		};
+
+		// overlay. which clusters of a kBlockPartial block are already copied from base
+		struct ClusterBitmap
+		{
+			std::vector<uint8_t> bits;
+			uint64_t numberOfCopied;
+			bool dirty;
+		};
+
+		// Verify. bytes used by one block, bitmap of partial block included
+		struct BlockExtent
+		{
+			uint64_t start;
+			uint64_t end;
+			uint64_t record;
+			uint32_t index;
+			uint32_t block;
 		};
 
 		typedef uint32_t(FileAccessInterface:: * IoOperationFunction)(void *buffer, uint32_t bufferSize);
 
 		uint32_t FileIoOperation(uint32_t index, void *data, uint32_t size, IoOperationFunction operation);
+		uint32_t BlockIo(uint32_t index, uint32_t block, uint64_t offsetInBlock, char *data, uint32_t size, IoOperationFunction operation);
+		uint32_t PartialBlockIo(uint32_t index, uint32_t block, uint64_t offsetInBlock, char *data, uint32_t size, bool write);
+		uint32_t ReadFromBase(uint64_t address, char *data, uint32_t size);
+		void	 MaterializeBlock(uint32_t index, uint32_t block);
+		ClusterBitmap &GetClusterBitmap(uint32_t index, uint32_t block);
+		uint64_t GetClusterBitmapSize(uint32_t index, uint32_t block);
+		void	 FlushClusterBitmaps();
+		bool	 LoadBaseTable(MetafileHeader &baseHeader);
+		uint64_t HashBaseTable();
+		bool	 CheckBase();
+		bool	 ReadTable(FileAccessInterface &access, const MetafileHeader &header, std::vector<FileThreadInfo> &table);
+		bool	 LoadSealedIndex(const char *head, uint32_t headSize);
+		void	 GrowDirectory(uint64_t directorySize);
+		bool	 StartAppends(uint32_t index);
+		void	 StopAppends(uint32_t index);
+		bool	 AppendToBlocks(uint32_t index, uint64_t offset, const char *data, uint32_t size);
+		bool	 AppendIo(uint64_t address, const char *data, uint32_t size);
+		void	 LoadSlabs();
+		bool	 IsSlab(uint32_t index);
+		bool	 MoveToSlab(uint32_t index);
+		bool	 MoveFromSlab(uint32_t index);
+		void	 FreeSlot(uint32_t index);
+		uint32_t SlabIo(uint32_t index, void *data, uint32_t size, bool write);
+		uint32_t WriteBlocks(uint32_t index, void *data, uint32_t size);
+		void	 AddExtents(BulkReader &reader, uint32_t index, uint64_t offset, uint64_t size, char *data);
+		void	 SetError(ErrorCode code, const std::string &message);
+		bool	 TakeAccessError(FileAccessInterface &access);
+		bool	 FindThread(const std::string &name, uint32_t &index);
+		bool	 FindThread(const char *name, size_t length, uint32_t &index);
+		bool	 AddThread(const std::string &name, uint32_t flags, uint32_t &index, bool moveBlocks = true);
+		void	 MoveBlocksFromTable();
+		void	 VerifyStreams(std::vector<BlockExtent> &extents, VerifyReport &report);
+		void	 VerifyExtents(std::vector<BlockExtent> &extents, bool repair, VerifyReport &report);
+		void	 VerifyFingerprints(const std::vector<BlockExtent> &extents, bool repair, VerifyReport &report);
+		void	 VerifySharing(bool repair, VerifyReport &report);
+		void	 ScanBlocks(const std::vector<BlockExtent> &extents, uint32_t numberOfThreads, bool repair, VerifyReport &report);
+		void	 CountReferences(std::map<uint64_t, uint64_t> &references);
+		std::string DescribeBlock(uint32_t index, uint32_t block);
+		void	 RelocateBlocksBelow(uint64_t limit);
+		void	 CopyData(uint64_t from, uint64_t to, uint64_t size);
+		void	 CopySharedBlock(uint32_t index, uint32_t block);
+		void	 ReleaseBlock(uint64_t address);
+		void	 LoadRefcounts();
+		void	 SaveRefcounts();
+		bool	 IsDeduplicated(uint32_t index);
+		bool	 ShareBlock(uint32_t index, uint32_t block, const Fingerprint &fingerprint, const char *data);
+		bool	 IsSameContent(uint64_t address, const char *data, uint64_t size);
+		std::unique_lock<std::recursive_mutex> LockTable();
+		bool	 SaveInBackground(bool sync);
+		void	 SaveTable(bool sync = false);
+		void	 EnterAppend();
+		void	 MarkDirty(uint64_t size);
+		uint64_t AppendRange(uint32_t index, const void *data, uint32_t size);
+
+		void	 AddFingerprint(uint64_t address, const Fingerprint &fingerprint);
+		void	 ForgetFingerprint(uint64_t address);
+		void	 LoadFingerprints();
+		void	 SaveFingerprints();
+		void	 AllocateBlocksUpTo(uint32_t index, uint32_t block);
+		uint64_t AllocateBlock(uint32_t index, uint32_t block, uint64_t prefix);
+		uint64_t AllocateInZone(uint32_t index, uint32_t block);
 		uint64_t FindAddressToAppendNewBlock();
-		uint64_t GetBlockSizeByIndex(uint32_t index);
-		bool	 GetBlockByAddress(uint64_t address, uint32_t &block, uint64_t &offsetInBlock);
+		void	 OpenZone(uint32_t index, uint64_t size);
+		void	 ReleaseZone(AllocationZone &zone);
+		void	 ReclaimZones();
+		void	 DropZones();
+		void	 FindFreeZones();
+		std::future<AsyncResult> RunAsync(const std::function<AsyncResult()> &operation,
+			const AsyncCallback &callback, const CancellationToken &token);
+		uint64_t GetDataRegionStart();
+		bool	 PackProfile(const StreamProfile &profile, FileThreadInfo &header);
+		bool	 IsValidProfile(const FileThreadInfo &header);
+		void	 BuildLayout(const FileThreadInfo &header, BlockLayout &layout);
+		const BlockLayout &GetLayout(uint32_t index);
+		uint64_t GetClusterSize(uint32_t index);
+		uint64_t GetBlockSize(uint32_t index, uint32_t block);
+		bool	 GetBlockByAddress(uint32_t index, uint64_t address, uint32_t &block, uint64_t &offsetInBlock);
 
 		std::shared_ptr<FileAccessInterface> m_fileAccess;
 		RuntimeFileInfo m_file;
 		std::string m_errorMessage;
+		ErrorCode m_errorCode;
+		bool m_readOnly;	// nothing is written, mutations fail without touching the file
+		bool m_singleWriter;	// holds lock of the writer, readers may follow with Refresh
+
+		// appends: block allocation, preparing a stream, copies of backends without WriteAt
+		std::mutex m_appendLock;
+
+		std::shared_ptr<FileAccessInterface> m_baseAccess;
+		std::vector<FileThreadInfo> m_baseThreads;
+		std::map<uint64_t, ClusterBitmap> m_clusterBitmaps;	// key is index << 32 | block
+
+		// visible streams in table order, extended when streams are added
+		std::vector<FileThread *> m_visibleThreads;
+		size_t m_numberOfListedThreads;
+
+		static const uint32_t kNoThread = ~0u;
+		uint32_t m_refcountThread;
+		std::map<uint64_t, uint64_t> m_refcounts;	// address -> number of references, shared blocks only
+
+		uint32_t m_fingerprintThread;	// kNoThread unless container deduplicates
+		std::map<Fingerprint, uint64_t> m_fingerprints;	// -> address of unmodified whole block
+		std::map<uint64_t, Fingerprint> m_fingerprintOf;
+
+		uint32_t m_slabThread;
+		std::vector<uint64_t> m_freeSlots;	// offsets in "$slabs"
+
+		// key is sizeOfCluster << 32 | packed profile. map nodes do not move, streams point into it
+		std::map<uint64_t, BlockLayout> m_layouts;
+
+		static const uint64_t kMaxBlockSize = 1ull << 50;
+		static const uint8_t kMinClusterShift = 9;
+		static const uint8_t kMaxClusterShift = 30;
+		uint64_t m_endOfBlocks;	// end of the furthest block, 0 if not known
+
+		uint64_t m_endOfZones;	// end of the furthest zone or free zone, 0 if none
+		std::map<uint64_t, uint64_t> m_freeZones;	// start -> end, unused parts of released zones
+
+		std::shared_ptr<FileAccessInterfaceAbstractFactory> m_readerFactory;
+		std::string m_path;
+
+		std::mutex m_buffersLock;
+		std::shared_ptr<BufferResource> m_buffers;	// created by first request unless set
+
+		std::mutex m_asyncLock;
+		std::shared_ptr<Executor> m_executor;
+		std::shared_ptr<AsyncQueue> m_asyncQueue;	// created by first async operation
+
+		// background flush. calls take the table lock while flusher exists, appenders
+		// don't, flusher waits for the ones in flight and holds new ones at the gate
+		std::unique_ptr<BackgroundFlusher> m_flusher;
+		std::recursive_mutex m_tableLock;
+		std::atomic<uint32_t> m_appendsInFlight;
+		std::atomic<bool> m_flushing;
 	};
 
 } // namespace
@@ -23,26 +23,62 @@ namespace metafile
 
 	}
 
-	std::shared_ptr<Metafile> MetafileLib::OpenInternal(const std::string &path)
+	std::shared_ptr<Metafile> MetafileLib::OpenInternal(const std::string &path, OpenMode mode)
 	{
 		auto fileAccess = m_AccessFactory->CreateFile();
-		fileAccess->UseFile(path);
-
 		auto file = std::make_shared<Metafile>();
+
+		if (mode == OpenMode::ReadOnly)
+		{
+			fileAccess->UseFileReadOnly(path);
+			file->SetReadOnly();
+		}
+		else
+		{
+			fileAccess->UseFile(path);
+			if (mode == OpenMode::SingleWriter) file->SetSingleWriter();
+		}
+
 		file->SetFileAccessInterface(fileAccess);
+		file->SetReaderSource(m_AccessFactory, path);
+		return file;
+	}
+
+	std::shared_ptr<FileAccessInterface> MetafileLib::OpenBase(const std::string &basePath)
+	{
+		// base is never written
+		auto baseAccess = m_AccessFactory->CreateFile();
+		baseAccess->UseFileReadOnly(basePath);
+		return baseAccess;
+	}
+
+	std::shared_ptr<Metafile> MetafileLib::CreateNewFile(const std::string &path, const std::vector<std::string> &threadNames,
+		const CreateOptions &options)
+	{
+		auto file = OpenInternal(path);
+		file->InitEmpty(threadNames, options);
+		return file;
+	}
+
+	std::shared_ptr<Metafile> MetafileLib::OpenFile(const std::string &path, OpenMode mode)
+	{
+		auto file = OpenInternal(path, mode);
+		file->Init();
 		return file;
 	}
 
-	std::shared_ptr<Metafile> MetafileLib::CreateNewFile(const std::string &path, const std::vector<std::string> &threadNames)
+	std::shared_ptr<Metafile> MetafileLib::CreateOverlay(const std::string &path, const std::string &basePath)
 	{
 		auto file = OpenInternal(path);
-		file->InitEmpty(threadNames);
+		file->SetBaseFileAccessInterface(OpenBase(basePath));
+		file->InitOverlay();
 		return file;
 	}
 
-	std::shared_ptr<Metafile> MetafileLib::OpenFile(const std::string &path)
+	std::shared_ptr<Metafile> MetafileLib::OpenOverlay(const std::string &path, const std::string &basePath)
 	{
 		auto file = OpenInternal(path);
+		file->SetBaseFileAccessInterface(OpenBase(basePath));
 		file->Init();
 		return file;
 	}
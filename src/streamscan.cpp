@@ -0,0 +1,208 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "streamscan.h"
+#include <algorithm>
+#include <string>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define METAFILE_HAVE_SSE2
+#endif
+
+namespace metafile
+{
+	// tables for slicing by 8, built at startup. function level statics are not thread safe in vs2013
+	struct Crc32Tables
+	{
+		uint32_t table[8][256];
+
+		Crc32Tables()
+		{
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t crc = i;
+				for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+				table[0][i] = crc;
+			}
+
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				for (int slice = 1; slice < 8; slice++)
+				{
+					uint32_t previous = table[slice - 1][i];
+					table[slice][i] = (previous >> 8) ^ table[0][previous & 0xff];
+				}
+			}
+		}
+	};
+
+	static const Crc32Tables g_crc32;
+
+	static size_t FindInMemory(const char *data, size_t size, const char *pattern, size_t patternSize)
+	{
+		for (size_t i = 0; i + patternSize <= size;)
+		{
+			const char *first = (const char *)memchr(data + i, pattern[0], size - patternSize + 1 - i);
+			if (!first) break;
+
+			i = first - data;
+			if (memcmp(first, pattern, patternSize) == 0) return i;
+			i++;
+		}
+
+		return std::string::npos;
+	}
+
+	uint64_t FindByte(FileThread &thread, uint64_t offset, char value)
+	{
+		uint64_t found = kNotFound;
+
+		thread.Scan(offset, ~0ull, [&](uint64_t pieceOffset, const char *data, size_t size)
+		{
+			const char *res = (const char *)memchr(data, value, size);
+			if (res) found = pieceOffset + (res - data);
+			return !res;
+		});
+
+		return found;
+	}
+
+	uint64_t FindPattern(FileThread &thread, uint64_t offset, const void *pattern, size_t size)
+	{
+		if (size == 0) return offset <= thread.GetSize() ? offset : kNotFound;
+		if (size == 1) return FindByte(thread, offset, *(const char *)pattern);
+
+		const char *needle = (const char *)pattern;
+		uint64_t found = kNotFound;
+		std::string tail;	// last size - 1 bytes before the piece
+
+		thread.Scan(offset, ~0ull, [&](uint64_t pieceOffset, const char *data, size_t pieceSize)
+		{
+			// match which starts in previous pieces and ends in this one
+			if (!tail.empty())
+			{
+				std::string window = tail;
+				window.append(data, std::min(pieceSize, size - 1));
+
+				size_t pos = FindInMemory(window.data(), window.size(), needle, size);
+				if (pos != std::string::npos && pos < tail.size())
+				{
+					found = pieceOffset - tail.size() + pos;
+					return false;
+				}
+			}
+
+			size_t pos = FindInMemory(data, pieceSize, needle, size);
+			if (pos != std::string::npos)
+			{
+				found = pieceOffset + pos;
+				return false;
+			}
+
+			if (pieceSize >= size - 1)
+			{
+				tail.assign(data + pieceSize - (size - 1), size - 1);
+			}
+			else
+			{
+				tail.append(data, pieceSize);
+				if (tail.size() > size - 1) tail.erase(0, tail.size() - (size - 1));
+			}
+
+			return true;
+		});
+
+		return found;
+	}
+
+	uint64_t CountLines(FileThread &thread)
+	{
+		uint64_t count = 0;
+
+		thread.Scan(0, ~0ull, [&](uint64_t, const char *data, size_t size)
+		{
+			count += CountByte(data, size, '\n');
+			return true;
+		});
+
+		return count;
+	}
+
+	uint32_t ComputeCrc32(FileThread &thread, uint64_t offset, uint64_t size)
+	{
+		uint32_t crc = 0;
+
+		thread.Scan(offset, size, [&](uint64_t, const char *data, size_t pieceSize)
+		{
+			crc = UpdateCrc32(crc, data, pieceSize);
+			return true;
+		});
+
+		return crc;
+	}
+
+	size_t CountByte(const char *data, size_t size, char value)
+	{
+		size_t count = 0;
+		size_t i = 0;
+
+#ifdef METAFILE_HAVE_SSE2
+		const __m128i target = _mm_set1_epi8(value);
+		const __m128i zero = _mm_setzero_si128();
+
+		while (size - i >= 16)
+		{
+			// matches are counted per byte lane, lanes overflow after 255 rounds
+			size_t rounds = std::min((size - i) / 16, (size_t)255);
+			__m128i counters = zero;
+
+			for (size_t round = 0; round < rounds; round++, i += 16)
+			{
+				__m128i bytes = _mm_loadu_si128((const __m128i *)(data + i));
+				counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(bytes, target));
+			}
+
+			__m128i sums = _mm_sad_epu8(counters, zero);
+			count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_extract_epi16(sums, 4);
+		}
+#endif
+
+		for (; i < size; i++)
+		{
+			if (data[i] == value) count++;
+		}
+
+		return count;
+	}
+
+	uint32_t UpdateCrc32(uint32_t crc, const void *data, size_t size)
+	{
+		auto &table = g_crc32.table;
+		const uint8_t *p = (const uint8_t *)data;
+		crc = ~crc;
+
+		for (; size >= 8; size -= 8, p += 8)
+		{
+			uint32_t low = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+			uint32_t high = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+
+			crc = table[7][low & 0xff] ^ table[6][(low >> 8) & 0xff] ^ table[5][(low >> 16) & 0xff] ^ table[4][low >> 24] ^
+				table[3][high & 0xff] ^ table[2][(high >> 8) & 0xff] ^ table[1][(high >> 16) & 0xff] ^ table[0][high >> 24];
+		}
+
+		for (; size != 0; size--, p++)
+		{
+			crc = (crc >> 8) ^ table[0][(crc ^ *p) & 0xff];
+		}
+
+		return ~crc;
+	}
+
+} // namespace
@@ -0,0 +1,400 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "stripedfileaccess.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <assert.h>
+
+namespace metafile
+{
+	// runs tasks of one member in order on its own thread
+	class StripeWorker
+	{
+	public:
+		StripeWorker()
+			: m_busy(false)
+			, m_stop(false)
+		{
+			m_thread = std::thread(&StripeWorker::Run, this);
+		}
+
+		~StripeWorker()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_stop = true;
+			}
+
+			m_wakeUp.notify_one();
+			m_thread.join();
+		}
+
+		void Post(const std::function<void()> &task)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				m_task = task;
+				m_busy = true;
+			}
+
+			m_wakeUp.notify_one();
+		}
+
+		void Wait()
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+			m_done.wait(lock, [this] { return !m_busy; });
+		}
+
+	private:
+		void Run()
+		{
+			std::unique_lock<std::mutex> lock(m_lock);
+
+			while (true)
+			{
+				m_wakeUp.wait(lock, [this] { return m_busy || m_stop; });
+				if (m_stop) return;
+
+				lock.unlock();
+				m_task();
+				lock.lock();
+
+				m_busy = false;
+				m_done.notify_all();
+			}
+		}
+
+		std::thread m_thread;
+		std::mutex m_lock;
+		std::condition_variable m_wakeUp;
+		std::condition_variable m_done;
+		std::function<void()> m_task;
+		bool m_busy;
+		bool m_stop;
+	};
+
+	StripedFileAccess::StripedFileAccess(const std::vector< std::shared_ptr<FileAccessInterface> > &memberAccess,
+		const std::vector<StripeMember> &members, uint32_t stripeSize)
+		: m_members(memberAccess)
+		, m_config(members)
+		, m_stripeSize(stripeSize)
+		, m_position(0)
+	{
+		assert(!m_members.empty() && m_members.size() == m_config.size() && m_stripeSize != 0);
+
+		uint32_t numberOfSlots = 0;
+		for (auto &member : m_config)
+		{
+			assert(member.weight != 0);
+			numberOfSlots += member.weight;
+		}
+
+		// smooth weighted round robin, heavy members do not get long runs of stripes
+		std::vector<int64_t> current(m_config.size(), 0);
+		std::vector<uint32_t> taken(m_config.size(), 0);
+
+		for (uint32_t slot = 0; slot < numberOfSlots; slot++)
+		{
+			uint32_t best = 0;
+			for (uint32_t i = 0; i < m_config.size(); i++)
+			{
+				current[i] += m_config[i].weight;
+				if (current[i] > current[best]) best = i;
+			}
+
+			current[best] -= numberOfSlots;
+			m_pattern.push_back(best);
+			m_slotRank.push_back(taken[best]++);
+		}
+
+		if (m_members.size() > 1)
+		{
+			for (size_t i = 0; i < m_members.size(); i++)
+			{
+				m_workers.emplace_back(new StripeWorker());
+			}
+		}
+	}
+
+	StripedFileAccess::~StripedFileAccess()
+	{
+	}
+
+	void StripedFileAccess::UseFile(const std::string &name)
+	{
+		m_error.clear();
+		m_position = 0;
+
+		for (size_t i = 0; i < m_members.size(); i++)
+		{
+			m_members[i]->UseFile(m_config[i].pathPrefix + name);
+		}
+
+		m_error = GetLastError();
+	}
+
+	void StripedFileAccess::UseFileReadOnly(const std::string &name)
+	{
+		m_error.clear();
+		m_position = 0;
+
+		for (size_t i = 0; i < m_members.size(); i++)
+		{
+			m_members[i]->UseFileReadOnly(m_config[i].pathPrefix + name);
+		}
+
+		m_error = GetLastError();
+	}
+
+	bool StripedFileAccess::IsValid()
+	{
+		for (auto &member : m_members)
+		{
+			if (!member->IsValid()) return false;
+		}
+
+		return true;
+	}
+
+	std::string StripedFileAccess::GetLastError()
+	{
+		if (!m_error.empty()) return m_error;
+
+		for (auto &member : m_members)
+		{
+			std::string error = member->GetLastError();
+			if (!error.empty()) return error;
+		}
+
+		return std::string();
+	}
+
+	void StripedFileAccess::SetPointerTo(uint64_t offset)
+	{
+		std::lock_guard<std::mutex> lock(m_transferLock);
+		m_position = offset;
+	}
+
+	void StripedFileAccess::SetFileSize(uint64_t size)
+	{
+		for (uint32_t i = 0; i < m_members.size(); i++)
+		{
+			m_members[i]->SetFileSize(GetMemberSize(i, size));
+		}
+	}
+
+	uint32_t StripedFileAccess::Read(void *buffer, uint32_t bufferSize)
+	{
+		return Transfer((char *)buffer, bufferSize, false);
+	}
+
+	uint32_t StripedFileAccess::Write(void *buffer, uint32_t bufferSize)
+	{
+		return Transfer((char *)buffer, bufferSize, true);
+	}
+
+	void StripedFileAccess::Flush()
+	{
+		for (auto &member : m_members)
+		{
+			member->Flush();
+		}
+	}
+
+	uint64_t StripedFileAccess::TransferTo(int fd, uint64_t offset, uint64_t size)
+	{
+		std::vector<Segment> segments;
+		uint64_t transferred = 0;
+
+		while (transferred < size)
+		{
+			uint32_t sizeToProcess = (uint32_t)std::min(size - transferred, (uint64_t)(1u << 30));
+			SplitToSegments(offset + transferred, sizeToProcess, segments);
+
+			for (auto &segment : segments)
+			{
+				uint64_t res = m_members[segment.member]->TransferTo(fd, segment.offsetInMember, segment.size);
+				transferred += res;
+
+				// not supported or member is shorter, caller copies the rest
+				if (res < segment.size) return transferred;
+			}
+		}
+
+		return transferred;
+	}
+
+	bool StripedFileAccess::LockForWriting()
+	{
+		// first member stands for the whole set
+		return !m_members.empty() && m_members[0]->LockForWriting();
+	}
+
+	bool StripedFileAccess::Sync()
+	{
+		bool res = !m_members.empty();
+		for (auto &member : m_members)
+		{
+			if (!member->Sync()) res = false;
+		}
+
+		return res;
+	}
+
+	uint32_t StripedFileAccess::GetAlignment()
+	{
+		uint32_t res = 1;
+		for (auto &member : m_members)
+		{
+			res = std::max(res, member->GetAlignment());
+		}
+
+		assert(m_stripeSize % res == 0);
+		return res;
+	}
+
+	void StripedFileAccess::SplitToSegments(uint64_t offset, uint32_t size, std::vector<Segment> &segments)
+	{
+		segments.clear();
+		uint32_t processed = 0;
+
+		while (processed < size)
+		{
+			uint64_t stripe = (offset + processed) / m_stripeSize;
+			uint32_t offsetInStripe = (uint32_t)((offset + processed) % m_stripeSize);
+			uint64_t cycle = stripe / m_pattern.size();
+			uint32_t slot = (uint32_t)(stripe % m_pattern.size());
+
+			Segment segment;
+			segment.member = m_pattern[slot];
+			segment.offsetInMember = (cycle * m_config[segment.member].weight + m_slotRank[slot]) * m_stripeSize + offsetInStripe;
+			segment.offsetInBuffer = processed;
+			segment.size = std::min(size - processed, m_stripeSize - offsetInStripe);
+
+			// neighbour stripes of the same member are adjacent in member file too
+			if (!segments.empty())
+			{
+				Segment &last = segments.back();
+				if (last.member == segment.member && last.offsetInMember + last.size == segment.offsetInMember)
+				{
+					last.size += segment.size;
+					processed += segment.size;
+					continue;
+				}
+			}
+
+			segments.push_back(segment);
+			processed += segment.size;
+		}
+	}
+
+	uint64_t StripedFileAccess::GetMemberSize(uint32_t member, uint64_t logicalSize)
+	{
+		uint64_t fullStripes = logicalSize / m_stripeSize;
+		uint64_t rest = logicalSize % m_stripeSize;
+		uint64_t cycle = fullStripes / m_pattern.size();
+		uint32_t lastSlot = (uint32_t)(fullStripes % m_pattern.size());
+
+		uint64_t stripes = cycle * m_config[member].weight;
+		for (uint32_t slot = 0; slot < lastSlot; slot++)
+		{
+			if (m_pattern[slot] == member) stripes++;
+		}
+
+		uint64_t res = stripes * m_stripeSize;
+		if (rest != 0 && m_pattern[lastSlot] == member) res += rest;
+		return res;
+	}
+
+	uint32_t StripedFileAccess::Transfer(char *buffer, uint32_t size, bool write)
+	{
+		std::lock_guard<std::mutex> lock(m_transferLock);
+		if (!IsValid()) return 0;
+
+		std::vector<Segment> segments;
+		SplitToSegments(m_position, size, segments);
+
+		// bytes read by each segment
+		std::vector<uint32_t> done(segments.size(), 0);
+
+		auto run = [&](uint32_t member)
+		{
+			auto &access = m_members[member];
+
+			for (size_t i = 0; i < segments.size(); i++)
+			{
+				Segment &segment = segments[i];
+				if (segment.member != member) continue;
+
+				access->SetPointerTo(segment.offsetInMember);
+				if (write)
+				{
+					access->Write(buffer + segment.offsetInBuffer, segment.size);
+					continue;
+				}
+
+				// members end at different places, missing tail of a stripe reads as zeros
+				done[i] = access->Read(buffer + segment.offsetInBuffer, segment.size);
+				memset(buffer + segment.offsetInBuffer + done[i], 0, segment.size - done[i]);
+			}
+		};
+
+		std::vector<bool> used(m_members.size(), false);
+		for (auto &segment : segments)
+		{
+			used[segment.member] = true;
+		}
+
+		if (segments.size() > 1 && !m_workers.empty())
+		{
+			for (uint32_t i = 0; i < m_members.size(); i++)
+			{
+				if (used[i]) m_workers[i]->Post([&run, i] { run(i); });
+			}
+
+			for (uint32_t i = 0; i < m_members.size(); i++)
+			{
+				if (used[i]) m_workers[i]->Wait();
+			}
+		}
+		else
+		{
+			for (uint32_t i = 0; i < m_members.size(); i++)
+			{
+				if (used[i]) run(i);
+			}
+		}
+
+		if (!IsValid())
+		{
+			m_error = GetLastError();
+			return 0;
+		}
+
+		// read ends where the furthest member data ends, zeros before that are holes
+		uint32_t res = size;
+		if (!write)
+		{
+			res = 0;
+			for (size_t i = 0; i < segments.size(); i++)
+			{
+				if (done[i] != 0) res = std::max(res, segments[i].offsetInBuffer + done[i]);
+			}
+		}
+
+		m_position += res;
+		return res;
+	}
+
+} // namespace
@@ -1,4 +1,21 @@
 #include "metafile/metafilelib.h"
+#include "metafile/directfileaccess.h"
+#include "metafile/memoryfileaccess.h"
+#include "metafile/stripedfileaccess.h"
+#include "metafile/filethreadstreambuf.h"
+#include "metafile/streamscan.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
 
 #define EXPECT_TRUE(x) if (x) {printf("ok\t\"" #x "\"\n");} else {printf("fail\t\"" #x "\"\n");}
 #define ASSERT_TRUE(x) if (x) {printf("ok\t\"" #x "\"\n");} else {printf("fail\t\"" #x "\"\n"); exit(0);}
@@ -7,6 +24,42 @@ using namespace metafile;
 
 MetafileLib libInstance;
 
+// heap allocations of the whole program, see TestNoAllocations. all four operators are
+// replaced, so every new and delete of the program, array ones too, go to malloc and free
+static std::atomic<uint64_t> g_numberOfAllocations(0);
+
+static void *CountedAllocate(size_t size)
+{
+	g_numberOfAllocations++;
+	void *res = malloc(size ? size : 1);
+	if (!res) throw std::bad_alloc();
+	return res;
+}
+
+void *operator new(size_t size)
+{
+	return CountedAllocate(size);
+}
+
+void *operator new[](size_t size)
+{
+	return CountedAllocate(size);
+}
+
+// gcc takes free of pointers from the replaced new for a mismatch
+#if defined(__GNUC__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete(void *pointer) throw()
+{
+	free(pointer);
+}
+
+void operator delete[](void *pointer) throw()
+{
+	free(pointer);
+}
+
 void CreateFileTest()
 {
 	auto file = libInstance.CreateNewFile("c:\\testfile.dat", { "data1", "data2", "data3" });
@@ -344,6 +397,2328 @@ void TestDelete()
 	EXPECT_TRUE(res1 == testData);
 }
 
+void TestExportTo()
+{
+	auto file = libInstance.CreateNewFile("c:\\testfile6.dat", { "data1", "data2" });
+
+	ASSERT_TRUE(file->IsValid());
+	FileThread *data1 = file->GetFileThread("data1");
+	FileThread *data2 = file->GetFileThread("data2");
+	ASSERT_TRUE(nullptr != data1);
+
+	std::vector<char> testData(100 * 1024 + 7);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	// interleave streams, so data1 extents are not adjacent
+	for (unsigned i = 0; i < testData.size(); i += 1000)
+	{
+		uint32_t size = std::min(1000u, (uint32_t)testData.size() - i);
+		data1->Write(&testData[i], size);
+		data2->Write(&testData[i], size);
+	}
+
+	FILE *out = fopen("c:\\testfile6.out", "wb+");
+	ASSERT_TRUE(out != nullptr);
+
+	EXPECT_TRUE(data1->ExportTo(fileno(out), 5, testData.size()) == testData.size() - 5);
+
+	std::vector<char> res(testData.size() - 5);
+	fseek(out, 0, SEEK_SET);
+	EXPECT_TRUE(fread(&res[0], 1, res.size(), out) == res.size());
+	EXPECT_TRUE(memcmp(&res[0], &testData[5], res.size()) == 0);
+	fclose(out);
+}
+
+void TestDirectFileAccess()
+{
+	MetafileLib directLib(std::make_shared<DirectFileAccessFactory>());
+
+	std::vector<char> testData(300 * 1024 + 3);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto file = directLib.CreateNewFile("c:\\testfile7.dat", { "data1", "data2" });
+		ASSERT_TRUE(file->IsValid());
+
+		FileThread *data1 = file->GetFileThread("data1");
+		FileThread *data2 = file->GetFileThread("data2");
+
+		// odd sized pieces, nothing is aligned
+		for (unsigned i = 0; i < testData.size(); i += 777)
+		{
+			uint32_t size = std::min(777u, (uint32_t)testData.size() - i);
+			data1->Write(&testData[i], size);
+			data2->Write(&testData[i], size);
+		}
+
+		std::vector<char> res(testData.size());
+		data2->SetPointerTo(0);
+		EXPECT_TRUE(data2->Read(&res[0], res.size()) == res.size());
+		EXPECT_TRUE(res == testData);
+	}
+
+	auto file = directLib.OpenFile("c:\\testfile7.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	FileThread *data1 = file->GetFileThread("data1");
+	ASSERT_TRUE(nullptr != data1);
+	EXPECT_TRUE(data1->GetSize() == testData.size());
+
+	std::vector<char> res(testData.size() - 11);
+	data1->SetPointerTo(11);
+	EXPECT_TRUE(data1->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(memcmp(&res[0], &testData[11], res.size()) == 0);
+}
+
+void TestMemoryFileAccess()
+{
+	auto factory = std::make_shared<MemoryFileAccessFactory>();
+	MetafileLib memoryLib(factory);
+
+	std::vector<char> testData(3 * 1024 * 1024 + 5);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto file = memoryLib.CreateNewFile("image", { "data1", "data2" });
+		ASSERT_TRUE(file->IsValid());
+
+		FileThread *data1 = file->GetFileThread("data1");
+		data1->Write(&testData[0], testData.size());
+	}
+
+	// image outlives Metafile
+	{
+		auto file = memoryLib.OpenFile("image");
+		ASSERT_TRUE(file->IsValid());
+
+		FileThread *data1 = file->GetFileThread("data1");
+		ASSERT_TRUE(nullptr != data1);
+		EXPECT_TRUE(data1->GetSize() == testData.size());
+	}
+
+	EXPECT_TRUE(factory->SaveTo("image", "c:\\testfile8.dat"));
+	factory->Remove("image");
+
+	// saved image is a regular container
+	{
+		auto file = libInstance.OpenFile("c:\\testfile8.dat");
+		ASSERT_TRUE(file->IsValid());
+
+		FileThread *data1 = file->GetFileThread("data1");
+		ASSERT_TRUE(nullptr != data1);
+
+		std::vector<char> res(testData.size());
+		EXPECT_TRUE(data1->Read(&res[0], res.size()) == res.size());
+		EXPECT_TRUE(res == testData);
+	}
+
+	EXPECT_TRUE(factory->LoadFrom("loaded", "c:\\testfile8.dat"));
+
+	auto file = memoryLib.OpenFile("loaded");
+	ASSERT_TRUE(file->IsValid());
+
+	FileThread *data1 = file->GetFileThread("data1");
+	ASSERT_TRUE(nullptr != data1);
+
+	std::vector<char> res(testData.size());
+	EXPECT_TRUE(data1->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+}
+
+static uint64_t GetDiskFileSize(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) return 0;
+	fseek(f, 0, SEEK_END);
+	uint64_t res = ftell(f);
+	fclose(f);
+	return res;
+}
+
+static std::vector<char> ReadDiskFile(const char *path)
+{
+	std::vector<char> res((size_t)GetDiskFileSize(path));
+	FILE *f = fopen(path, "rb");
+	if (!f) return res;
+	if (!res.empty()) res.resize(fread(&res[0], 1, res.size(), f));
+	fclose(f);
+	return res;
+}
+
+void TestOverlay()
+{
+	std::vector<char> testData(2 * 1024 * 1024 + 17);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto base = libInstance.CreateNewFile("c:\\testfile9.dat", { "data1", "data2" });
+		ASSERT_TRUE(base->IsValid());
+		base->GetFileThread("data1")->Write(&testData[0], testData.size());
+		base->GetFileThread("data2")->Write(&testData[0], 5000);
+	}
+
+	std::vector<char> expected1 = testData;
+	std::vector<char> expected2(testData.begin(), testData.begin() + 5000);
+	char patch[] = "overlay";
+
+	{
+		auto file = libInstance.CreateOverlay("c:\\testfile9.ovl", "c:\\testfile9.dat");
+		ASSERT_TRUE(file->IsValid());
+
+		FileThread *data1 = file->GetFileThread("data1");
+		FileThread *data2 = file->GetFileThread("data2");
+		ASSERT_TRUE(nullptr != data1 && nullptr != data2);
+		EXPECT_TRUE(data1->GetSize() == testData.size());
+
+		// crosses cluster border
+		data1->SetPointerTo(4096 * 3 - 3);
+		data1->Write(patch, sizeof(patch));
+		memcpy(&expected1[4096 * 3 - 3], patch, sizeof(patch));
+
+		data2->SetPointerTo(data2->GetSize());
+		data2->Write(patch, sizeof(patch));
+		expected2.insert(expected2.end(), patch, patch + sizeof(patch));
+
+		std::vector<char> res(expected1.size());
+		data1->SetPointerTo(0);
+		EXPECT_TRUE(data1->Read(&res[0], res.size()) == res.size());
+		EXPECT_TRUE(res == expected1);
+	}
+
+	// only the delta is stored
+	EXPECT_TRUE(GetDiskFileSize("c:\\testfile9.ovl") < 64 * 1024);
+	EXPECT_TRUE(libInstance.OpenFile("c:\\testfile9.ovl")->IsValid() == false);
+
+	{
+		auto base = libInstance.OpenFile("c:\\testfile9.dat");
+		ASSERT_TRUE(base->IsValid());
+
+		std::vector<char> res(testData.size());
+		EXPECT_TRUE(base->GetFileThread("data1")->Read(&res[0], res.size()) == res.size());
+		EXPECT_TRUE(res == testData);
+		EXPECT_TRUE(base->GetFileThread("data2")->GetSize() == 5000);
+	}
+
+	auto file = libInstance.OpenOverlay("c:\\testfile9.ovl", "c:\\testfile9.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	std::vector<char> res1(expected1.size());
+	EXPECT_TRUE(file->GetFileThread("data1")->Read(&res1[0], res1.size()) == res1.size());
+	EXPECT_TRUE(res1 == expected1);
+
+	std::vector<char> res2(expected2.size());
+	EXPECT_TRUE(file->GetFileThread("data2")->Read(&res2[0], res2.size()) == res2.size());
+	EXPECT_TRUE(res2 == expected2);
+}
+
+void TestCloneAndSnapshot()
+{
+	std::vector<char> testData(1024 * 1024 + 3);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	std::vector<char> expected = testData;
+	char patch[] = "clone";
+
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile10.dat", { "data1", "data2" });
+		ASSERT_TRUE(file->IsValid());
+
+		FileThread *data1 = file->GetFileThread("data1");
+		data1->Write(&testData[0], testData.size());
+		uint64_t sizeBefore = GetDiskFileSize("c:\\testfile10.dat");
+
+		FileThread *clone = file->CloneFileThread("data1", "clone1");
+		ASSERT_TRUE(nullptr != clone);
+		EXPECT_TRUE(nullptr == file->CloneFileThread("data1", "clone1"));
+		EXPECT_TRUE(nullptr == file->GetFileThread("$refcounts"));
+		EXPECT_TRUE(clone->GetSize() == testData.size());
+		EXPECT_TRUE(file->Snapshot("@1"));
+		EXPECT_TRUE(nullptr != file->GetFileThread("clone1@1"));
+
+		// data1 pointer is still valid after streams were added
+		data1->SetPointerTo(100);
+		data1->Write(patch, sizeof(patch));
+		memcpy(&expected[100], patch, sizeof(patch));
+
+		// nothing close to a second copy of the data. file grows only by
+		// unused tail of the last block, where moved and copied blocks go
+		file->Flush();
+		EXPECT_TRUE(GetDiskFileSize("c:\\testfile10.dat") < sizeBefore + testData.size() / 2);
+
+		std::vector<char> res(testData.size());
+		clone->SetPointerTo(0);
+		EXPECT_TRUE(clone->Read(&res[0], res.size()) == res.size());
+		EXPECT_TRUE(res == testData);
+
+		data1->SetPointerTo(0);
+		EXPECT_TRUE(data1->Read(&res[0], res.size()) == res.size());
+		EXPECT_TRUE(res == expected);
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile10.dat");
+	ASSERT_TRUE(file->IsValid());
+	EXPECT_TRUE(file->GetAllFileThreads().size() == 6);
+
+	// shared block of snapshot is copied on write, other side keeps old data
+	FileThread *snapshot = file->GetFileThread("data1@1");
+	ASSERT_TRUE(nullptr != snapshot);
+	snapshot->SetPointerTo(testData.size() - 2);
+	snapshot->Write(patch, sizeof(patch));
+
+	std::vector<char> res(testData.size());
+	FileThread *clone = file->GetFileThread("clone1");
+	EXPECT_TRUE(clone->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+
+	FileThread *clone1 = file->GetFileThread("clone1@1");
+	EXPECT_TRUE(clone1->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+
+	res.resize(snapshot->GetSize());
+	snapshot->SetPointerTo(0);
+	EXPECT_TRUE(snapshot->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(memcmp(&res[0], &testData[0], testData.size() - 2) == 0);
+	EXPECT_TRUE(memcmp(&res[testData.size() - 2], patch, sizeof(patch)) == 0);
+}
+
+void TestStripedFileAccess()
+{
+	StripeMember member1 = { "c:\\stripe1_", 1 };
+	StripeMember member2 = { "c:\\stripe2_", 2 };
+	MetafileLib stripedLib(std::make_shared<StripedFileAccessFactory>(std::vector<StripeMember>{ member1, member2 }, 64 * 1024));
+
+	std::vector<char> testData(3 * 1024 * 1024 + 11);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto file = stripedLib.CreateNewFile("testfile11.dat", { "data1", "data2" });
+		ASSERT_TRUE(file->IsValid());
+
+		FileThread *data1 = file->GetFileThread("data1");
+		EXPECT_TRUE(data1->Write(&testData[0], testData.size()) == testData.size());
+	}
+
+	// weights 1:2
+	uint64_t size1 = GetDiskFileSize("c:\\stripe1_testfile11.dat");
+	uint64_t size2 = GetDiskFileSize("c:\\stripe2_testfile11.dat");
+	EXPECT_TRUE(size1 > testData.size() / 4 && size2 > size1 * 3 / 2);
+
+	auto file = stripedLib.OpenFile("testfile11.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	FileThread *data1 = file->GetFileThread("data1");
+	ASSERT_TRUE(nullptr != data1);
+
+	std::vector<char> res(testData.size());
+	EXPECT_TRUE(data1->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+
+	// reads stop where data ends, like other backends
+	StripedFileAccessFactory factory(std::vector<StripeMember>{ member1, member2 }, 4096);
+	auto access = factory.CreateFile();
+	access->UseFile("testfile39.dat");
+	ASSERT_TRUE(access->IsValid());
+
+	std::vector<char> pattern(64 * 1024, 0x5A);
+	EXPECT_TRUE(access->Write(&pattern[0], 10000) == 10000);
+	access->SetPointerTo(0);
+	EXPECT_TRUE(access->Read(&res[0], 20000) == 10000);
+	access->SetPointerTo(12000);
+	EXPECT_TRUE(access->Read(&res[0], 100) == 0);
+
+	// reads of two threads, each spans both members
+	access->SetPointerTo(0);
+	EXPECT_TRUE(access->Write(&pattern[0], pattern.size()) == pattern.size());
+
+	std::atomic<bool> allRead(true);
+	auto read = [&]
+	{
+		std::vector<char> buffer(3 * 4096);
+		for (int i = 0; i < 1000; i++)
+		{
+			std::fill(buffer.begin(), buffer.end(), 0);
+			access->SetPointerTo(0);
+
+			bool ok = access->Read(&buffer[0], buffer.size()) == buffer.size();
+			ok = ok && (size_t)std::count(buffer.begin(), buffer.end(), 0x5A) == buffer.size();
+			if (!ok) allRead = false;
+		}
+	};
+
+	std::thread other(read);
+	read();
+	other.join();
+	EXPECT_TRUE(allRead);
+}
+
+void TestReserve()
+{
+	std::vector<char> testData(50 * 1000);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile12.dat", { "data1", "data2", "data3" });
+		ASSERT_TRUE(file->IsValid());
+
+		std::vector<FileThread *> threads = file->GetAllFileThreads();
+		for (auto thread : threads)
+		{
+			thread->Reserve(testData.size());
+			EXPECT_TRUE(thread->GetSize() == 0);
+		}
+
+		// last stream is placed after space reserved for first two
+		EXPECT_TRUE(threads[2]->Write(&testData[0], testData.size()) == testData.size());
+		file->Flush();
+		EXPECT_TRUE(GetDiskFileSize("c:\\testfile12.dat") > 3 * testData.size());
+
+		EXPECT_TRUE(threads[0]->Write(&testData[0], testData.size()) == testData.size());
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile12.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	std::vector<char> res(testData.size());
+	EXPECT_TRUE(file->GetFileThread("data1")->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+	EXPECT_TRUE(file->GetFileThread("data3")->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+	EXPECT_TRUE(file->GetFileThread("data2")->GetSize() == 0);
+}
+
+void TestStreambuf()
+{
+	std::vector<char> testData(200 * 1024 + 5);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile13.dat", { "data1" });
+		ASSERT_TRUE(file->IsValid());
+
+		// small buffer, so both buffered and direct paths are used
+		FileThreadStream stream(file->GetFileThread("data1"), 4096);
+		for (int i = 0; i < 10000; i++)
+		{
+			stream << i << ' ';
+		}
+
+		stream.write(&testData[0], testData.size());
+		stream << "end";
+		EXPECT_TRUE(stream.good());
+		EXPECT_TRUE(stream.tellp() > (std::streamoff)testData.size());
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile13.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	FileThreadStream stream(file->GetFileThread("data1"), 4096);
+	bool numbersMatch = true;
+	for (int i = 0; i < 10000; i++)
+	{
+		int value = -1;
+		stream >> value;
+		numbersMatch = numbersMatch && value == i;
+	}
+
+	EXPECT_TRUE(numbersMatch);
+	stream.get();
+	std::streamoff dataStart = stream.tellg();
+
+	std::vector<char> res(testData.size());
+	stream.read(&res[0], res.size());
+	EXPECT_TRUE(stream.gcount() == (std::streamsize)res.size());
+	EXPECT_TRUE(res == testData);
+
+	std::string tail;
+	stream >> tail;
+	EXPECT_TRUE(tail == "end");
+
+	stream.clear();
+	stream.seekg(-3, std::ios_base::end);
+	stream >> tail;
+	EXPECT_TRUE(tail == "end");
+
+	// overwrite in the middle, then read it back through the same stream
+	stream.clear();
+	stream.seekp(dataStart + 10);
+	stream.write("patch", 5);
+	stream.seekg(dataStart + 8);
+	char patched[9] = {};
+	stream.read(patched, 7);
+	EXPECT_TRUE(memcmp(patched + 2, "patch", 5) == 0 && memcmp(patched, &testData[8], 2) == 0);
+}
+
+// runs posted tasks only when asked, so test controls when operations start
+class ManualExecutor : public Executor
+{
+public:
+	virtual void Post(const std::function<void()> &task) override
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_tasks.push_back(task);
+	}
+
+	void RunAll()
+	{
+		while (true)
+		{
+			std::function<void()> task;
+			{
+				std::lock_guard<std::mutex> lock(m_lock);
+				if (m_tasks.empty()) return;
+				task = m_tasks.front();
+				m_tasks.pop_front();
+			}
+
+			task();
+		}
+	}
+
+private:
+	std::mutex m_lock;
+	std::deque< std::function<void()> > m_tasks;
+};
+
+void TestAsync()
+{
+	std::vector<char> testData(1000 * 1000);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	auto file = libInstance.CreateNewFile("c:\\testfile14.dat", { "data1", "data2" });
+	ASSERT_TRUE(file->IsValid());
+	FileThread *data1 = file->GetFileThread("data1");
+
+	// many operations in flight at once, completed on default pool
+	std::vector< std::future<AsyncResult> > writes;
+	for (unsigned i = 0; i < testData.size(); i += 1000)
+	{
+		writes.push_back(data1->WriteAsync(i, &testData[i], 1000));
+	}
+
+	bool allWritten = true;
+	for (auto &write : writes)
+	{
+		AsyncResult result = write.get();
+		allWritten = allWritten && result.status == AsyncStatus::Ok && result.size == 1000;
+	}
+
+	EXPECT_TRUE(allWritten);
+	EXPECT_TRUE(file->FlushAsync().get().status == AsyncStatus::Ok);
+
+	std::vector<char> res(testData.size());
+	std::atomic<uint32_t> completed(0);
+	std::future<AsyncResult> last;
+	for (unsigned i = 0; i < testData.size(); i += 4000)
+	{
+		last = data1->ReadAsync(i, &res[i], 4000, [&completed](const AsyncResult &result)
+		{
+			if (result.status == AsyncStatus::Ok) completed++;
+		});
+	}
+
+	// operations complete in order, callback runs after future is ready
+	last.wait();
+	while (completed != testData.size() / 4000) std::this_thread::yield();
+	EXPECT_TRUE(res == testData);
+
+	AsyncResult pastEnd = data1->ReadAsync(testData.size() + 10, &res[0], 10).get();
+	EXPECT_TRUE(pastEnd.status == AsyncStatus::Ok && pastEnd.size == 0);
+
+	// own executor and cancellation of operation which has not started yet
+	auto executor = std::make_shared<ManualExecutor>();
+	file->SetExecutor(executor);
+
+	FileThread *data2 = file->GetFileThread("data2");
+	CancellationToken token;
+	auto kept = data2->WriteAsync(0, &testData[0], 100);
+	auto cancelled = data2->WriteAsync(100, &testData[100], 100, AsyncCallback(), token);
+	token.Cancel();
+
+	EXPECT_TRUE(kept.wait_for(std::chrono::milliseconds(0)) == std::future_status::timeout);
+	executor->RunAll();
+
+	EXPECT_TRUE(kept.get().status == AsyncStatus::Ok);
+	EXPECT_TRUE(cancelled.get().status == AsyncStatus::Cancelled);
+	EXPECT_TRUE(data2->GetSize() == 100);
+}
+
+void TestReadMany()
+{
+	std::vector<std::string> names;
+	for (int i = 0; i < 200; i++)
+	{
+		names.push_back("stream" + std::to_string(i));
+	}
+
+	auto file = libInstance.CreateNewFile("c:\\testfile15.dat", names);
+	ASSERT_TRUE(file->IsValid());
+
+	// interleaved writes scatter blocks of every stream over the file
+	std::vector< std::vector<char> > testData(names.size());
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		testData[i].resize(rand() % (64 * 1024) + (i % 10 == 0 ? 300 * 1024 : 0));
+		for (auto &c : testData[i]) c = rand();
+	}
+
+	for (uint32_t pos = 0; ; pos += 4096)
+	{
+		bool any = false;
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			if (pos >= testData[i].size()) continue;
+
+			uint32_t size = std::min(4096u, (uint32_t)testData[i].size() - pos);
+			file->GetFileThread(names[i])->Write(&testData[i][pos], size);
+			any = true;
+		}
+
+		if (!any) break;
+	}
+
+	std::vector< std::vector<char> > res(names.size());
+	std::vector<ReadRequest> requests;
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		// one request asks for more than stream has
+		res[i].resize(testData[i].size() + (i == 7 ? 100 : 0));
+
+		ReadRequest request = { file->GetFileThread(names[i]), res[i].empty() ? nullptr : &res[i][0], res[i].size(), 0 };
+		requests.push_back(request);
+	}
+
+	EXPECT_TRUE(file->ReadMany(requests, 4));
+
+	bool allMatch = true;
+	for (size_t i = 0; i < names.size(); i++)
+	{
+		allMatch = allMatch && requests[i].bytesRead == testData[i].size();
+		allMatch = allMatch && std::equal(testData[i].begin(), testData[i].end(), res[i].begin());
+	}
+
+	EXPECT_TRUE(allMatch);
+}
+
+void TestStreamProfiles()
+{
+	std::vector<std::string> names = { "big", "fixed", "hinted" };
+	for (int i = 0; i < 100; i++)
+	{
+		names.push_back("tiny" + std::to_string(i));
+	}
+
+	CreateOptions options;
+	options.defaultProfile = StreamProfile::Fixed(1, 512);
+	options.profiles["big"] = StreamProfile::Geometric(2, 64 * 1024);
+	options.profiles["fixed"] = StreamProfile::Fixed(16);
+	options.profiles["hinted"] = StreamProfile::SizeHint(1000 * 1000);
+
+	std::vector<char> testData(3 * 1000 * 1000 + 3);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile16.dat", names, options);
+		ASSERT_TRUE(file->IsValid());
+
+		bool allWritten = true;
+		for (int i = 0; i < 100; i++)
+		{
+			allWritten = allWritten && file->GetFileThread(names[3 + i])->Write(&testData[i], 100) == 100;
+		}
+
+		EXPECT_TRUE(allWritten);
+
+		// small blocks of tiny streams take little space
+		file->Flush();
+		uint64_t tableSize = 64 + 1024 * names.size();
+		EXPECT_TRUE(GetDiskFileSize("c:\\testfile16.dat") <= tableSize + 100 * 512 + 4096);
+
+		EXPECT_TRUE(file->GetFileThread("big")->Write(&testData[0], testData.size()) == testData.size());
+		EXPECT_TRUE(file->GetFileThread("fixed")->Write(&testData[0], 300 * 1024) == 300 * 1024);
+		EXPECT_TRUE(file->GetFileThread("hinted")->Write(&testData[0], 1000 * 1000) == 1000 * 1000);
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile16.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	StreamProfile big = file->GetFileThread("big")->GetProfile();
+	EXPECT_TRUE(big.growth == BlockGrowth::Geometric && big.parameter == 512 && big.clusterSize == 64 * 1024);
+	StreamProfile fixed = file->GetFileThread("fixed")->GetProfile();
+	EXPECT_TRUE(fixed.growth == BlockGrowth::Fixed && fixed.parameter == 16 && fixed.clusterSize == 4096);
+	StreamProfile hinted = file->GetFileThread("hinted")->GetProfile();
+	EXPECT_TRUE(hinted.growth == BlockGrowth::SizeHint && hinted.parameter >= 1000 * 1000);
+	EXPECT_TRUE(file->GetFileThread("tiny5")->GetProfile().clusterSize == 512);
+
+	std::vector<char> res(testData.size());
+	EXPECT_TRUE(file->GetFileThread("big")->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+
+	EXPECT_TRUE(file->GetFileThread("fixed")->Read(&res[0], res.size()) == 300 * 1024);
+	EXPECT_TRUE(memcmp(&res[0], &testData[0], 300 * 1024) == 0);
+
+	EXPECT_TRUE(file->GetFileThread("hinted")->Read(&res[0], res.size()) == 1000 * 1000);
+	EXPECT_TRUE(memcmp(&res[0], &testData[0], 1000 * 1000) == 0);
+
+	EXPECT_TRUE(file->GetFileThread("tiny42")->Read(&res[0], res.size()) == 100);
+	EXPECT_TRUE(memcmp(&res[0], &testData[42], 100) == 0);
+
+	// invalid profile is rejected
+	CreateOptions invalid;
+	invalid.defaultProfile = StreamProfile::Fixed(1, 1000);
+	EXPECT_TRUE(!libInstance.CreateNewFile("c:\\testfile17.dat", { "data1" }, invalid)->IsValid());
+}
+
+void TestSmallStreams()
+{
+	std::vector<std::string> names;
+	for (int i = 0; i < 200; i++)
+	{
+		names.push_back("small" + std::to_string(i));
+	}
+
+	CreateOptions options;
+	options.smallStreamSize = 256;
+
+	std::vector<char> testData(1024 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile18.dat", names, options);
+		ASSERT_TRUE(file->IsValid());
+
+		bool allWritten = true;
+		for (int i = 0; i < 200; i++)
+		{
+			allWritten = allWritten && file->GetFileThread(names[i])->Write(&testData[i], 100) == 100;
+		}
+
+		EXPECT_TRUE(allWritten);
+
+		// slots share clusters instead of taking one each
+		file->Flush();
+		uint64_t tableSize = 64 + 1024 * (names.size() + 1);
+		EXPECT_TRUE(GetDiskFileSize("c:\\testfile18.dat") <= tableSize + 200 * 256 + 4096);
+
+		// grows out of the slot, keeps old content
+		FileThread *grown = file->GetFileThread("small7");
+		grown->SetPointerTo(100);
+		EXPECT_TRUE(grown->Write(&testData[107], 100000) == 100000);
+		EXPECT_TRUE(grown->GetSize() == 100100);
+
+		// freed slots are reused and read as zeros
+		file->GetFileThread("small8")->SetSize(0);
+		file->GetFileThread("small9")->SetSize(10);
+		file->GetFileThread("small9")->SetSize(50);
+
+		FileThread *clone = file->CloneFileThread("small10", "copy");
+		ASSERT_TRUE(clone != nullptr);
+		clone->SetPointerTo(0);
+		EXPECT_TRUE(clone->Write(&testData[0], 10) == 10);
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile18.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	std::vector<char> res(testData.size());
+	EXPECT_TRUE(file->GetFileThread("small42")->Read(&res[0], res.size()) == 100);
+	EXPECT_TRUE(memcmp(&res[0], &testData[42], 100) == 0);
+
+	EXPECT_TRUE(file->GetFileThread("small7")->Read(&res[0], res.size()) == 100100);
+	EXPECT_TRUE(memcmp(&res[0], &testData[7], 100100) == 0);
+
+	EXPECT_TRUE(file->GetFileThread("small9")->Read(&res[0], res.size()) == 50);
+	EXPECT_TRUE(memcmp(&res[0], &testData[9], 10) == 0);
+	EXPECT_TRUE(std::count(res.begin() + 10, res.begin() + 50, 0) == 40);
+
+	EXPECT_TRUE(file->GetFileThread("copy")->Read(&res[0], res.size()) == 100);
+	EXPECT_TRUE(memcmp(&res[0], &testData[0], 10) == 0 && memcmp(&res[10], &testData[20], 90) == 0);
+	EXPECT_TRUE(file->GetFileThread("small10")->Read(&res[0], res.size()) == 100);
+	EXPECT_TRUE(memcmp(&res[0], &testData[10], 100) == 0);
+
+	FileThread *reused = file->GetFileThread("small8");
+	EXPECT_TRUE(reused->GetSize() == 0);
+	reused->SetPointerTo(20);
+	EXPECT_TRUE(reused->Write(&testData[0], 10) == 10);
+	reused->SetPointerTo(0);
+	EXPECT_TRUE(reused->Read(&res[0], res.size()) == 30);
+	EXPECT_TRUE(std::count(res.begin(), res.begin() + 20, 0) == 20);
+
+	// bulk read maps slots to their clusters
+	std::vector< std::vector<char> > buffers(200, std::vector<char>(100));
+	std::vector<ReadRequest> requests;
+	for (int i = 20; i < 200; i++)
+	{
+		ReadRequest request = { file->GetFileThread(names[i]), &buffers[i][0], 100, 0 };
+		requests.push_back(request);
+	}
+
+	EXPECT_TRUE(file->ReadMany(requests, 4));
+
+	bool allRead = true;
+	for (int i = 20; i < 200; i++)
+	{
+		allRead = allRead && memcmp(&buffers[i][0], &testData[i], 100) == 0;
+	}
+
+	EXPECT_TRUE(allRead);
+}
+
+void TestFormatVersions()
+{
+	std::vector<std::string> names;
+	for (int i = 0; i < 10000; i++)
+	{
+		names.push_back("stream" + std::to_string(i));
+	}
+
+	{
+		// compact directory is an order of magnitude smaller than 1 KB per stream
+		auto file = libInstance.CreateNewFile("c:\\testfile19.dat", names);
+		ASSERT_TRUE(file->IsValid());
+		EXPECT_TRUE(GetDiskFileSize("c:\\testfile19.dat") < names.size() * 1024 / 10);
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile19.dat");
+	ASSERT_TRUE(file->IsValid());
+	EXPECT_TRUE(file->GetAllFileThreads().size() == names.size());
+	EXPECT_TRUE(file->GetFileThread("stream9999") != nullptr);
+
+	std::vector<char> testData(4 * 1024 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		CreateOptions options;
+		options.formatVersion = 1;
+		auto file = libInstance.CreateNewFile("c:\\testfile20.dat", { "data1", "data2" }, options);
+		ASSERT_TRUE(file->IsValid());
+		EXPECT_TRUE(file->GetFileThread("data1")->Write(&testData[0], testData.size()) == testData.size());
+		EXPECT_TRUE(file->GetFileThread("data2")->Write(&testData[1], 1000) == 1000);
+	}
+
+	// reader made before version 2 checks the signature only, it must turn down upgraded files
+	const uint32_t kOldSignature = 0x12345678;
+	uint32_t signature;
+	memcpy(&signature, &ReadDiskFile("c:\\testfile20.dat")[0], sizeof(signature));
+	EXPECT_TRUE(signature == kOldSignature);
+	memcpy(&signature, &ReadDiskFile("c:\\testfile19.dat")[0], sizeof(signature));
+	EXPECT_TRUE(signature != kOldSignature);
+
+	{
+		auto file = libInstance.OpenFile("c:\\testfile20.dat");
+		ASSERT_TRUE(file->IsValid());
+		uint64_t sizeBefore = GetDiskFileSize("c:\\testfile20.dat");
+		EXPECT_TRUE(file->UpgradeFormat());
+		EXPECT_TRUE(GetDiskFileSize("c:\\testfile20.dat") == sizeBefore);
+
+		memcpy(&signature, &ReadDiskFile("c:\\testfile20.dat")[0], sizeof(signature));
+		EXPECT_TRUE(signature != kOldSignature);
+
+		// many new entries outgrow the directory, blocks below it are moved
+		bool allCloned = true;
+		for (int i = 0; i < 300; i++)
+		{
+			allCloned = allCloned && file->CloneFileThread("data1", "clone" + std::to_string(i)) != nullptr;
+		}
+
+		EXPECT_TRUE(allCloned);
+	}
+
+	file = libInstance.OpenFile("c:\\testfile20.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	std::vector<char> res(testData.size());
+	EXPECT_TRUE(file->GetFileThread("data1")->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+	EXPECT_TRUE(file->GetFileThread("clone299")->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+	EXPECT_TRUE(file->GetFileThread("data2")->Read(&res[0], res.size()) == 1000);
+	EXPECT_TRUE(memcmp(&res[0], &testData[1], 1000) == 0);
+
+	CreateOptions unknown;
+	unknown.formatVersion = 3;
+	EXPECT_TRUE(!libInstance.CreateNewFile("c:\\testfile21.dat", { "data1" }, unknown)->IsValid());
+}
+
+void TestReadOnly()
+{
+	std::vector<char> testData(1024 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile22.dat", { "data1", "data2" });
+		ASSERT_TRUE(file->IsValid());
+		EXPECT_TRUE(file->GetFileThread("data1")->Write(&testData[0], testData.size()) == testData.size());
+		file->GetFileThread("data2")->SetSize(100000);
+	}
+
+	std::vector<char> image = ReadDiskFile("c:\\testfile22.dat");
+
+	{
+		auto file = libInstance.OpenFile("c:\\testfile22.dat", OpenMode::ReadOnly);
+		ASSERT_TRUE(file->IsValid());
+
+		std::vector<char> res(testData.size());
+		EXPECT_TRUE(file->GetFileThread("data1")->Read(&res[0], res.size()) == res.size());
+		EXPECT_TRUE(res == testData);
+
+		// hole reads as zeros and is not allocated
+		EXPECT_TRUE(file->GetFileThread("data2")->Read(&res[0], res.size()) == 100000);
+		EXPECT_TRUE(std::count(res.begin(), res.begin() + 100000, 0) == 100000);
+
+		FileThread *data1 = file->GetFileThread("data1");
+		data1->SetPointerTo(0);
+		EXPECT_TRUE(data1->Write(&testData[1], 100) == 0);
+		data1->SetSize(10);
+		EXPECT_TRUE(data1->GetSize() == testData.size());
+		EXPECT_TRUE(file->CloneFileThread("data1", "copy") == nullptr);
+		EXPECT_TRUE(!file->Snapshot("-snap"));
+
+		file->Flush();
+		EXPECT_TRUE(file->IsValid());
+	}
+
+	EXPECT_TRUE(ReadDiskFile("c:\\testfile22.dat") == image);
+
+	// missing file is not created
+	remove("c:\\testfile23.dat");
+	EXPECT_TRUE(!libInstance.OpenFile("c:\\testfile23.dat", OpenMode::ReadOnly)->IsValid());
+	FILE *f = fopen("c:\\testfile23.dat", "rb");
+	EXPECT_TRUE(f == nullptr);
+	if (f) fclose(f);
+}
+
+// memory backend which logs writes, syncs and reads, to check their order
+struct AccessRecord
+{
+	char kind;	// 'w' write, 'f' flush, 's' sync, 'r' read
+	uint64_t offset;
+	uint64_t size;
+};
+
+class RecordingFileAccessFactory : public FileAccessInterfaceAbstractFactory
+{
+public:
+	std::shared_ptr<FileAccessInterface> CreateFile();
+
+	// called on every access, before it is made
+	std::function<void(const AccessRecord &)> onAccess;
+	// reads of this file fail while it is set
+	std::string failReadsOf;
+
+	void Add(char kind, uint64_t offset, uint64_t size)
+	{
+		AccessRecord record = { kind, offset, size };
+		if (onAccess) onAccess(record);
+
+		std::lock_guard<std::mutex> lock(m_lock);
+		m_log.push_back(record);
+	}
+
+	std::vector<AccessRecord> TakeLog()
+	{
+		std::lock_guard<std::mutex> lock(m_lock);
+		std::vector<AccessRecord> res;
+		res.swap(m_log);
+		return res;
+	}
+
+	uint64_t CountBytes(const std::vector<AccessRecord> &log, char kind)
+	{
+		uint64_t res = 0;
+		for (auto &record : log)
+		{
+			if (record.kind == kind) res += record.size;
+		}
+
+		return res;
+	}
+
+private:
+	MemoryFileAccessFactory m_memory;
+	std::mutex m_lock;
+	std::vector<AccessRecord> m_log;
+};
+
+class RecordingFileAccess : public FileAccessInterface
+{
+public:
+	RecordingFileAccess(const std::shared_ptr<FileAccessInterface> &file, RecordingFileAccessFactory &factory)
+		: m_file(file), m_factory(factory), m_position(0) {}
+
+	virtual void UseFile(const std::string &name) override { m_name = name; m_file->UseFile(name); }
+	virtual void UseFileReadOnly(const std::string &name) override { m_name = name; m_file->UseFileReadOnly(name); }
+	virtual bool IsValid() override { return m_file->IsValid(); }
+
+	virtual std::string GetLastError() override
+	{
+		return m_name == m_factory.failReadsOf ? "Read error" : m_file->GetLastError();
+	}
+	virtual void SetFileSize(uint64_t size) override { m_file->SetFileSize(size); }
+	virtual bool LockForWriting() override { return m_file->LockForWriting(); }
+	virtual uint64_t GetFileSize() override { return m_file->GetFileSize(); }
+
+	virtual void SetPointerTo(uint64_t offset) override
+	{
+		m_position = offset;
+		m_file->SetPointerTo(offset);
+	}
+
+	virtual uint32_t Read(void *buffer, uint32_t bufferSize) override
+	{
+		m_factory.Add('r', m_position, bufferSize);
+		if (m_name == m_factory.failReadsOf) return 0;
+
+		uint32_t res = m_file->Read(buffer, bufferSize);
+		m_position += res;
+		return res;
+	}
+
+	virtual uint32_t Write(void *buffer, uint32_t bufferSize) override
+	{
+		m_factory.Add('w', m_position, bufferSize);
+		uint32_t res = m_file->Write(buffer, bufferSize);
+		m_position += res;
+		return res;
+	}
+
+	virtual uint32_t WriteAt(uint64_t offset, const void *buffer, uint32_t bufferSize) override
+	{
+		uint32_t res = m_file->WriteAt(offset, buffer, bufferSize);
+		if (res) m_factory.Add('w', offset, res);
+		return res;
+	}
+
+	virtual void Flush() override
+	{
+		m_factory.Add('f', 0, 0);
+		m_file->Flush();
+	}
+
+	virtual bool Sync() override
+	{
+		m_factory.Add('s', 0, 0);
+		return m_file->Sync();
+	}
+
+private:
+	std::shared_ptr<FileAccessInterface> m_file;
+	RecordingFileAccessFactory &m_factory;
+	std::string m_name;
+	uint64_t m_position;
+};
+
+std::shared_ptr<FileAccessInterface> RecordingFileAccessFactory::CreateFile()
+{
+	return std::make_shared<RecordingFileAccess>(m_memory.CreateFile(), *this);
+}
+
+void TestOverlayBase()
+{
+	auto factory = std::make_shared<RecordingFileAccessFactory>();
+	MetafileLib recordingLib(factory);
+
+	std::vector<char> testData(256 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto base = recordingLib.CreateNewFile("base", { "data1", "data2" });
+		ASSERT_TRUE(base->IsValid());
+		base->GetFileThread("data1")->Write(&testData[0], testData.size());
+		base->GetFileThread("data2")->Write(&testData[0], 5000);
+	}
+
+	// same streams, other layout
+	{
+		auto other = recordingLib.CreateNewFile("other", { "data1", "data2" });
+		ASSERT_TRUE(other->IsValid());
+		other->GetFileThread("data2")->Write(&testData[0], 5000);
+		other->GetFileThread("data1")->Write(&testData[0], testData.size());
+	}
+
+	char patch[] = "overlay";
+	{
+		auto overlay = recordingLib.CreateOverlay("overlay", "base");
+		ASSERT_TRUE(overlay->IsValid());
+		FileThread *data1 = overlay->GetFileThread("data1");
+		data1->SetPointerTo(10);
+		EXPECT_TRUE(data1->Write(patch, sizeof(patch)) == sizeof(patch));
+	}
+
+	auto wrong = recordingLib.OpenOverlay("overlay", "other");
+	EXPECT_TRUE(!wrong->IsValid() && wrong->GetLastErrorCode() == ErrorCode::BaseMismatch);
+
+	auto file = recordingLib.OpenOverlay("overlay", "base");
+	ASSERT_TRUE(file->IsValid());
+	FileThread *data1 = file->GetFileThread("data1");
+
+	// failed base read is an error, not zeros
+	factory->failReadsOf = "base";
+	std::vector<char> res(4096);
+	data1->SetPointerTo(100000);
+	EXPECT_TRUE(data1->Read(&res[0], (uint32_t)res.size()) < res.size());
+	EXPECT_TRUE(file->GetLastErrorCode() == ErrorCode::IoError);
+
+	// cluster which can't be copied from base stays there
+	data1->SetPointerTo(100005);
+	EXPECT_TRUE(data1->Write(patch, sizeof(patch)) == 0);
+
+	factory->failReadsOf.clear();
+	data1->SetPointerTo(100000);
+	EXPECT_TRUE(data1->Read(&res[0], (uint32_t)res.size()) == res.size());
+	EXPECT_TRUE(memcmp(&res[0], &testData[100000], res.size()) == 0);
+
+	data1->SetPointerTo(100005);
+	EXPECT_TRUE(data1->Write(patch, sizeof(patch)) == sizeof(patch));
+	data1->SetPointerTo(0);
+	EXPECT_TRUE(data1->Read(&res[0], (uint32_t)res.size()) == res.size());
+	EXPECT_TRUE(memcmp(&res[10], patch, sizeof(patch)) == 0 && memcmp(&res[0], &testData[0], 10) == 0);
+}
+
+void TestSingleWriter()
+{
+	std::vector<char> testData(1024 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	libInstance.CreateNewFile("c:\\testfile24.dat", { "log" });
+
+	auto writer = libInstance.OpenFile("c:\\testfile24.dat", OpenMode::SingleWriter);
+	ASSERT_TRUE(writer->IsValid());
+	EXPECT_TRUE(!libInstance.OpenFile("c:\\testfile24.dat", OpenMode::SingleWriter)->IsValid());
+
+	auto reader = libInstance.OpenFile("c:\\testfile24.dat", OpenMode::ReadOnly);
+	ASSERT_TRUE(reader->IsValid());
+	FileThread *log = reader->GetFileThread("log");
+	ASSERT_TRUE(log != nullptr);
+	EXPECT_TRUE(reader->Refresh());
+	EXPECT_TRUE(log->GetSize() == 0);
+
+	// reader sees appended data only after writer flushes
+	EXPECT_TRUE(writer->GetFileThread("log")->Write(&testData[0], 300000) == 300000);
+	EXPECT_TRUE(reader->Refresh());
+	EXPECT_TRUE(log->GetSize() == 0);
+
+	writer->Flush();
+	EXPECT_TRUE(reader->Refresh());
+	EXPECT_TRUE(log->GetSize() == 300000);
+
+	EXPECT_TRUE(writer->GetFileThread("log")->Write(&testData[300000], testData.size() - 300000) == testData.size() - 300000);
+	EXPECT_TRUE(writer->CloneFileThread("log", "copy") != nullptr);
+	writer->Flush();
+
+	EXPECT_TRUE(reader->Refresh());
+	EXPECT_TRUE(log->GetSize() == testData.size());
+
+	std::vector<char> res(testData.size());
+	log->SetPointerTo(0);
+	EXPECT_TRUE(log->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+
+	FileThread *copy = reader->GetFileThread("copy");
+	ASSERT_TRUE(copy != nullptr);
+	EXPECT_TRUE(copy->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+
+	// many clones outgrow the table, blocks under it move. reader which refreshed reads them at new place
+	for (int i = 0; i < 50; i++)
+	{
+		EXPECT_TRUE(writer->CloneFileThread("log", "copy" + std::to_string(i)) != nullptr);
+	}
+
+	writer->Flush();
+	EXPECT_TRUE(reader->Refresh());
+	EXPECT_TRUE(reader->GetFileThread("copy49") != nullptr);
+	EXPECT_TRUE(log->ReadAt(0, &res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+
+	// lock goes away with the writer
+	writer.reset();
+	EXPECT_TRUE(reader->Refresh());
+	EXPECT_TRUE(libInstance.OpenFile("c:\\testfile24.dat", OpenMode::SingleWriter)->IsValid());
+}
+
+void TestSingleWriterOrder()
+{
+	std::vector<char> testData(64 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	auto factory = std::make_shared<RecordingFileAccessFactory>();
+	MetafileLib recordingLib(factory);
+	recordingLib.CreateNewFile("image", { "log" });
+
+	auto writer = recordingLib.OpenFile("image", OpenMode::SingleWriter);
+	ASSERT_TRUE(writer->IsValid());
+	EXPECT_TRUE(writer->GetFileThread("log")->Write(&testData[0], testData.size()) == testData.size());
+	factory->TakeLog();
+	writer->Flush();
+
+	// odd header, table after it, even header as the last write
+	std::vector<AccessRecord> table;
+	for (auto &record : factory->TakeLog())
+	{
+		if (record.kind == 'w' && record.offset < 4096) table.push_back(record);
+	}
+
+	ASSERT_TRUE(table.size() == 3);
+	EXPECT_TRUE(table[0].offset == 0 && table[0].size == 64);
+	EXPECT_TRUE(table[1].offset == 64);
+	EXPECT_TRUE(table[2].offset == 0 && table[2].size == 64);
+
+	auto reader = recordingLib.OpenFile("image", OpenMode::ReadOnly);
+	ASSERT_TRUE(reader->IsValid());
+	EXPECT_TRUE(reader->GetFileThread("log")->GetSize() == testData.size());
+}
+
+void TestSnapshotCost()
+{
+	std::vector<char> testData(20 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	std::vector<std::string> names;
+	for (int i = 0; i < 40; i++)
+	{
+		names.push_back("stream" + std::to_string(i));
+	}
+
+	auto factory = std::make_shared<RecordingFileAccessFactory>();
+	MetafileLib recordingLib(factory);
+
+	for (uint32_t version = 1; version <= 2; version++)
+	{
+		CreateOptions options;
+		options.formatVersion = version;
+		auto file = recordingLib.CreateNewFile("image" + std::to_string(version), names, options);
+		ASSERT_TRUE(file->IsValid());
+
+		bool allWritten = true;
+		for (auto &name : names)
+		{
+			allWritten = allWritten && file->GetFileThread(name)->Write(&testData[0], testData.size()) == testData.size();
+		}
+
+		EXPECT_TRUE(allWritten);
+		file->Flush();
+
+		factory->TakeLog();
+		EXPECT_TRUE(file->Snapshot("@1"));
+		std::vector<AccessRecord> log = factory->TakeLog();
+
+		// directory has room, snapshot is metadata only. version 1 table grows by
+		// a record per stream, blocks under it are moved once
+		if (version == 1)
+		{
+			EXPECT_TRUE(factory->CountBytes(log, 'r') <= (names.size() + 1) * 1024 + testData.size());
+		}
+		else
+		{
+			EXPECT_TRUE(factory->CountBytes(log, 'r') == 0 && factory->CountBytes(log, 'w') == 0);
+		}
+
+		// first streams had their blocks moved
+		std::vector<char> res(testData.size());
+		FileThread *first = file->GetFileThread(names[0] + "@1");
+		EXPECT_TRUE(first != nullptr && first->Read(&res[0], res.size()) == res.size() && res == testData);
+		EXPECT_TRUE(file->GetFileThread(names[0])->ReadAt(0, &res[0], res.size()) == res.size() && res == testData);
+	}
+}
+
+struct AppendedRecord
+{
+	uint64_t offset;
+	uint32_t size;
+	char fill;
+};
+
+static void AppendConcurrently(Metafile &file, FileThread *log)
+{
+	const int kNumberOfThreads = 8;
+	const int kRecordsPerThread = 1000;
+
+	// prefix written before appends must stay
+	log->SetPointerTo(0);
+	EXPECT_TRUE(log->Write((void *)"head", 4) == 4);
+
+	std::vector< std::vector<AppendedRecord> > records(kNumberOfThreads);
+	std::vector<std::thread> threads;
+	std::atomic<bool> done(false);
+	std::atomic<bool> sizeMonotonic(true);
+
+	for (int t = 0; t < kNumberOfThreads; t++)
+	{
+		threads.push_back(std::thread([&, t]
+		{
+			std::vector<char> buffer(700);
+			for (int i = 0; i < kRecordsPerThread; i++)
+			{
+				AppendedRecord record;
+				record.size = 1 + (t * 131 + i * 17) % 700;
+				record.fill = (char)(t * 31 + i);
+				memset(&buffer[0], record.fill, record.size);
+
+				record.offset = log->Append(&buffer[0], record.size);
+				records[t].push_back(record);
+			}
+		}));
+	}
+
+	// size only grows while appenders work
+	std::thread watcher([&]
+	{
+		uint64_t last = 0;
+		while (!done)
+		{
+			uint64_t size = log->GetSize();
+			if (size < last) sizeMonotonic = false;
+			last = size;
+		}
+	});
+
+	for (auto &thread : threads) thread.join();
+	done = true;
+	watcher.join();
+	EXPECT_TRUE(sizeMonotonic);
+
+	std::vector<AppendedRecord> all;
+	for (auto &list : records) all.insert(all.end(), list.begin(), list.end());
+	std::sort(all.begin(), all.end(), [](const AppendedRecord &a, const AppendedRecord &b) { return a.offset < b.offset; });
+
+	// ranges are packed one after another without gaps
+	bool packed = true;
+	uint64_t end = 4;
+	for (auto &record : all)
+	{
+		packed = packed && record.offset == end;
+		end += record.size;
+	}
+
+	EXPECT_TRUE(packed);
+	EXPECT_TRUE(log->GetSize() == end);
+
+	std::vector<char> res((size_t)end);
+	log->SetPointerTo(0);
+	EXPECT_TRUE(log->Read(&res[0], (uint32_t)res.size()) == res.size());
+	EXPECT_TRUE(memcmp(&res[0], "head", 4) == 0);
+
+	bool matches = true;
+	for (auto &record : all)
+	{
+		matches = matches && std::count(res.begin() + (size_t)record.offset, res.begin() + (size_t)(record.offset + record.size), record.fill) == record.size;
+	}
+
+	EXPECT_TRUE(matches);
+
+	// usual write after appends continues from the appended size
+	log->SetPointerTo(end);
+	EXPECT_TRUE(log->Write((void *)"tail", 4) == 4);
+	EXPECT_TRUE(log->Append("more", 4) == end + 4);
+	EXPECT_TRUE(log->GetSize() == end + 8);
+	file.Flush();
+}
+
+void TestAsyncCancel()
+{
+	auto factory = std::make_shared<RecordingFileAccessFactory>();
+	MetafileLib recordingLib(factory);
+	auto file = recordingLib.CreateNewFile("cancel", { "data" });
+	ASSERT_TRUE(file->IsValid());
+	FileThread *data = file->GetFileThread("data");
+
+	std::vector<char> testData(3 * 1024 * 1024 + 5, 'x');
+	EXPECT_TRUE(data->WriteAsync(0, &testData[0], (uint32_t)testData.size()).get().size == testData.size());
+
+	// running write stops between chunks, what is written stays
+	CancellationToken token;
+	factory->onAccess = [token](const AccessRecord &record) mutable
+	{
+		if (record.kind == 'w') token.Cancel();
+	};
+
+	AsyncResult written = data->WriteAsync(testData.size(), &testData[0], (uint32_t)testData.size(), AsyncCallback(), token).get();
+	EXPECT_TRUE(written.status == AsyncStatus::Cancelled);
+	EXPECT_TRUE(written.size > 0 && written.size < testData.size());
+	EXPECT_TRUE(data->GetSize() == testData.size() + written.size);
+
+	token = CancellationToken();
+	factory->onAccess = [token](const AccessRecord &record) mutable
+	{
+		if (record.kind == 'r') token.Cancel();
+	};
+
+	std::vector<char> res(testData.size());
+	AsyncResult read = data->ReadAsync(0, &res[0], (uint32_t)res.size(), AsyncCallback(), token).get();
+	EXPECT_TRUE(read.status == AsyncStatus::Cancelled);
+	EXPECT_TRUE(read.size > 0 && read.size < res.size());
+
+	// flush stops before the table
+	token = CancellationToken();
+	factory->onAccess = [token](const AccessRecord &record) mutable
+	{
+		if (record.kind == 'f') token.Cancel();
+	};
+
+	factory->TakeLog();
+	EXPECT_TRUE(file->FlushAsync(AsyncCallback(), token).get().status == AsyncStatus::Cancelled);
+	EXPECT_TRUE(factory->CountBytes(factory->TakeLog(), 'w') == 0);
+
+	factory->onAccess = nullptr;
+	EXPECT_TRUE(file->FlushAsync().get().status == AsyncStatus::Ok);
+	EXPECT_TRUE(factory->CountBytes(factory->TakeLog(), 'w') != 0);
+}
+
+void TestConcurrentAppend()
+{
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile25.dat", { "log", "other" });
+		ASSERT_TRUE(file->IsValid());
+		AppendConcurrently(*file, file->GetFileThread("log"));
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile25.dat");
+	ASSERT_TRUE(file->IsValid());
+	FileThread *log = file->GetFileThread("log");
+	std::vector<char> res(4);
+	log->SetPointerTo(log->GetSize() - 4);
+	EXPECT_TRUE(log->Read(&res[0], 4) == 4 && memcmp(&res[0], "more", 4) == 0);
+
+	// memory backend copies in parallel
+	auto factory = std::make_shared<MemoryFileAccessFactory>();
+	MetafileLib memoryLib(factory);
+	auto image = memoryLib.CreateNewFile("log", { "log" });
+	ASSERT_TRUE(image->IsValid());
+	AppendConcurrently(*image, image->GetFileThread("log"));
+
+	auto reader = libInstance.OpenFile("c:\\testfile25.dat", OpenMode::ReadOnly);
+	EXPECT_TRUE(reader->GetFileThread("log")->Append("x", 1) == FileThread::kAppendFailed);
+
+	// file backends write in place, without the pointer
+	{
+		DefaultFileAccess access;
+		access.UseFile("c:\\testfile40.dat");
+		ASSERT_TRUE(access.IsValid());
+
+		std::vector<char> data(8192, 'a');
+		EXPECT_TRUE(access.Write(&data[0], (uint32_t)data.size()) == data.size());
+
+		// buffered bytes are written first
+		EXPECT_TRUE(access.WriteAt(data.size(), "tail", 4) == 4);
+		EXPECT_TRUE(access.GetFileSize() == data.size() + 4);
+
+		// read buffer is filled before the write and must not be used after it
+		char res[4];
+		access.SetPointerTo(0);
+		EXPECT_TRUE(access.Read(res, 4) == 4 && memcmp(res, "aaaa", 4) == 0);
+		EXPECT_TRUE(access.WriteAt(100, "bbbb", 4) == 4);
+		access.SetPointerTo(100);
+		EXPECT_TRUE(access.Read(res, 4) == 4 && memcmp(res, "bbbb", 4) == 0);
+	}
+
+	{
+		DirectFileAccess access;
+		access.UseFile("c:\\testfile40.dat");
+		ASSERT_TRUE(access.IsValid());
+
+		std::vector<char> data(3 * DirectFileAccess::kDefaultAlignment, 'c');
+		char *aligned = &data[0] + (DirectFileAccess::kDefaultAlignment - (uintptr_t)&data[0] % DirectFileAccess::kDefaultAlignment);
+
+		// only whole units, partial ones are patched by Write under the lock
+		EXPECT_TRUE(access.WriteAt(100, aligned, 4) == 0);
+		EXPECT_TRUE(access.WriteAt(8192, aligned, 4096) == 4096);
+		EXPECT_TRUE(access.GetFileSize() == 8192 + 4096);
+	}
+}
+
+void TestDedup()
+{
+	CreateOptions options;
+	options.defaultProfile = StreamProfile::Fixed(1);
+	options.deduplicate = true;
+
+	std::vector<char> testData(256 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	std::vector<char> changed(testData);
+	memcpy(&changed[5000], "0123456789", 10);
+
+	uint64_t sizeWithOneCopy;
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile26.dat", { "a", "b", "c", "d" }, options);
+		ASSERT_TRUE(file->IsValid());
+
+		EXPECT_TRUE(file->GetFileThread("a")->Write(&testData[0], testData.size()) == testData.size());
+		file->Flush();
+		sizeWithOneCopy = GetDiskFileSize("c:\\testfile26.dat");
+
+		// second copy costs index and refcounts only
+		EXPECT_TRUE(file->GetFileThread("b")->Write(&testData[0], testData.size()) == testData.size());
+		file->Flush();
+		EXPECT_TRUE(GetDiskFileSize("c:\\testfile26.dat") <= sizeWithOneCopy + 2 * 4096);
+
+		// shared block is copied before it is changed
+		FileThread *b = file->GetFileThread("b");
+		b->SetPointerTo(5000);
+		EXPECT_TRUE(b->Write(&changed[5000], 10) == 10);
+
+		// pieces smaller than a block are written as usual
+		FileThread *c = file->GetFileThread("c");
+		bool allWritten = true;
+		for (uint32_t offset = 0; offset < testData.size(); offset += 1000)
+		{
+			uint32_t size = (uint32_t)std::min((size_t)1000, testData.size() - offset);
+			allWritten = allWritten && c->Write(&testData[offset], size) == size;
+		}
+
+		EXPECT_TRUE(allWritten);
+	}
+
+	{
+		// index survives reopen
+		auto file = libInstance.OpenFile("c:\\testfile26.dat");
+		ASSERT_TRUE(file->IsValid());
+		uint64_t sizeBefore = GetDiskFileSize("c:\\testfile26.dat");
+
+		EXPECT_TRUE(file->GetFileThread("d")->Write(&changed[0], changed.size()) == changed.size());
+		file->GetFileThread("a")->SetSize(4096);
+		file->Flush();
+		EXPECT_TRUE(GetDiskFileSize("c:\\testfile26.dat") <= sizeBefore + 2 * 4096);
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile26.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	std::vector<char> res(testData.size());
+	EXPECT_TRUE(file->GetFileThread("a")->Read(&res[0], res.size()) == 4096);
+	EXPECT_TRUE(memcmp(&res[0], &testData[0], 4096) == 0);
+
+	EXPECT_TRUE(file->GetFileThread("b")->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == changed);
+
+	EXPECT_TRUE(file->GetFileThread("c")->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+
+	EXPECT_TRUE(file->GetFileThread("d")->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == changed);
+}
+
+void TestNoAllocations()
+{
+	auto file = libInstance.CreateNewFile("c:\\testfile27.dat", { "data1", "data2" });
+	ASSERT_TRUE(file->IsValid());
+
+	std::vector<char> testData(1024 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	// first pass allocates blocks and fills caches
+	FileThread *data1 = file->GetFileThread("data1");
+	EXPECT_TRUE(data1->WriteAt(0, &testData[0], testData.size()) == testData.size());
+	EXPECT_TRUE(file->GetFileThreadList().size() == 2);
+	data1->SetPointerTo(10);
+
+	std::vector<char> res(testData.size());
+	uint64_t allocationsBefore = g_numberOfAllocations;
+
+	bool allDone = true;
+	for (uint64_t i = 0; i < 100; i++)
+	{
+		FileThread *thread = file->GetFileThread("data1", 5);
+		allDone = allDone && thread == data1 && strcmp(thread->GetNameRef(), "data1") == 0;
+		allDone = allDone && file->GetFileThreadList()[1] == file->GetFileThread("data2", 5);
+
+		uint64_t offset = i * 4099;
+		allDone = allDone && thread->WriteAt(offset, &testData[offset], 65536) == 65536;
+		allDone = allDone && thread->ReadAt(offset, &res[offset], 65536) == 65536;
+		allDone = allDone && file->GetLastErrorCode() == ErrorCode::None;
+	}
+
+	uint64_t allocations = g_numberOfAllocations - allocationsBefore;
+	EXPECT_TRUE(allDone);
+	EXPECT_TRUE(allocations == 0);
+	EXPECT_TRUE(memcmp(&res[0], &testData[0], 99 * 4099 + 65536) == 0);
+
+	// pointer stays where it was
+	char byte = 0;
+	EXPECT_TRUE(data1->Read(&byte, 1) == 1 && byte == testData[10]);
+	EXPECT_TRUE(data1->ReadAt(testData.size() - 10, &res[0], 100) == 10);
+	EXPECT_TRUE(data1->ReadAt(testData.size(), &res[0], 100) == 0);
+	EXPECT_TRUE(file->GetFileThread("data", 4) == nullptr);
+
+	auto missing = libInstance.OpenFile("c:\\testfile27_missing.dat", OpenMode::ReadOnly);
+	EXPECT_TRUE(missing->GetLastErrorCode() == ErrorCode::IoError && !missing->IsValid());
+
+	// read-write open creates an empty file
+	auto empty = libInstance.OpenFile("c:\\testfile27_empty.dat");
+	EXPECT_TRUE(empty->GetLastErrorCode() == ErrorCode::NotMetafile);
+}
+
+void TestVerify()
+{
+	CreateOptions options;
+	options.defaultProfile = StreamProfile::Fixed(1);
+	options.deduplicate = true;
+
+	std::vector<char> testData(256 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile28.dat", { "a", "b", "c" }, options);
+		ASSERT_TRUE(file->IsValid());
+		EXPECT_TRUE(file->GetFileThread("a")->Write(&testData[0], testData.size()) == testData.size());
+		EXPECT_TRUE(file->GetFileThread("b")->Write(&testData[0], 100 * 1024) == 100 * 1024);
+		EXPECT_TRUE(file->GetFileThread("c")->Write(&testData[1], 5000) == 5000);
+		EXPECT_TRUE(file->CloneFileThread("c", "d") != nullptr);
+		file->GetFileThread("a")->SetSize(200 * 1024);
+
+		VerifyOptions verifyOptions;
+		verifyOptions.readBlocks = true;
+		verifyOptions.numberOfThreads = 4;
+
+		VerifyReport report;
+		EXPECT_TRUE(file->Verify(report, verifyOptions));
+		EXPECT_TRUE(report.problems.empty() && report.scannedSize >= 200 * 1024);
+	}
+
+	// writer stopped after writing blocks, before saving the table
+	FILE *f = fopen("c:\\testfile28.dat", "ab");
+	ASSERT_TRUE(f != nullptr);
+	fwrite(&testData[0], 1, 10000, f);
+	fclose(f);
+
+	// first block of a is shared by b and indexed, its content changes behind the index
+	std::vector<char> image = ReadDiskFile("c:\\testfile28.dat");
+	auto block = std::search(image.begin(), image.end(), testData.begin(), testData.begin() + 4096);
+	ASSERT_TRUE(block != image.end());
+
+	f = fopen("c:\\testfile28.dat", "r+b");
+	ASSERT_TRUE(f != nullptr);
+	fseek(f, (long)(block - image.begin() + 100), SEEK_SET);
+	fwrite("changed", 1, 7, f);
+	fclose(f);
+
+	uint64_t damagedSize = GetDiskFileSize("c:\\testfile28.dat");
+
+	{
+		auto file = libInstance.OpenFile("c:\\testfile28.dat", OpenMode::ReadOnly);
+		ASSERT_TRUE(file->IsValid());
+
+		// table alone does not show changed content
+		VerifyReport report;
+		EXPECT_TRUE(!file->Verify(report));
+		EXPECT_TRUE(report.problems.size() == 1 && report.leakedSize >= 10000);
+
+		VerifyOptions verifyOptions;
+		verifyOptions.readBlocks = true;
+		verifyOptions.repair = true;
+		EXPECT_TRUE(!file->Verify(report, verifyOptions));
+		EXPECT_TRUE(report.problems.size() == 2 && report.numberOfRepaired == 0);
+		EXPECT_TRUE(GetDiskFileSize("c:\\testfile28.dat") == damagedSize);
+	}
+
+	{
+		auto file = libInstance.OpenFile("c:\\testfile28.dat");
+		ASSERT_TRUE(file->IsValid());
+
+		VerifyOptions verifyOptions;
+		verifyOptions.readBlocks = true;
+		verifyOptions.repair = true;
+
+		VerifyReport report;
+		EXPECT_TRUE(file->Verify(report, verifyOptions));
+		EXPECT_TRUE(report.problems.size() == 2 && report.numberOfRepaired == 2);
+		EXPECT_TRUE(GetDiskFileSize("c:\\testfile28.dat") < damagedSize);
+
+		// changed block is not shared any more
+		EXPECT_TRUE(file->GetFileThread("c")->Write(&testData[0], 4096) == 4096);
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile28.dat", OpenMode::ReadOnly);
+	ASSERT_TRUE(file->IsValid());
+
+	VerifyOptions verifyOptions;
+	verifyOptions.readBlocks = true;
+
+	VerifyReport report;
+	EXPECT_TRUE(file->Verify(report, verifyOptions));
+	EXPECT_TRUE(report.problems.empty());
+
+	std::vector<char> res(4096);
+	EXPECT_TRUE(file->GetFileThread("c")->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(memcmp(&res[0], &testData[0], res.size()) == 0);
+}
+
+// reader sees size after writer's flusher saves the table
+static bool WaitForSavedSize(Metafile &reader, FileThread *thread, uint64_t size)
+{
+	for (int i = 0; i < 2000; i++)
+	{
+		if (reader.Refresh() && thread->GetSize() >= size) return true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	return false;
+}
+
+void TestBackgroundFlush()
+{
+	std::vector<char> testData(1024 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	libInstance.CreateNewFile("c:\\testfile29.dat", { "data", "log" });
+
+	auto writer = libInstance.OpenFile("c:\\testfile29.dat", OpenMode::SingleWriter);
+	ASSERT_TRUE(writer->IsValid());
+	FileThread *out = writer->GetFileThread("data");
+
+	auto reader = libInstance.OpenFile("c:\\testfile29.dat", OpenMode::ReadOnly);
+	ASSERT_TRUE(reader->IsValid());
+	EXPECT_TRUE(!reader->StartBackgroundFlush());
+	FileThread *data = reader->GetFileThread("data");
+
+	// writer never flushes itself, table is saved after every 256 kB
+	FlushPolicy policy;
+	policy.intervalMs = 0;
+	policy.dirtyBytes = 256 * 1024;
+	EXPECT_TRUE(writer->StartBackgroundFlush(policy));
+
+	bool written = true;
+	for (int i = 0; i < 16; i++)
+	{
+		written = written && out->Write(&testData[i * 64 * 1024], 64 * 1024) == 64 * 1024;
+	}
+
+	EXPECT_TRUE(written);
+
+	// flusher may take the count before the last writes, less than the limit stays unsaved
+	EXPECT_TRUE(WaitForSavedSize(*reader, data, 1024 * 1024 - policy.dirtyBytes + 64 * 1024));
+
+	// Flush waits until the flusher saved everything written before
+	EXPECT_TRUE(out->Write((void *)"tail", 4) == 4);
+	writer->Flush();
+	EXPECT_TRUE(reader->Refresh());
+	EXPECT_TRUE(data->GetSize() == 1024 * 1024 + 4);
+
+	std::vector<char> res(testData.size());
+	data->SetPointerTo(0);
+	EXPECT_TRUE(data->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(res == testData);
+
+	// saved once writes stop
+	policy.dirtyBytes = 0;
+	policy.idleMs = 10;
+	EXPECT_TRUE(writer->StartBackgroundFlush(policy));
+	EXPECT_TRUE(out->Write((void *)"more", 4) == 4);
+	EXPECT_TRUE(WaitForSavedSize(*reader, data, 1024 * 1024 + 8));
+
+	// appenders go on while table is saved every millisecond
+	policy.idleMs = 0;
+	policy.intervalMs = 1;
+	policy.sync = false;
+	EXPECT_TRUE(writer->StartBackgroundFlush(policy));
+
+	FileThread *log = writer->GetFileThread("log");
+	AppendConcurrently(*writer, log);
+	EXPECT_TRUE(reader->Refresh());
+	EXPECT_TRUE(reader->GetFileThread("log")->GetSize() == log->GetSize());
+
+	writer->StopBackgroundFlush();
+	EXPECT_TRUE(out->Write((void *)"last", 4) == 4);
+	EXPECT_TRUE(reader->Refresh());
+	EXPECT_TRUE(data->GetSize() == 1024 * 1024 + 8);
+
+	// closing saves what flusher did not
+	EXPECT_TRUE(writer->StartBackgroundFlush(FlushPolicy()));
+	EXPECT_TRUE(out->Write((void *)"last", 4) == 4);
+	writer.reset();
+
+	EXPECT_TRUE(reader->Refresh());
+	EXPECT_TRUE(data->GetSize() == 1024 * 1024 + 16);
+}
+
+void TestFlushOrder()
+{
+	std::vector<char> testData(64 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	auto factory = std::make_shared<RecordingFileAccessFactory>();
+	MetafileLib recordingLib(factory);
+	auto file = recordingLib.CreateNewFile("image", { "data" });
+	ASSERT_TRUE(file->IsValid());
+
+	FlushPolicy policy;
+	policy.intervalMs = 0;
+	EXPECT_TRUE(file->StartBackgroundFlush(policy));
+	factory->TakeLog();
+	EXPECT_TRUE(file->GetFileThread("data")->Write(&testData[0], testData.size()) == testData.size());
+	file->Flush();
+
+	// data synced, table written, synced again. table is in the first 4 kB
+	std::vector<AccessRecord> log = factory->TakeLog();
+	int firstSync = -1, firstTable = -1, lastData = -1;
+	for (int i = 0; i < (int)log.size(); i++)
+	{
+		if (log[i].kind == 's' && firstSync < 0) firstSync = i;
+		if (log[i].kind == 'w' && log[i].offset < 4096 && firstTable < 0) firstTable = i;
+		if (log[i].kind == 'w' && log[i].offset >= 4096) lastData = i;
+	}
+
+	EXPECT_TRUE(lastData >= 0 && firstSync > lastData && firstTable > firstSync);
+	EXPECT_TRUE(!log.empty() && log.back().kind == 's');
+	file->StopBackgroundFlush();
+
+	// no sync without the policy
+	policy.sync = false;
+	EXPECT_TRUE(file->StartBackgroundFlush(policy));
+	factory->TakeLog();
+	EXPECT_TRUE(file->GetFileThread("data")->Write(&testData[0], testData.size()) == testData.size());
+	file->Flush();
+
+	log = factory->TakeLog();
+	EXPECT_TRUE(std::none_of(log.begin(), log.end(), [](const AccessRecord &record) { return record.kind == 's'; }));
+}
+
+// counts buffers metafile takes
+class CountingBufferResource : public BufferResource
+{
+public:
+	CountingBufferResource() : numberOfAllocations(0), numberOfDeallocations(0) {}
+
+	virtual void *Allocate(size_t size, size_t alignment) override
+	{
+		numberOfAllocations++;
+		return arena.Allocate(size, alignment);
+	}
+
+	virtual void Deallocate(void *buffer, size_t size, size_t alignment) override
+	{
+		numberOfDeallocations++;
+		arena.Deallocate(buffer, size, alignment);
+	}
+
+	BufferArena arena;
+	std::atomic<uint32_t> numberOfAllocations;
+	std::atomic<uint32_t> numberOfDeallocations;
+};
+
+void TestBufferArena()
+{
+	BufferArena arena;
+
+	// same class is served by the same buffer
+	char *first = (char *)arena.Allocate(5000, 64);
+	ASSERT_TRUE(first != nullptr);
+	EXPECT_TRUE(((uintptr_t)first & 4095) == 0);
+	memset(first, 1, 5000);
+	arena.Deallocate(first, 5000, 64);
+
+	char *second = (char *)arena.Allocate(8192, 1);
+	EXPECT_TRUE(second == first);
+	arena.Deallocate(second, 8192, 1);
+	EXPECT_TRUE(arena.GetNumberOfSystemAllocations() == 1);
+
+	// larger than any class, not kept
+	void *large = arena.Allocate(64 * 1024 * 1024, 16);
+	EXPECT_TRUE(large != nullptr);
+	arena.Deallocate(large, 64 * 1024 * 1024, 16);
+	EXPECT_TRUE(arena.GetNumberOfSystemAllocations() == 2);
+
+	{
+		std::vector<int, BufferAllocator<int> > numbers((BufferAllocator<int>(&arena)));
+		for (int i = 0; i < 10000; i++) numbers.push_back(i);
+		EXPECT_TRUE(numbers[9999] == 9999);
+	}
+
+	// huge pages if system gives them, normal otherwise
+	BufferArena::Options options;
+	options.hugePages = true;
+	BufferArena hugeArena(options);
+
+	char *huge = (char *)hugeArena.Allocate(3 * 1024 * 1024, 4096);
+	ASSERT_TRUE(huge != nullptr);
+	memset(huge, 2, 3 * 1024 * 1024);
+	hugeArena.Deallocate(huge, 3 * 1024 * 1024, 4096);
+	EXPECT_TRUE(hugeArena.Allocate(4 * 1024 * 1024, 1) == huge);
+	hugeArena.Deallocate(huge, 4 * 1024 * 1024, 1);
+
+	std::vector<char> testData(300 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	auto file = libInstance.CreateNewFile("c:\\testfile30.dat", { "a" });
+	ASSERT_TRUE(file->IsValid());
+	EXPECT_TRUE(file->GetBufferResource() != nullptr);
+
+	// copy of a shared block is staged in buffers of the file
+	auto buffers = std::make_shared<CountingBufferResource>();
+	file->SetBufferResource(buffers);
+	EXPECT_TRUE(file->GetBufferResource() == buffers);
+
+	EXPECT_TRUE(file->GetFileThread("a")->Write(&testData[0], testData.size()) == testData.size());
+	FileThread *copy = file->CloneFileThread("a", "b");
+	ASSERT_TRUE(copy != nullptr);
+	EXPECT_TRUE(buffers->numberOfAllocations == 0);
+
+	copy->SetPointerTo(100);
+	EXPECT_TRUE(copy->Write((void *)"changed", 7) == 7);
+	EXPECT_TRUE(buffers->numberOfAllocations != 0);
+	EXPECT_TRUE(buffers->numberOfAllocations == buffers->numberOfDeallocations);
+
+	// buffers of copies are reused
+	uint64_t numberOfSystemAllocations = buffers->arena.GetNumberOfSystemAllocations();
+	FileThread *other = file->CloneFileThread("a", "c");
+	ASSERT_TRUE(other != nullptr);
+	EXPECT_TRUE(other->Write((void *)"changed", 7) == 7);
+	EXPECT_TRUE(buffers->arena.GetNumberOfSystemAllocations() == numberOfSystemAllocations);
+
+	std::vector<char> res(testData.size());
+	copy->SetPointerTo(0);
+	EXPECT_TRUE(copy->Read(&res[0], res.size()) == res.size());
+	EXPECT_TRUE(memcmp(&res[100], "changed", 7) == 0 && memcmp(&res[0], &testData[0], 100) == 0);
+	EXPECT_TRUE(memcmp(&res[107], &testData[107], res.size() - 107) == 0);
+}
+
+// visits stream from offset on, checks pieces follow each other and collects them
+static bool ScanAll(FileThread *thread, uint64_t offset, std::vector<char> &res)
+{
+	bool contiguous = true;
+	uint64_t expected = offset;
+	res.clear();
+
+	uint64_t scanned = thread->Scan(offset, ~0ull, [&](uint64_t pieceOffset, const char *data, size_t size)
+	{
+		contiguous = contiguous && pieceOffset == expected && size != 0;
+		expected += size;
+		res.insert(res.end(), data, data + size);
+		return true;
+	});
+
+	return contiguous && scanned == res.size();
+}
+
+void TestScan()
+{
+	EXPECT_TRUE(UpdateCrc32(0, "123456789", 9) == 0xCBF43926);
+	EXPECT_TRUE(UpdateCrc32(UpdateCrc32(0, "1234", 4), "56789", 5) == 0xCBF43926);
+	EXPECT_TRUE(CountByte("a\nb\n\n", 5, '\n') == 3);
+
+	std::vector<char> testData(2 * 1024 * 1024 + 1000);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = 'a' + rand() / (RAND_MAX / 20 + 1);
+		if (rand() < RAND_MAX / 50) testData[i] = '\n';
+	}
+
+	// pattern which crosses the first block and the 1 mb chunk
+	const char pattern[] = "#pattern#";
+	memcpy(&testData[4096 - 3], pattern, 9);
+	memcpy(&testData[1024 * 1024 - 4], pattern, 9);
+	testData[1500 * 1024] = '$';
+	uint64_t numberOfLines = std::count(testData.begin(), testData.end(), '\n');
+
+	auto factory = std::make_shared<MemoryFileAccessFactory>();
+	MetafileLib memoryLib(factory);
+
+	std::shared_ptr<Metafile> files[] = {
+		libInstance.CreateNewFile("c:\\testfile31.dat", { "data", "sparse" }),
+		memoryLib.CreateNewFile("scan", { "data", "sparse" })
+	};
+
+	for (auto &file : files)
+	{
+		ASSERT_TRUE(file->IsValid());
+		FileThread *data = file->GetFileThread("data");
+		EXPECT_TRUE(data->Write(&testData[0], testData.size()) == testData.size());
+
+		std::vector<char> res;
+		EXPECT_TRUE(ScanAll(data, 0, res) && res == testData);
+		EXPECT_TRUE(ScanAll(data, 12345, res) && res.size() == testData.size() - 12345);
+		EXPECT_TRUE(memcmp(&res[0], &testData[12345], res.size()) == 0);
+
+		// visitor stops the scan
+		uint64_t visited = data->Scan(10, 100, [](uint64_t, const char *, size_t) { return false; });
+		EXPECT_TRUE(visited != 0 && visited <= 100);
+		EXPECT_TRUE(data->Scan(testData.size(), 10, [](uint64_t, const char *, size_t) { return true; }) == 0);
+
+		EXPECT_TRUE(FindByte(*data, 0, '$') == 1500 * 1024);
+		EXPECT_TRUE(FindByte(*data, 1500 * 1024 + 1, '$') == kNotFound);
+		EXPECT_TRUE(FindPattern(*data, 0, pattern, 9) == 4096 - 3);
+		EXPECT_TRUE(FindPattern(*data, 4096, pattern, 9) == 1024 * 1024 - 4);
+		EXPECT_TRUE(FindPattern(*data, 1024 * 1024, pattern, 9) == kNotFound);
+		EXPECT_TRUE(CountLines(*data) == numberOfLines);
+		EXPECT_TRUE(ComputeCrc32(*data) == UpdateCrc32(0, &testData[0], testData.size()));
+		EXPECT_TRUE(ComputeCrc32(*data, 100, 5000) == UpdateCrc32(0, &testData[100], 5000));
+
+		// pointer stays at the end of the write
+		char byte;
+		EXPECT_TRUE(data->Read(&byte, 1) == 0);
+
+		// hole reads as zeros
+		FileThread *sparse = file->GetFileThread("sparse");
+		sparse->SetSize(300 * 1024);
+		sparse->SetPointerTo(200 * 1024);
+		EXPECT_TRUE(sparse->Write((void *)"x", 1) == 1);
+		EXPECT_TRUE(ScanAll(sparse, 0, res) && res.size() == 300 * 1024);
+		EXPECT_TRUE(FindByte(*sparse, 0, 'x') == 200 * 1024);
+		EXPECT_TRUE(std::count(res.begin(), res.end(), 0) == 300 * 1024 - 1);
+	}
+
+	// memory backend hands out its own memory, files are alike
+	bool inPlace = false;
+	std::vector<char> copy(testData.size());
+	files[1]->GetFileThread("data")->Scan(0, 1, [&](uint64_t, const char *data, size_t)
+	{
+		files[1]->GetFileThread("data")->SetPointerTo(0);
+		inPlace = files[1]->GetFileThread("data")->Read(&copy[0], 1) == 1 && data[0] == copy[0];
+		return false;
+	});
+	EXPECT_TRUE(inPlace);
+
+	CreateOptions options;
+	options.smallStreamSize = 256;
+	auto small = libInstance.CreateNewFile("c:\\testfile32.dat", { "a", "b" }, options);
+	ASSERT_TRUE(small->IsValid());
+	EXPECT_TRUE(small->GetFileThread("a")->Write((void *)"first\n", 6) == 6);
+	EXPECT_TRUE(small->GetFileThread("b")->Write((void *)"one\ntwo\n", 8) == 8);
+	EXPECT_TRUE(CountLines(*small->GetFileThread("b")) == 2);
+	EXPECT_TRUE(FindPattern(*small->GetFileThread("b"), 0, "two", 3) == 4);
+}
+
+void TestAllocationZones()
+{
+	CreateOptions options;
+	options.defaultProfile = StreamProfile::Fixed(1);
+
+	std::vector<char> testData(400 * 1024);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	const char *names[] = { "a", "b", "c" };
+
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile33.dat", { "a", "b", "c" }, options);
+		ASSERT_TRUE(file->IsValid());
+
+		// streams grow together, blocks come one by one to each of them
+		bool allWritten = true;
+		for (size_t offset = 0; offset < testData.size(); offset += 4096)
+		{
+			for (auto name : names)
+			{
+				allWritten = allWritten && file->GetFileThread(name)->Write(&testData[offset], 4096) == 4096;
+			}
+
+			if (offset % (100 * 1024) == 0) file->Flush();
+		}
+
+		EXPECT_TRUE(allWritten);
+
+		VerifyReport report;
+		EXPECT_TRUE(file->Verify(report));
+
+		// one piece per block would be 300
+		EXPECT_TRUE(report.numberOfFragments >= 3 && report.numberOfFragments < 60);
+		EXPECT_TRUE(report.leakedSize <= 3 * 100 * 1024);
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile33.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	VerifyReport report;
+	EXPECT_TRUE(file->Verify(report));
+
+	bool same = true;
+	for (auto name : names)
+	{
+		std::vector<char> res(testData.size());
+		same = same && file->GetFileThread(name)->Read(&res[0], res.size()) == res.size() && res == testData;
+	}
+
+	EXPECT_TRUE(same);
+	file.reset();
+
+	// reserved space left between blocks is found again after reopen, sessions don't leak
+	options.defaultProfile = StreamProfile::Fixed(4);
+	libInstance.CreateNewFile("c:\\testfile38.dat", { "a", "b", "c" }, options);
+
+	uint64_t firstLeaked = 0;
+	for (int session = 0; session < 4; session++)
+	{
+		auto file = libInstance.OpenFile("c:\\testfile38.dat");
+		ASSERT_TRUE(file->IsValid());
+
+		for (auto name : names)
+		{
+			FileThread *thread = file->GetFileThread(name);
+			thread->SetPointerTo(thread->GetSize());
+		}
+
+		bool allWritten = true;
+		for (size_t offset = 0; offset < testData.size(); offset += 16 * 1024)
+		{
+			for (auto name : names)
+			{
+				allWritten = allWritten && file->GetFileThread(name)->Write(&testData[offset], 16 * 1024) == 16 * 1024;
+			}
+		}
+
+		EXPECT_TRUE(allWritten);
+		file->Flush();
+
+		VerifyReport report;
+		EXPECT_TRUE(file->Verify(report));
+		if (session == 0) firstLeaked = report.leakedSize;
+		EXPECT_TRUE(report.leakedSize < 2 * firstLeaked);
+	}
+
+	// only the last session's reservations are unused
+	uint64_t written = 4 * 3 * testData.size();
+	EXPECT_TRUE(GetDiskFileSize("c:\\testfile38.dat") <= 4096 + written + 2 * firstLeaked);
+}
+
+void TestSeal()
+{
+	std::vector<char> testData(1024 * 1024 + 5);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	CreateOptions options;
+	options.smallStreamSize = 256;
+	options.profiles["zeta"] = StreamProfile::Fixed(1);
+
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile34.dat", { "zeta", "alpha", "small", "empty" }, options);
+		ASSERT_TRUE(file->IsValid());
+
+		EXPECT_TRUE(file->GetFileThread("zeta")->Write(&testData[0], 300 * 1024) == 300 * 1024);
+		EXPECT_TRUE(file->GetFileThread("alpha")->Write(&testData[0], testData.size()) == testData.size());
+		EXPECT_TRUE(file->GetFileThread("small")->Write(&testData[7], 100) == 100);
+
+		FileThread *clone = file->CloneFileThread("alpha", "beta");
+		ASSERT_TRUE(clone != nullptr);
+		clone->SetPointerTo(10);
+		EXPECT_TRUE(clone->Write((void *)"sealed", 6) == 6);
+
+		EXPECT_TRUE(file->Seal("c:\\testfile35.dat"));
+		EXPECT_TRUE(file->IsValid());
+	}
+
+	// older binaries must not take it for a writable container
+	uint32_t signature;
+	memcpy(&signature, &ReadDiskFile("c:\\testfile35.dat")[0], sizeof(signature));
+	EXPECT_TRUE(signature != 0x12345678 && signature != 0x12345679);
+
+	auto file = libInstance.OpenFile("c:\\testfile35.dat");
+	ASSERT_TRUE(file->IsValid());
+
+	// names come sorted, hidden streams are not copied
+	auto &list = file->GetFileThreadList();
+	ASSERT_TRUE(list.size() == 5);
+	EXPECT_TRUE(strcmp(list[0]->GetNameRef(), "alpha") == 0 && strcmp(list[4]->GetNameRef(), "zeta") == 0);
+	EXPECT_TRUE(file->GetFileThread("beta") == list[1] && file->GetFileThread("small") == list[3]);
+	EXPECT_TRUE(file->GetFileThread("gamma") == nullptr && file->GetFileThread("alph") == nullptr);
+
+	std::vector<char> res(testData.size());
+	EXPECT_TRUE(file->GetFileThread("alpha")->Read(&res[0], res.size()) == res.size() && res == testData);
+	EXPECT_TRUE(file->GetFileThread("zeta")->GetSize() == 300 * 1024);
+	EXPECT_TRUE(file->GetFileThread("zeta")->Read(&res[0], res.size()) == 300 * 1024);
+	EXPECT_TRUE(memcmp(&res[0], &testData[0], 300 * 1024) == 0);
+	EXPECT_TRUE(file->GetFileThread("small")->Read(&res[0], 100) == 100 && memcmp(&res[0], &testData[7], 100) == 0);
+	EXPECT_TRUE(file->GetFileThread("empty")->GetSize() == 0);
+
+	FileThread *beta = file->GetFileThread("beta");
+	EXPECT_TRUE(beta->ReadAt(8, &res[0], 10) == 10 && memcmp(&res[2], "sealed", 6) == 0);
+	EXPECT_TRUE(ComputeCrc32(*beta, 100) == UpdateCrc32(0, &testData[100], testData.size() - 100));
+
+	// one piece per stream, nothing after the last one
+	VerifyReport report;
+	EXPECT_TRUE(file->Verify(report) && report.problems.empty());
+	EXPECT_TRUE(report.numberOfFragments == 4);
+	EXPECT_TRUE(GetDiskFileSize("c:\\testfile35.dat") <= 4096 + 2 * (testData.size() + 4096) + 300 * 1024 + 2 * 4096);
+
+	// immutable
+	EXPECT_TRUE(file->GetFileThread("alpha")->Write(&testData[0], 10) == 0);
+	EXPECT_TRUE(file->CloneFileThread("alpha", "copy") == nullptr);
+
+	// sealed file seals again, memory backend too
+	auto factory = std::make_shared<MemoryFileAccessFactory>();
+	MetafileLib memoryLib(factory);
+	{
+		auto image = memoryLib.CreateNewFile("image", { "b", "a" });
+		ASSERT_TRUE(image->IsValid());
+		EXPECT_TRUE(image->GetFileThread("b")->Write(&testData[0], 5000) == 5000);
+		EXPECT_TRUE(image->Seal("sealed"));
+	}
+
+	auto sealed = memoryLib.OpenFile("sealed");
+	ASSERT_TRUE(sealed->IsValid());
+	EXPECT_TRUE(sealed->GetFileThread("b")->Read(&res[0], res.size()) == 5000 && memcmp(&res[0], &testData[0], 5000) == 0);
+	EXPECT_TRUE(file->Seal("c:\\testfile36.dat"));
+	EXPECT_TRUE(libInstance.OpenFile("c:\\testfile36.dat")->GetFileThreadList().size() == 5);
+}
+
+void TestBeginWrite()
+{
+	std::vector<char> testData(3 * 1024 * 1024 + 7);
+	for (unsigned i = 0; i < testData.size(); i++)
+	{
+		testData[i] = rand();
+	}
+
+	// memory of the stream itself, pieces end at block ends
+	auto factory = std::make_shared<MemoryFileAccessFactory>();
+	MetafileLib memoryLib(factory);
+	auto image = memoryLib.CreateNewFile("image", { "data", "other" });
+	ASSERT_TRUE(image->IsValid());
+
+	FileThread *data = image->GetFileThread("data");
+	uint32_t available;
+	uint64_t written = 0;
+	int pieces = 0;
+	while (written < testData.size())
+	{
+		uint32_t size = (uint32_t)(testData.size() - written);
+		char *buffer = data->BeginWrite(size, available);
+		ASSERT_TRUE(buffer != nullptr && available != 0 && available <= size);
+
+		memcpy(buffer, &testData[(size_t)written], available);
+		EXPECT_TRUE(data->CommitWrite(available));
+		EXPECT_TRUE(data->CommitWrite(0) == false);
+		written += available;
+		pieces++;
+	}
+
+	EXPECT_TRUE(pieces > 1);
+	EXPECT_TRUE(data->GetSize() == testData.size());
+
+	std::vector<char> res(testData.size());
+	data->SetPointerTo(0);
+	EXPECT_TRUE(data->Read(&res[0], res.size()) == res.size() && res == testData);
+
+	// partial commit, the rest is dropped
+	char *buffer = data->BeginWrite(100, available);
+	ASSERT_TRUE(buffer != nullptr && available == 100);
+	memcpy(buffer, "tail", 4);
+	EXPECT_TRUE(data->CommitWrite(101) == false);
+
+	buffer = data->BeginWrite(100, available);
+	ASSERT_TRUE(buffer != nullptr);
+	memcpy(buffer, "tail", 4);
+	EXPECT_TRUE(data->CommitWrite(4));
+	EXPECT_TRUE(data->GetSize() == testData.size() + 4);
+	EXPECT_TRUE(data->ReadAt(testData.size(), &res[0], 10) == 4 && memcmp(&res[0], "tail", 4) == 0);
+
+	// pointer moved in between
+	buffer = data->BeginWrite(100, available);
+	ASSERT_TRUE(buffer != nullptr);
+	data->SetPointerTo(0);
+	EXPECT_TRUE(data->CommitWrite(1) == false);
+
+	// shared block is copied before it is handed out
+	FileThread *clone = image->CloneFileThread("data", "copy");
+	ASSERT_TRUE(clone != nullptr);
+	clone->SetPointerTo(10);
+	buffer = clone->BeginWrite(6, available);
+	ASSERT_TRUE(buffer != nullptr && available == 6);
+	memcpy(buffer, "cloned", 6);
+	EXPECT_TRUE(clone->CommitWrite(6));
+	EXPECT_TRUE(clone->ReadAt(10, &res[0], 6) == 6 && memcmp(&res[0], "cloned", 6) == 0);
+	EXPECT_TRUE(data->ReadAt(10, &res[0], 6) == 6 && memcmp(&res[0], &testData[10], 6) == 0);
+
+	// disk file takes buffer of the stream, one copy on commit
+	{
+		auto file = libInstance.CreateNewFile("c:\\testfile37.dat", { "data" });
+		ASSERT_TRUE(file->IsValid());
+
+		FileThread *stream = file->GetFileThread("data");
+		written = 0;
+		while (written < testData.size())
+		{
+			buffer = stream->BeginWrite((uint32_t)(testData.size() - written), available);
+			ASSERT_TRUE(buffer != nullptr && available != 0);
+			memcpy(buffer, &testData[(size_t)written], available);
+			EXPECT_TRUE(stream->CommitWrite(available));
+			written += available;
+		}
+	}
+
+	auto file = libInstance.OpenFile("c:\\testfile37.dat");
+	ASSERT_TRUE(file->IsValid());
+	EXPECT_TRUE(file->GetFileThread("data")->Read(&res[0], res.size()) == testData.size());
+	EXPECT_TRUE(memcmp(&res[0], &testData[0], testData.size()) == 0);
+
+	// nothing to write into
+	EXPECT_TRUE(file->GetFileThread("data")->BeginWrite(0, available) == nullptr && available == 0);
+	EXPECT_TRUE(file->GetFileThread("data")->CommitWrite(0) == false);
+}
+
 void WriteBigFile()
 {
 	auto file = libInstance.CreateNewFile("c:\\testfile4.dat", { "data1", "data2", "data3" });
@@ -392,6 +2767,66 @@ int main()
 	TestDisbalance();
 	printf("--------- TestDelete -------\n");
 	TestDelete();
+	printf("--------- TestExportTo -------\n");
+	TestExportTo();
+	printf("--------- TestDirectFileAccess -------\n");
+	TestDirectFileAccess();
+	printf("--------- TestMemoryFileAccess -------\n");
+	TestMemoryFileAccess();
+	printf("--------- TestOverlay -------\n");
+	TestOverlay();
+	printf("--------- TestCloneAndSnapshot -------\n");
+	TestCloneAndSnapshot();
+	printf("--------- TestStripedFileAccess -------\n");
+	TestStripedFileAccess();
+	printf("--------- TestReserve -------\n");
+	TestReserve();
+	printf("--------- TestStreambuf -------\n");
+	TestStreambuf();
+	printf("--------- TestAsync -------\n");
+	TestAsync();
+	printf("--------- TestReadMany -------\n");
+	TestReadMany();
+	printf("--------- TestStreamProfiles -------\n");
+	TestStreamProfiles();
+	printf("--------- TestSmallStreams -------\n");
+	TestSmallStreams();
+	printf("--------- TestFormatVersions -------\n");
+	TestFormatVersions();
+	printf("--------- TestReadOnly -------\n");
+	TestReadOnly();
+	printf("--------- TestSingleWriter -------\n");
+	TestSingleWriter();
+	printf("--------- TestSingleWriterOrder -------\n");
+	TestSingleWriterOrder();
+	printf("--------- TestSnapshotCost -------\n");
+	TestSnapshotCost();
+	printf("--------- TestAsyncCancel -------\n");
+	TestAsyncCancel();
+	printf("--------- TestOverlayBase -------\n");
+	TestOverlayBase();
+	printf("--------- TestConcurrentAppend -------\n");
+	TestConcurrentAppend();
+	printf("--------- TestDedup -------\n");
+	TestDedup();
+	printf("--------- TestNoAllocations -------\n");
+	TestNoAllocations();
+	printf("--------- TestVerify -------\n");
+	TestVerify();
+	printf("--------- TestBackgroundFlush -------\n");
+	TestBackgroundFlush();
+	printf("--------- TestFlushOrder -------\n");
+	TestFlushOrder();
+	printf("--------- TestBufferArena -------\n");
+	TestBufferArena();
+	printf("--------- TestScan -------\n");
+	TestScan();
+	printf("--------- TestAllocationZones -------\n");
+	TestAllocationZones();
+	printf("--------- TestSeal -------\n");
+	TestSeal();
+	printf("--------- TestBeginWrite -------\n");
+	TestBeginWrite();
 
 //	WriteBigFile();
 
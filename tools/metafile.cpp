@@ -0,0 +1,809 @@
+/* Copyright (C) 2015, Vadym Ianushkevych ( vadik.ya@gmail.com )
+ * All Rights Reserved.
+ * You may use, distribute and modify this code under the terms
+ * of the Simplified BSD License. You should have received a copy
+ * of the Simplified BSD License with this file. If not, see
+ * http://opensource.org/licenses/BSD-2-Clause
+*/
+
+// command line front end:
+//   metafile pack [-j threads] <container> <directory>
+//   metafile unpack [-j threads] <container> <directory>
+//   metafile ls <container>
+//   metafile cat <container> <stream>
+//   metafile upgrade <container>
+//   metafile fsck [-j threads] [--repair] [--quick] <container>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "metafile/metafilelib.h"
+#include "layout.h"
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+using namespace metafile;
+
+// files larger than this are not loaded into memory at once
+static const uint64_t kLargeFileSize = 64 * 1024 * 1024;
+static const uint32_t kCopyChunkSize = 8 * 1024 * 1024;
+
+// read ahead limits of pack and write behind limits of unpack
+static const uint64_t kMaxBytesInFlight = 256 * 1024 * 1024;
+static const size_t kMaxFilesInFlight = 4096;
+
+struct SourceFile
+{
+	std::string name;	// stream name, relative path with '/'
+	std::string path;
+	uint64_t size;
+};
+
+static bool ListFiles(const std::string &root, const std::string &prefix,
+	std::vector<SourceFile> &files, std::string &error)
+{
+#ifdef _WIN32
+	WIN32_FIND_DATAA data;
+	std::string directory = root + "\\" + prefix;
+	HANDLE h = FindFirstFileA((directory + "*").c_str(), &data);
+	if (h == INVALID_HANDLE_VALUE)
+	{
+		error = "Can not read directory " + directory;
+		return false;
+	}
+
+	bool res = true;
+	do
+	{
+		std::string name = data.cFileName;
+		if (name == "." || name == "..") continue;
+
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+		{
+			res = ListFiles(root, prefix + name + "/", files, error);
+			continue;
+		}
+
+		SourceFile file;
+		file.name = prefix + name;
+		file.path = root + "/" + file.name;
+		file.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		files.push_back(file);
+	} while (res && FindNextFileA(h, &data));
+
+	FindClose(h);
+	return res;
+#else
+	std::string directory = root + "/" + prefix;
+	DIR *dir = opendir(directory.c_str());
+	if (!dir)
+	{
+		error = "Can not read directory " + directory;
+		return false;
+	}
+
+	bool res = true;
+	while (res)
+	{
+		struct dirent *entry = readdir(dir);
+		if (!entry) break;
+
+		std::string name = entry->d_name;
+		if (name == "." || name == "..") continue;
+
+		struct stat info;
+		if (stat((directory + name).c_str(), &info) != 0)
+		{
+			error = "Can not stat " + directory + name;
+			res = false;
+			break;
+		}
+
+		if (S_ISDIR(info.st_mode))
+		{
+			res = ListFiles(root, prefix + name + "/", files, error);
+			continue;
+		}
+
+		if (!S_ISREG(info.st_mode)) continue;
+
+		SourceFile file;
+		file.name = prefix + name;
+		file.path = directory + name;
+		file.size = info.st_size;
+		files.push_back(file);
+	}
+
+	closedir(dir);
+	return res;
+#endif
+}
+
+static bool MakeDirectory(const std::string &path)
+{
+#ifdef _WIN32
+	return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+	return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+// creates every missing directory on the way to file
+static bool MakeParentDirectories(const std::string &root, const std::string &name, std::set<std::string> &created)
+{
+	for (size_t pos = name.find('/'); pos != std::string::npos; pos = name.find('/', pos + 1))
+	{
+		std::string directory = name.substr(0, pos);
+		if (created.count(directory)) continue;
+
+		if (!MakeDirectory(root + "/" + directory)) return false;
+		created.insert(directory);
+	}
+
+	return true;
+}
+
+static int OpenForWrite(const std::string &path)
+{
+#ifdef _WIN32
+	return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+	return open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+}
+
+static void CloseDescriptor(int fd)
+{
+#ifdef _WIN32
+	_close(fd);
+#else
+	close(fd);
+#endif
+}
+
+static bool ReadWholeFile(const std::string &path, std::vector<char> &data, uint64_t size)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) return false;
+
+	// one fread of the whole file, stdio buffer would only add a copy
+	setvbuf(f, nullptr, _IONBF, 0);
+
+	data.resize((size_t)size);
+	bool res = size == 0 || fread(&data[0], 1, (size_t)size, f) == size;
+	fclose(f);
+	return res;
+}
+
+static bool WriteWholeFile(const std::string &path, const std::vector<char> &data)
+{
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f) return false;
+
+	setvbuf(f, nullptr, _IONBF, 0);
+
+	bool res = data.empty() || fwrite(&data[0], 1, data.size(), f) == data.size();
+	res = fclose(f) == 0 && res;
+	return res;
+}
+
+static void PrintStats(const char *action, uint64_t files, uint64_t bytes,
+	std::chrono::steady_clock::time_point start)
+{
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (seconds <= 0) seconds = 1e-9;
+
+	double megabytes = bytes / (1024.0 * 1024.0);
+	printf("%s %llu files, %.1f MB in %.2f s: %.0f files/s, %.1f MB/s\n", action,
+		(unsigned long long)files, megabytes, seconds, files / seconds, megabytes / seconds);
+}
+
+// source files are read by a pool of threads ahead of the writer,
+// container is written by one thread in stream order
+class PackReader
+{
+public:
+	struct Slot
+	{
+		std::vector<char> data;
+		bool ready;
+		bool failed;
+
+		Slot() : ready(false), failed(false) {}
+	};
+
+	PackReader(const std::vector<SourceFile> &files, uint32_t numberOfThreads)
+		: m_files(files)
+		, m_slots(files.size())
+		, m_next(0)
+		, m_consumed(0)
+		, m_bytesInFlight(0)
+		, m_stop(false)
+	{
+		for (uint32_t i = 0; i < numberOfThreads; i++)
+		{
+			m_threads.push_back(std::thread(&PackReader::Run, this));
+		}
+	}
+
+	~PackReader()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_stop = true;
+		}
+
+		m_changed.notify_all();
+		for (auto &thread : m_threads) thread.join();
+	}
+
+	// waits for file i, files must be taken in order.
+	// large files are left to the caller and come back empty
+	bool Take(size_t i, std::vector<char> &data)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		m_changed.wait(lock, [this, i] { return m_slots[i].ready; });
+
+		data.swap(m_slots[i].data);
+		if (m_files[i].size <= kLargeFileSize) m_bytesInFlight -= m_files[i].size;
+		m_consumed = i + 1;
+
+		bool res = !m_slots[i].failed;
+		lock.unlock();
+		m_changed.notify_all();
+		return res;
+	}
+
+private:
+	void Run()
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		while (true)
+		{
+			m_changed.wait(lock, [this]
+			{
+				return m_stop || m_next == m_files.size() ||
+					(m_next < m_consumed + kMaxFilesInFlight && m_bytesInFlight < kMaxBytesInFlight);
+			});
+
+			if (m_stop || m_next == m_files.size()) return;
+
+			size_t i = m_next++;
+			const SourceFile &file = m_files[i];
+			bool large = file.size > kLargeFileSize;
+			if (!large) m_bytesInFlight += file.size;
+
+			lock.unlock();
+			std::vector<char> data;
+			bool res = large || ReadWholeFile(file.path, data, file.size);
+			lock.lock();
+
+			m_slots[i].data.swap(data);
+			m_slots[i].failed = !res;
+			m_slots[i].ready = true;
+			m_changed.notify_all();
+		}
+	}
+
+	const std::vector<SourceFile> &m_files;
+	std::vector<Slot> m_slots;
+	std::vector<std::thread> m_threads;
+	std::mutex m_lock;
+	std::condition_variable m_changed;
+	size_t m_next;
+	size_t m_consumed;
+	uint64_t m_bytesInFlight;
+	bool m_stop;
+};
+
+static bool CopyLargeFile(const SourceFile &file, FileThread *thread)
+{
+	FILE *f = fopen(file.path.c_str(), "rb");
+	if (!f) return false;
+
+	setvbuf(f, nullptr, _IONBF, 0);
+
+	std::vector<char> buffer(kCopyChunkSize);
+	uint64_t copied = 0;
+
+	while (copied < file.size)
+	{
+		uint32_t size = (uint32_t)std::min((uint64_t)kCopyChunkSize, file.size - copied);
+		if (fread(&buffer[0], 1, size, f) != size || thread->Write(&buffer[0], size) != size) break;
+		copied += size;
+	}
+
+	fclose(f);
+	return copied == file.size;
+}
+
+static int Pack(const std::string &container, const std::string &directory, uint32_t numberOfThreads)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	std::vector<SourceFile> files;
+	std::string error;
+	if (!ListFiles(directory, "", files, error))
+	{
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	std::sort(files.begin(), files.end(), [](const SourceFile &a, const SourceFile &b) { return a.name < b.name; });
+
+	if (files.size() > MetafileHeader::kMaxNumberOfThreads)
+	{
+		fprintf(stderr, "%u files found, container holds at most %u\n", (unsigned)files.size(), MetafileHeader::kMaxNumberOfThreads);
+		return 1;
+	}
+
+	std::vector<std::string> names;
+	uint64_t totalSize = 0;
+	for (auto &file : files)
+	{
+		if (file.name.size() >= sizeof(FileThreadInfo::name))
+		{
+			fprintf(stderr, "Name is too long: %s\n", file.name.c_str());
+			return 1;
+		}
+
+		names.push_back(file.name);
+		totalSize += file.size;
+	}
+
+	MetafileLib lib;
+	auto metafile = lib.CreateNewFile(container, names);
+	if (!metafile->IsValid())
+	{
+		fprintf(stderr, "%s\n", metafile->GetLastError().c_str());
+		return 1;
+	}
+
+	// sizes are known in advance, so each stream gets one contiguous run of blocks
+	// and the container is written front to back without seeking around
+	std::vector<FileThread *> threads = metafile->GetAllFileThreads();
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		threads[i]->Reserve(files[i].size);
+	}
+
+	PackReader reader(files, numberOfThreads);
+	std::vector<char> data;
+
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		bool res = reader.Take(i, data);
+		if (res && files[i].size > kLargeFileSize) res = CopyLargeFile(files[i], threads[i]);
+		else if (res && !data.empty()) res = threads[i]->Write(&data[0], (uint32_t)data.size()) == data.size();
+
+		if (!res)
+		{
+			std::string message = metafile->GetLastError();
+			fprintf(stderr, "Can not pack %s %s\n", files[i].path.c_str(), message.c_str());
+			return 1;
+		}
+	}
+
+	metafile->Flush();
+	if (!metafile->IsValid())
+	{
+		fprintf(stderr, "%s\n", metafile->GetLastError().c_str());
+		return 1;
+	}
+
+	PrintStats("packed", files.size(), totalSize, start);
+	return 0;
+}
+
+// files are written by a pool of threads while container is read by one thread in stream order
+class UnpackWriter
+{
+public:
+	UnpackWriter(uint32_t numberOfThreads)
+		: m_bytesInFlight(0)
+		, m_done(false)
+	{
+		for (uint32_t i = 0; i < numberOfThreads; i++)
+		{
+			m_threads.push_back(std::thread(&UnpackWriter::Run, this));
+		}
+	}
+
+	~UnpackWriter()
+	{
+		Finish();
+	}
+
+	void Post(const std::string &path, std::vector<char> &data)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		m_changed.wait(lock, [this]
+		{
+			return m_queue.size() < kMaxFilesInFlight && m_bytesInFlight < kMaxBytesInFlight;
+		});
+
+		m_queue.push_back(Item());
+		m_queue.back().path = path;
+		m_queue.back().data.swap(data);
+		m_bytesInFlight += m_queue.back().data.size();
+
+		lock.unlock();
+		m_changed.notify_all();
+	}
+
+	// waits for all posted files, returns first error
+	std::string Finish()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+			m_done = true;
+		}
+
+		m_changed.notify_all();
+		for (auto &thread : m_threads) thread.join();
+		m_threads.clear();
+
+		return m_error;
+	}
+
+private:
+	struct Item
+	{
+		std::string path;
+		std::vector<char> data;
+	};
+
+	void Run()
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+
+		while (true)
+		{
+			m_changed.wait(lock, [this] { return m_done || !m_queue.empty(); });
+			if (m_queue.empty()) return;
+
+			Item item;
+			item.path.swap(m_queue.front().path);
+			item.data.swap(m_queue.front().data);
+			m_queue.pop_front();
+
+			lock.unlock();
+			m_changed.notify_all();
+			bool res = WriteWholeFile(item.path, item.data);
+			lock.lock();
+
+			m_bytesInFlight -= item.data.size();
+			if (!res && m_error.empty()) m_error = "Can not write " + item.path;
+			m_changed.notify_all();
+		}
+	}
+
+	std::vector<std::thread> m_threads;
+	std::deque<Item> m_queue;
+	std::mutex m_lock;
+	std::condition_variable m_changed;
+	uint64_t m_bytesInFlight;
+	bool m_done;
+	std::string m_error;
+};
+
+// stream names come from the container, they must stay inside the target directory.
+// windows takes '\\' for a separator too, and "c:" for a drive
+static bool IsSafeName(const std::string &name)
+{
+	if (name.find('\\') != std::string::npos || name.find(':') != std::string::npos) return false;
+
+	size_t start = 0;
+	while (true)
+	{
+		size_t end = name.find('/', start);
+		std::string part = name.substr(start, end == std::string::npos ? std::string::npos : end - start);
+		if (part.empty() || part == "." || part == "..") return false;
+
+		if (end == std::string::npos) return true;
+		start = end + 1;
+	}
+}
+
+static std::shared_ptr<Metafile> OpenContainer(MetafileLib &lib, const std::string &container,
+	OpenMode mode = OpenMode::ReadOnly)
+{
+	auto metafile = lib.OpenFile(container, mode);
+	if (!metafile->IsValid())
+	{
+		fprintf(stderr, "%s\n", metafile->GetLastError().c_str());
+		return nullptr;
+	}
+
+	return metafile;
+}
+
+static int Unpack(const std::string &container, const std::string &directory, uint32_t numberOfThreads)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	MetafileLib lib;
+	auto metafile = OpenContainer(lib, container);
+	if (!metafile) return 1;
+
+	if (!MakeDirectory(directory))
+	{
+		fprintf(stderr, "Can not create directory %s\n", directory.c_str());
+		return 1;
+	}
+
+	std::vector<FileThread *> threads = metafile->GetAllFileThreads();
+	std::set<std::string> createdDirectories;
+	uint64_t totalSize = 0;
+
+	UnpackWriter writer(numberOfThreads);
+
+	// small streams are read in batches by ReadMany, it merges close pieces into large reads
+	std::vector<ReadRequest> batch;
+	std::vector<std::vector<char>> batchData;
+	std::vector<std::string> batchPaths;
+	uint64_t batchSize = 0;
+
+	auto readBatch = [&]() -> bool
+	{
+		// buffers are settled now, vectors may have moved while the batch grew
+		for (size_t i = 0; i < batch.size(); i++) batch[i].data = batchData[i].data();
+
+		bool res = batch.empty() || metafile->ReadMany(batch, numberOfThreads);
+		for (size_t i = 0; res && i < batch.size(); i++)
+		{
+			if (batch[i].bytesRead != batch[i].size) res = false;
+			else writer.Post(batchPaths[i], batchData[i]);
+		}
+
+		if (!res) fprintf(stderr, "Can not read %s %s\n", container.c_str(), metafile->GetLastError().c_str());
+
+		batch.clear();
+		batchData.clear();
+		batchPaths.clear();
+		batchSize = 0;
+		return res;
+	};
+
+	// streams are read in the order they were packed, which is the order on disk
+	for (auto thread : threads)
+	{
+		std::string name = thread->GetName();
+		std::string path = directory + "/" + name;
+		uint64_t size = thread->GetSize();
+
+		if (!IsSafeName(name) || !MakeParentDirectories(directory, name, createdDirectories))
+		{
+			fprintf(stderr, "Can not create %s\n", path.c_str());
+			return 1;
+		}
+
+		totalSize += size;
+
+		if (size > kLargeFileSize)
+		{
+			if (!readBatch()) return 1;
+
+			int fd = OpenForWrite(path);
+			bool res = fd >= 0 && thread->ExportTo(fd, 0, size) == size;
+			if (fd >= 0) CloseDescriptor(fd);
+
+			if (!res)
+			{
+				fprintf(stderr, "Can not write %s\n", path.c_str());
+				return 1;
+			}
+
+			continue;
+		}
+
+		// batch holds at most what writer may have in flight
+		if (batchSize + size > kMaxBytesInFlight / 2 || batch.size() == kMaxFilesInFlight / 2)
+		{
+			if (!readBatch()) return 1;
+		}
+
+		ReadRequest request = { thread, nullptr, size, 0 };
+		batch.push_back(request);
+		batchData.push_back(std::vector<char>((size_t)size));
+		batchPaths.push_back(path);
+		batchSize += size;
+	}
+
+	if (!readBatch()) return 1;
+
+	std::string error = writer.Finish();
+	if (!error.empty())
+	{
+		fprintf(stderr, "%s\n", error.c_str());
+		return 1;
+	}
+
+	PrintStats("unpacked", threads.size(), totalSize, start);
+	return 0;
+}
+
+static int List(const std::string &container)
+{
+	MetafileLib lib;
+	auto metafile = OpenContainer(lib, container);
+	if (!metafile) return 1;
+
+	uint64_t totalSize = 0;
+	std::vector<FileThread *> threads = metafile->GetAllFileThreads();
+	for (auto thread : threads)
+	{
+		printf("%12llu %s\n", (unsigned long long)thread->GetSize(), thread->GetName().c_str());
+		totalSize += thread->GetSize();
+	}
+
+	printf("%12llu total in %u streams\n", (unsigned long long)totalSize, (unsigned)threads.size());
+	return 0;
+}
+
+static int Cat(const std::string &container, const std::string &name)
+{
+	MetafileLib lib;
+	auto metafile = OpenContainer(lib, container);
+	if (!metafile) return 1;
+
+	FileThread *thread = metafile->GetFileThread(name);
+	if (!thread)
+	{
+		fprintf(stderr, "No stream %s\n", name.c_str());
+		return 1;
+	}
+
+	fflush(stdout);
+#ifdef _WIN32
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	uint64_t size = thread->GetSize();
+	if (thread->ExportTo(fileno(stdout), 0, size) != size)
+	{
+		fprintf(stderr, "Write error\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int Upgrade(const std::string &container)
+{
+	MetafileLib lib;
+	auto metafile = OpenContainer(lib, container, OpenMode::ReadWrite);
+	if (!metafile) return 1;
+
+	if (!metafile->UpgradeFormat())
+	{
+		fprintf(stderr, "Can not upgrade %s: %s\n", container.c_str(), metafile->GetLastError().c_str());
+		return 1;
+	}
+
+	return 0;
+}
+
+static int Seal(const std::string &container, const std::string &output)
+{
+	MetafileLib lib;
+	auto metafile = OpenContainer(lib, container, OpenMode::ReadOnly);
+	if (!metafile) return 1;
+
+	if (!metafile->Seal(output))
+	{
+		fprintf(stderr, "Can not seal %s: %s\n", container.c_str(), metafile->GetLastError().c_str());
+		return 1;
+	}
+
+	return 0;
+}
+
+// exit codes follow fsck: 0 - sound, 1 - problems repaired, 4 - problems left
+static int Fsck(const std::string &container, uint32_t numberOfThreads, bool repair, bool quick)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	MetafileLib lib;
+	auto metafile = OpenContainer(lib, container, repair ? OpenMode::SingleWriter : OpenMode::ReadOnly);
+	if (!metafile) return 4;
+
+	VerifyOptions options;
+	options.readBlocks = !quick;
+	options.numberOfThreads = numberOfThreads;
+	options.repair = repair;
+
+	VerifyReport report;
+	bool sound = metafile->Verify(report, options);
+
+	for (auto &problem : report.problems)
+	{
+		printf("%s\n", problem.c_str());
+	}
+
+	if (report.leakedSize != 0) printf("%llu bytes are not used by any block\n", (unsigned long long)report.leakedSize);
+	printf("streams are in %llu pieces\n", (unsigned long long)report.numberOfFragments);
+	if (!quick) PrintStats("checked", metafile->GetFileThreadList().size(), report.scannedSize, start);
+
+	if (!sound) return 4;
+	return report.problems.empty() ? 0 : 1;
+}
+
+static int Usage()
+{
+	fprintf(stderr,
+		"usage: metafile pack [-j threads] <container> <directory>\n"
+		"       metafile unpack [-j threads] <container> <directory>\n"
+		"       metafile ls <container>\n"
+		"       metafile cat <container> <stream>\n"
+		"       metafile upgrade <container>\n"
+		"       metafile seal <container> <output>\n"
+		"       metafile fsck [-j threads] [--repair] [--quick] <container>\n");
+	return 2;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) return Usage();
+
+	std::string command = argv[1];
+	std::vector<std::string> args;
+	uint32_t numberOfThreads = std::max(1u, std::thread::hardware_concurrency());
+	bool repair = false;
+	bool quick = false;
+
+	for (int i = 2; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+		{
+			numberOfThreads = std::max(1, atoi(argv[++i]));
+			continue;
+		}
+
+		if (command == "fsck" && strcmp(argv[i], "--repair") == 0)
+		{
+			repair = true;
+			continue;
+		}
+
+		if (command == "fsck" && strcmp(argv[i], "--quick") == 0)
+		{
+			quick = true;
+			continue;
+		}
+
+		args.push_back(argv[i]);
+	}
+
+	if (command == "pack" && args.size() == 2) return Pack(args[0], args[1], numberOfThreads);
+	if (command == "unpack" && args.size() == 2) return Unpack(args[0], args[1], numberOfThreads);
+	if (command == "ls" && args.size() == 1) return List(args[0]);
+	if (command == "cat" && args.size() == 2) return Cat(args[0], args[1]);
+	if (command == "upgrade" && args.size() == 1) return Upgrade(args[0]);
+	if (command == "seal" && args.size() == 2) return Seal(args[0], args[1]);
+	if (command == "fsck" && args.size() == 1) return Fsck(args[0], numberOfThreads, repair, quick);
+
+	return Usage();
+}